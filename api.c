@@ -37,9 +37,6 @@
 
 #define HAVE_AN_FPGA 1
 
-// Max amount of data to buffer before sending on the socket
-#define RPC_SOCKBUFSIZ     0x10000
-
 // BUFSIZ varies on Windows and Linux
 #define TMPBUFSIZ	8192
 
@@ -136,6 +133,7 @@ static const char *OSINFO =
 #define _MINECOIN	"COIN"
 #define _DEBUGSET	"DEBUG"
 #define _SETCONFIG	"SETCONFIG"
+#define _LATENCY	"LATENCY"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -175,6 +173,7 @@ static const char ISJSON = '{';
 #define JSON_MINECOIN	JSON1 _MINECOIN JSON2
 #define JSON_DEBUGSET	JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
+#define JSON_LATENCY	JSON1 _LATENCY JSON2
 #define JSON_END	JSON4 JSON5
 #define JSON_END_TRUNCATED	JSON4_TRUNCATED JSON5
 #define JSON_BETWEEN_JOIN	","
@@ -307,6 +306,7 @@ static const char *JSON_PARAMETER = "parameter";
 
 #define MSG_INVNEG 121
 #define MSG_SETQUOTA 122
+#define MSG_LATENCY 123
 
 #define USE_ALTMSG 0x4000
 
@@ -460,6 +460,7 @@ struct CODES {
  { SEVERITY_ERR,   MSG_INVNUM,	PARAM_BOTH,	"Invalid number (%d) for '%s' range is 0-9999" },
  { SEVERITY_ERR,   MSG_INVNEG,	PARAM_BOTH,	"Invalid negative number (%d) for '%s'" },
  { SEVERITY_SUCC,  MSG_SETQUOTA,PARAM_SET,	"Set pool '%s' to quota %d'" },
+ { SEVERITY_SUCC,  MSG_LATENCY,	PARAM_NONE,	"BFGMiner latency" },
  { SEVERITY_ERR,   MSG_CONPAR,	PARAM_NONE,	"Missing config parameters 'name,N'" },
  { SEVERITY_ERR,   MSG_CONVAL,	PARAM_STR,	"Missing config value N for '%s,N'" },
 #ifdef HAVE_AN_FPGA
@@ -484,6 +485,36 @@ static const char *localaddr = "127.0.0.1";
 static int my_thr_id = 0;
 static bool bye;
 
+// Commands run one at a time, but clients are read from and replied to by
+// opt_api_threads worker threads, so a slow client only holds up its own
+static pthread_mutex_t api_cmd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct api_conn {
+	SOCKETTYPE sock;
+	char connectaddr[16];
+	char group;
+	struct api_conn *next;
+};
+
+static struct api_conn *api_conn_queue;
+static pthread_mutex_t api_conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t api_conn_cond = PTHREAD_COND_INITIALIZER;
+
+// Replies to read-only requests are reused for opt_api_cache ms, so pollers
+// asking the same thing don't each walk every device and pool
+#define API_MAX_CACHED_REPLIES  0x100
+
+struct api_reply {
+	// Access group followed by the request exactly as received
+	char *request;
+	bytes_t reply;
+	struct timeval tv_created;
+	UT_hash_handle hh;
+};
+
+static struct api_reply *api_replies;
+static pthread_mutex_t api_replies_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // Used to control quit restart access to shutdown variables
 static pthread_mutex_t quit_restart_lock;
 
@@ -522,13 +553,16 @@ struct io_data {
 	
 	// Whether to add various things
 	bool close;
+	
+	// Whether the reply may be reused for the same request
+	bool cacheable;
 };
-static struct io_data *rpc_io_data;
 
 static void io_reinit(struct io_data *io_data)
 {
 	bytes_reset(&io_data->data);
 	io_data->close = false;
+	io_data->cacheable = true;
 }
 
 static
@@ -588,11 +622,10 @@ size_t io_flush(struct io_data *io_data, bool complete)
 	return sent;
 }
 
+// Replies are only sent once complete, outside of api_cmd_lock
 static bool io_add(struct io_data *io_data, char *buf)
 {
 	size_t len = strlen(buf);
-	if (bytes_len(&io_data->data) + len > RPC_SOCKBUFSIZ)
-		io_flush(io_data, false);
 	bytes_append(&io_data->data, buf, len);
 	return true;
 }
@@ -602,13 +635,6 @@ static void io_close(struct io_data *io_data)
 	io_data->close = true;
 }
 
-static void io_free()
-{
-	bytes_free(&rpc_io_data->data);
-	free(rpc_io_data);
-	rpc_io_data = NULL;
-}
-
 // This is only called when expected to be needed (rarely)
 // i.e. strings outside of the codes control (input from the user)
 static char *escape_string(char *str, bool isjson)
@@ -2938,6 +2964,8 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 	root = api_add_timeval(root, "Wait", &(stats->getwork_wait), false);
 	root = api_add_timeval(root, "Max", &(stats->getwork_wait_max), false);
 	root = api_add_timeval(root, "Min", &(stats->getwork_wait_min), false);
+	root = api_add_uint32(root, "Cached", &(stats->getwork_cached), false);
+	root = api_add_uint32(root, "Stolen", &(stats->getwork_stolen), false);
 
 	if (pool_stats) {
 		root = api_add_uint32(root, "Pool Calls", &(pool_stats->getwork_calls), false);
@@ -2972,6 +3000,28 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 	return ++i;
 }
 
+static int itemworkallocstats(struct io_data *io_data, int i, bool isjson)
+{
+	struct api_data *root = NULL;
+	struct work_alloc_stats stats;
+	char buf[TMPBUFSIZ];
+
+	get_work_alloc_stats(&stats);
+
+	root = api_add_int(root, "STATS", &i, false);
+	root = api_add_const(root, "ID", "WORK", false);
+	root = api_add_uint64(root, "Work Allocs", &stats.allocs, true);
+	root = api_add_uint64(root, "Work Frees", &stats.frees, true);
+	root = api_add_uint64(root, "Work Cache Refills", &stats.refills, true);
+	root = api_add_uint64(root, "Work Slabs", &stats.slabs, true);
+	root = api_add_uint64(root, "Submit Copies Avoided", &stats.copies_avoided, true);
+
+	root = print_data(root, buf, isjson, isjson && (i > 0));
+	io_add(io_data, buf);
+
+	return ++i;
+}
+
 static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct cgpu_info *cgpu;
@@ -3006,6 +3056,98 @@ static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		i = itemstats(io_data, i, id, &(pool->cgminer_stats), &(pool->cgminer_pool_stats), NULL, isjson);
 	}
 
+	i = itemworkallocstats(io_data, i, isjson);
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
+// Latencies are reported in milliseconds
+static struct api_data *api_add_latency(struct api_data *root, const char *name, const struct latency_hist *hist)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9 };
+	char buf[40];
+	double ms;
+	int i;
+
+	sprintf(buf, "%s Count", name);
+	root = api_add_uint32(root, buf, (uint32_t *)&hist->count, true);
+	ms = hist->count ? (hist->total_us / 1e3 / hist->count) : 0;
+	sprintf(buf, "%s Avg", name);
+	root = api_add_double(root, buf, &ms, true);
+	for (i = 0; i < 4; ++i) {
+		ms = latency_hist_percentile(hist, pcts[i]) / 1e3;
+		sprintf(buf, "%s P%g", name, pcts[i]);
+		root = api_add_double(root, buf, &ms, true);
+	}
+	ms = hist->max_us / 1e3;
+	sprintf(buf, "%s Max", name);
+	root = api_add_double(root, buf, &ms, true);
+
+	return root;
+}
+
+static int itemlatency(struct io_data *io_data, int i, char *id, const char *getwork_name, struct latency_hist *getwork, struct latency_hist *staged, struct latency_hist *found_submit, struct latency_hist *submit, int *stale, double *diff_accepted, double *diff_rejected, double *diff_stale, bool isjson)
+{
+	struct api_data *root = NULL;
+	char buf[TMPBUFSIZ];
+	struct latency_hist hists[4];
+	int stales;
+	double diffs, stalep;
+
+	// Copy out under the lock, so each histogram is consistent with its count
+	mutex_lock(&stats_lock);
+	hists[0] = *getwork;
+	hists[1] = *staged;
+	hists[2] = *found_submit;
+	hists[3] = *submit;
+	stales = *stale;
+	diffs = *diff_accepted + *diff_rejected + *diff_stale;
+	stalep = diffs ? (*diff_stale / diffs) : 0;
+	mutex_unlock(&stats_lock);
+
+	root = api_add_int(root, "LATENCY", &i, false);
+	root = api_add_string(root, "ID", id, false);
+	root = api_add_latency(root, getwork_name, &hists[0]);
+	root = api_add_latency(root, "Staged", &hists[1]);
+	root = api_add_latency(root, "Found To Submit", &hists[2]);
+	root = api_add_latency(root, "Submit", &hists[3]);
+	root = api_add_int(root, "Stale", &stales, true);
+	root = api_add_percent(root, "Stale%", &stalep, true);
+
+	root = print_data(root, buf, isjson, isjson && (i > 0));
+	io_add(io_data, buf);
+
+	return ++i;
+}
+
+static void latencystats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	struct cgpu_info *cgpu;
+	bool io_open = false;
+	char id[20];
+	int i, j;
+
+	message(io_data, MSG_LATENCY, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_LATENCY);
+
+	i = 0;
+	for (j = 0; j < total_devices; j++) {
+		cgpu = get_devices(j);
+
+		i = itemlatency(io_data, i, cgpu->proc_repr_ns, "Get Work", &cgpu->lat_getwork_wait, &cgpu->lat_staged, &cgpu->lat_found_submit, &cgpu->lat_submit, &cgpu->stale, &cgpu->diff_accepted, &cgpu->diff_rejected, &cgpu->diff_stale, isjson);
+	}
+
+	for (j = 0; j < total_pools; j++) {
+		struct pool *pool = pools[j];
+		int stale = pool->stale_shares;
+
+		sprintf(id, "POOL%d", j);
+		i = itemlatency(io_data, i, id, "Getwork", &pool->lat_getwork, &pool->lat_staged, &pool->lat_found_submit, &pool->lat_submit, &stale, &pool->diff_accepted, &pool->diff_rejected, &pool->diff_stale, isjson);
+	}
+
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3391,6 +3533,7 @@ struct CMDS {
 	{ "procdetails",		devdetail,	false,	true },
 	{ "restart",		dorestart,	true,	false },
 	{ "stats",		minerstats,	false,	true },
+	{ "latency",		latencystats,	false,	true },
 	{ "check",		checkcommand,	false,	false },
 	{ "failover-only",	failoveronly,	true,	false },
 	{ "coin",		minecoin,	false,	true },
@@ -3498,6 +3641,11 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 	// Null-terminate reply, including sending the \0 on the socket
 	bytes_append(&io_data->data, "", 1);
 	
+}
+
+static
+void api_send_reply(struct io_data * const io_data)
+{
 	applog(LOG_DEBUG, "API: send reply: (%ld) '%.10s%s'",
 	       (long)bytes_len(&io_data->data),
 	       bytes_buf(&io_data->data),
@@ -3510,6 +3658,71 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 		       (long)bytes_len(&io_data->data));
 }
 
+static
+bool api_reply_from_cache(struct io_data * const io_data, const char * const request)
+{
+	struct api_reply *ar;
+	bool found = false;
+	
+	mutex_lock(&api_replies_lock);
+	HASH_FIND_STR(api_replies, request, ar);
+	if (ar && ms_tdiff(NULL, &ar->tv_created) < opt_api_cache)
+	{
+		bytes_cat(&io_data->data, &ar->reply);
+		found = true;
+	}
+	mutex_unlock(&api_replies_lock);
+	
+	return found;
+}
+
+// Write commands make every cached reply stale, so they throw them all out
+static
+void api_replies_flush()
+{
+	struct api_reply *ar, *tmp;
+	
+	mutex_lock(&api_replies_lock);
+	HASH_ITER(hh, api_replies, ar, tmp)
+	{
+		HASH_DEL(api_replies, ar);
+		free(ar->request);
+		bytes_free(&ar->reply);
+		free(ar);
+	}
+	mutex_unlock(&api_replies_lock);
+}
+
+static
+void api_reply_to_cache(const struct io_data * const io_data, const char * const request)
+{
+	struct api_reply *ar, *tmp;
+	struct timeval tv_now;
+	
+	cgtime(&tv_now);
+	mutex_lock(&api_replies_lock);
+	HASH_ITER(hh, api_replies, ar, tmp)
+	{
+		if (ms_tdiff(&tv_now, &ar->tv_created) < opt_api_cache)
+			continue;
+		HASH_DEL(api_replies, ar);
+		free(ar->request);
+		bytes_free(&ar->reply);
+		free(ar);
+	}
+	if (HASH_COUNT(api_replies) < API_MAX_CACHED_REPLIES)
+	{
+		ar = malloc(sizeof(*ar));
+		*ar = (struct api_reply){
+			.request = strdup(request),
+			.tv_created = tv_now,
+		};
+		bytes_cpy(&ar->reply, &io_data->data);
+		HASH_ADD_KEYPTR(hh, api_replies, ar->request, strlen(ar->request), ar);
+	}
+	mutex_unlock(&api_replies_lock);
+}
+
 static void tidyup(__maybe_unused void *arg)
 {
 	mutex_lock(&quit_restart_lock);
@@ -3530,8 +3743,6 @@ static void tidyup(__maybe_unused void *arg)
 		ipaccess = NULL;
 	}
 
-	io_free();
-
 	mutex_unlock(&quit_restart_lock);
 }
 
@@ -3996,14 +4207,239 @@ void mcast_init()
 		quit(1, "API mcast thread create failed");
 }
 
-void api(int api_thr_id)
+static
+void api_serve(struct io_data * const io_data, const SOCKETTYPE c, const char * const connectaddr, const char group)
 {
-	struct io_data *io_data;
-	struct thr_info bye_thr;
 	char buf[TMPBUFSIZ];
+	char request[TMPBUFSIZ + 1];
 	char param_buf[TMPBUFSIZ];
+	char cmdbuf[100];
+	char *cmd = NULL, *cmdptr, *cmdsbuf = NULL;
+	char *param;
+	json_error_t json_err;
+	json_t *json_config;
+	json_t *json_val;
+	bool isjson;
+	bool did, isjoin, firstjoin;
+	int n, i;
+
+	n = recv(c, &buf[0], TMPBUFSIZ-1, 0);
+	if (SOCKETFAIL(n))
+		buf[0] = '\0';
+	else
+		buf[n] = '\0';
+
+	if (opt_debug) {
+		if (SOCKETFAIL(n))
+			applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
+		else
+			applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
+	}
+
+	if (SOCKETFAIL(n))
+		return;
+
+	io_reinit(io_data);
+	io_data->sock = c;
+
+	request[0] = group;
+	strcpy(&request[1], buf);
+	if (opt_api_cache && api_reply_from_cache(io_data, request)) {
+		api_send_reply(io_data);
+		return;
+	}
+
+	mutex_lock(&api_cmd_lock);
+
+	firstjoin = isjoin = false;
+	// the time of the request in now
+	when = time(NULL);
+
+	did = false;
+
+	if (*buf != ISJSON) {
+		isjson = false;
+
+		param = strchr(buf, SEPARATOR);
+		if (param != NULL)
+			*(param++) = '\0';
+
+		cmd = buf;
+	}
+	else {
+		isjson = true;
+
+		param = NULL;
+
+#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
+		json_config = json_loadb(buf, n, 0, &json_err);
+#elif JANSSON_MAJOR_VERSION > 1
+		json_config = json_loads(buf, 0, &json_err);
+#else
+		json_config = json_loads(buf, &json_err);
+#endif
+
+		if (!json_is_object(json_config)) {
+			message(io_data, MSG_INVJSON, 0, NULL, isjson);
+			send_result(io_data, c, isjson);
+			did = true;
+		}
+		else {
+			json_val = json_object_get(json_config, JSON_COMMAND);
+			if (json_val == NULL) {
+				message(io_data, MSG_MISCMD, 0, NULL, isjson);
+				send_result(io_data, c, isjson);
+				did = true;
+			}
+			else {
+				if (!json_is_string(json_val)) {
+					message(io_data, MSG_INVCMD, 0, NULL, isjson);
+					send_result(io_data, c, isjson);
+					did = true;
+				}
+				else {
+					cmd = (char *)json_string_value(json_val);
+					json_val = json_object_get(json_config, JSON_PARAMETER);
+					if (json_is_string(json_val))
+						param = (char *)json_string_value(json_val);
+					else if (json_is_integer(json_val)) {
+						sprintf(param_buf, "%d", (int)json_integer_value(json_val));
+						param = param_buf;
+					} else if (json_is_real(json_val)) {
+						sprintf(param_buf, "%f", (double)json_real_value(json_val));
+						param = param_buf;
+					}
+				}
+			}
+		}
+	}
+
+	if (!did) {
+		if (strchr(cmd, CMDJOIN)) {
+			firstjoin = isjoin = true;
+			// cmd + leading+tailing '|' + '\0'
+			cmdsbuf = malloc(strlen(cmd) + 3);
+			if (!cmdsbuf)
+				quithere(1, "OOM cmdsbuf");
+			strcpy(cmdsbuf, "|");
+			param = NULL;
+		}
+
+		cmdptr = cmd;
+		do {
+			did = false;
+			if (isjoin) {
+				cmd = strchr(cmdptr, CMDJOIN);
+				if (cmd)
+					*(cmd++) = '\0';
+				if (!*cmdptr)
+					goto inochi;
+			}
+
+			for (i = 0; cmds[i].name != NULL; i++) {
+				if (strcmp(cmdptr, cmds[i].name) == 0) {
+					if (cmds[i].iswritemode)
+						io_data->cacheable = false;
+					sprintf(cmdbuf, "|%s|", cmdptr);
+					if (isjoin) {
+						if (strstr(cmdsbuf, cmdbuf)) {
+							did = true;
+							break;
+						}
+						strcat(cmdsbuf, cmdptr);
+						strcat(cmdsbuf, "|");
+						head_join(io_data, cmdptr, isjson, &firstjoin);
+						if (!cmds[i].joinable) {
+							message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+							did = true;
+							tail_join(io_data, isjson);
+							break;
+						}
+					}
+					if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
+					{
+						per_proc = !strncmp(cmds[i].name, "proc", 4);
+						(cmds[i].func)(io_data, c, param, isjson, group);
+						if (cmds[i].iswritemode)
+							api_replies_flush();
+					}
+					else {
+						message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+						applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
+					}
+
+					did = true;
+					if (!isjoin)
+						send_result(io_data, c, isjson);
+					else
+						tail_join(io_data, isjson);
+					break;
+				}
+			}
+
+			if (!did) {
+				if (isjoin)
+					head_join(io_data, cmdptr, isjson, &firstjoin);
+				message(io_data, MSG_INVCMD, 0, NULL, isjson);
+				if (isjoin)
+					tail_join(io_data, isjson);
+				else
+					send_result(io_data, c, isjson);
+			}
+inochi:
+			if (isjoin)
+				cmdptr = cmd;
+		} while (isjoin && cmdptr);
+	}
+
+	if (isjson)
+		json_decref(json_config);
+
+	if (isjoin) {
+		send_result(io_data, c, isjson);
+		free(cmdsbuf);
+	}
+
+	// Cached before a write command can get in and flush the cache
+	if (opt_api_cache && io_data->cacheable)
+		api_reply_to_cache(io_data, request);
+
+	mutex_unlock(&api_cmd_lock);
+
+	api_send_reply(io_data);
+}
+
+static void *api_worker_thread(__maybe_unused void *userdata)
+{
+	struct io_data * const io_data = sock_io_new();
+	struct api_conn *conn;
+
+	pthread_detach(pthread_self());
+	RenameThread("api_worker");
+
+	while (true) {
+		mutex_lock(&api_conn_lock);
+		while (!api_conn_queue)
+			pthread_cond_wait(&api_conn_cond, &api_conn_lock);
+		conn = api_conn_queue;
+		LL_DELETE(api_conn_queue, conn);
+		mutex_unlock(&api_conn_lock);
+
+		api_serve(io_data, conn->sock, conn->connectaddr, conn->group);
+		CLOSESOCKET(conn->sock);
+		free(conn);
+	}
+
+	return NULL;
+}
+
+void api(int api_thr_id)
+{
+	struct thr_info bye_thr;
+	struct api_conn *conn;
+	pthread_t pth;
 	SOCKETTYPE c;
-	int n, bound;
+	int bound;
 	char *connectaddr;
 	const char *binderror;
 	struct timeval bindstart;
@@ -4011,16 +4447,10 @@ void api(int api_thr_id)
 	struct sockaddr_in serv;
 	struct sockaddr_in cli;
 	socklen_t clisiz;
-	char cmdbuf[100];
-	char *cmd = NULL, *cmdptr, *cmdsbuf;
-	char *param;
+	struct timeval tv;
+	fd_set rd;
 	bool addrok;
 	char group;
-	json_error_t json_err;
-	json_t *json_config;
-	json_t *json_val;
-	bool isjson;
-	bool did, isjoin, firstjoin;
 	int i;
 
 	SOCKETTYPE *apisock;
@@ -4033,9 +4463,6 @@ void api(int api_thr_id)
 	apisock = malloc(sizeof(*apisock));
 	*apisock = INVSOCK;
 
-	rpc_io_data =
-	io_data = sock_io_new();
-
 	mutex_init(&quit_restart_lock);
 
 	pthread_cleanup_push(tidyup, (void *)apisock);
@@ -4125,7 +4552,18 @@ void api(int api_thr_id)
 	if (opt_api_mcast)
 		mcast_init();
 
+	for (i = 0; i < opt_api_threads; ++i)
+		if (unlikely(pthread_create(&pth, NULL, api_worker_thread, NULL)))
+			quit(1, "API worker thread create failed");
+
 	while (!bye) {
+		// Wake up now and then to notice a quit or restart from a worker
+		FD_ZERO(&rd);
+		FD_SET(*apisock, &rd);
+		tv = (struct timeval){1, 0};
+		if (select(*apisock + 1, &rd, NULL, NULL, &tv) < 1)
+			continue;
+
 		clisiz = sizeof(cli);
 		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
 			applog(LOG_ERR, "API failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
@@ -4136,168 +4574,19 @@ void api(int api_thr_id)
 		applog(LOG_DEBUG, "API: connection from %s - %s",
 					connectaddr, addrok ? "Accepted" : "Ignored");
 
-		if (addrok) {
-			n = recv(c, &buf[0], TMPBUFSIZ-1, 0);
-			if (SOCKETFAIL(n))
-				buf[0] = '\0';
-			else
-				buf[n] = '\0';
-
-			if (opt_debug) {
-				if (SOCKETFAIL(n))
-					applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
-				else
-					applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
-			}
-
-			firstjoin = isjoin = false;
-			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
-				io_reinit(io_data);
-				io_data->sock = c;
-
-				did = false;
-
-				if (*buf != ISJSON) {
-					isjson = false;
-
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
-
-					cmd = buf;
-				}
-				else {
-					isjson = true;
-
-					param = NULL;
-
-#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
-					json_config = json_loadb(buf, n, 0, &json_err);
-#elif JANSSON_MAJOR_VERSION > 1
-					json_config = json_loads(buf, 0, &json_err);
-#else
-					json_config = json_loads(buf, &json_err);
-#endif
-
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					}
-					else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						}
-						else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							}
-							else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									sprintf(param_buf, "%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									sprintf(param_buf, "%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
-
-				if (!did) {
-					if (strchr(cmd, CMDJOIN)) {
-						firstjoin = isjoin = true;
-						// cmd + leading+tailing '|' + '\0'
-						cmdsbuf = malloc(strlen(cmd) + 3);
-						if (!cmdsbuf)
-							quithere(1, "OOM cmdsbuf");
-						strcpy(cmdsbuf, "|");
-						param = NULL;
-					}
-
-					cmdptr = cmd;
-					do {
-						did = false;
-						if (isjoin) {
-							cmd = strchr(cmdptr, CMDJOIN);
-							if (cmd)
-								*(cmd++) = '\0';
-							if (!*cmdptr)
-								goto inochi;
-						}
-
-						for (i = 0; cmds[i].name != NULL; i++) {
-							if (strcmp(cmdptr, cmds[i].name) == 0) {
-								sprintf(cmdbuf, "|%s|", cmdptr);
-								if (isjoin) {
-									if (strstr(cmdsbuf, cmdbuf)) {
-										did = true;
-										break;
-									}
-									strcat(cmdsbuf, cmdptr);
-									strcat(cmdsbuf, "|");
-									head_join(io_data, cmdptr, isjson, &firstjoin);
-									if (!cmds[i].joinable) {
-										message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-										did = true;
-										tail_join(io_data, isjson);
-										break;
-									}
-								}
-								if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-								{
-									per_proc = !strncmp(cmds[i].name, "proc", 4);
-									(cmds[i].func)(io_data, c, param, isjson, group);
-								}
-								else {
-									message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-									applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-								}
-
-								did = true;
-								if (!isjoin)
-									send_result(io_data, c, isjson);
-								else
-									tail_join(io_data, isjson);
-								break;
-							}
-						}
-
-						if (!did) {
-							if (isjoin)
-								head_join(io_data, cmdptr, isjson, &firstjoin);
-							message(io_data, MSG_INVCMD, 0, NULL, isjson);
-							if (isjoin)
-								tail_join(io_data, isjson);
-							else
-								send_result(io_data, c, isjson);
-						}
-inochi:
-						if (isjoin)
-							cmdptr = cmd;
-					} while (isjoin && cmdptr);
-				}
-
-				if (isjson)
-					json_decref(json_config);
-
-				if (isjoin)
-					send_result(io_data, c, isjson);
-			}
+		if (!addrok) {
+			CLOSESOCKET(c);
+			continue;
 		}
-		CLOSESOCKET(c);
+
+		conn = malloc(sizeof(*conn));
+		conn->sock = c;
+		snprintf(conn->connectaddr, sizeof(conn->connectaddr), "%s", connectaddr);
+		conn->group = group;
+		mutex_lock(&api_conn_lock);
+		LL_APPEND(api_conn_queue, conn);
+		pthread_cond_signal(&api_conn_cond);
+		mutex_unlock(&api_conn_lock);
 	}
 die:
 	/* Blank line fix for older compilers since pthread_cleanup_pop is a
@@ -4328,3 +4617,58 @@ die:
 
 	mutex_unlock(&quit_restart_lock);
 }
+
+#ifndef WIN32
+static
+void _test_api_cache_queue(struct io_data * const io_data, const char * const cmd, const int expect)
+{
+	char reply[TMPBUFSIZ], queue[0x20];
+	int sv[2];
+	ssize_t n;
+	
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+	{
+		applog(LOG_ERR, "%s: socketpair failed: %s", __func__, bfg_strerror(errno, BST_ERRNO));
+		return;
+	}
+	if (send(sv[1], cmd, strlen(cmd), 0) != (ssize_t)strlen(cmd))
+		applog(LOG_ERR, "%s: %s: send failed", __func__, cmd);
+	// Access groups aren't set up until the API starts, but W needs none
+	api_serve(io_data, sv[0], "127.0.0.1", PRIVGROUP);
+	n = recv(sv[1], reply, sizeof(reply) - 1, 0);
+	reply[(n > 0) ? n : 0] = '\0';
+	if (expect >= 0)
+	{
+		snprintf(queue, sizeof(queue), ",Queue=%d,", expect);
+		if (!strstr(reply, queue))
+			applog(LOG_ERR, "%s: %s: Expected %s in reply: %s", __func__, cmd, queue, reply);
+	}
+	close(sv[0]);
+	close(sv[1]);
+}
+
+void test_api_cache()
+{
+	struct io_data * const io_data = sock_io_new();
+	const int api_cache = opt_api_cache, queue = opt_queue;
+	char setconfig[0x20];
+	
+	opt_api_cache = 60000;
+	_test_api_cache_queue(io_data, "config", queue);
+	
+	// Changes outside the API can take up to opt_api_cache ms to show
+	opt_queue = queue + 1;
+	_test_api_cache_queue(io_data, "config", queue);
+	
+	// ...but a read after a write command always sees what it did
+	snprintf(setconfig, sizeof(setconfig), "setconfig|queue,%d", queue + 2);
+	_test_api_cache_queue(io_data, setconfig, -1);
+	_test_api_cache_queue(io_data, "config", queue + 2);
+	
+	opt_queue = queue;
+	opt_api_cache = api_cache;
+	api_replies_flush();
+	bytes_free(&io_data->data);
+	free(io_data);
+}
+#endif
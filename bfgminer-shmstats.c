@@ -0,0 +1,95 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Prints the stats a local BFGMiner publishes with --shm-stats, without
+ * going through the API.  Usage: bfgminer-shmstats [name] */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmstats.h"
+
+int main(int argc, char **argv)
+{
+	const char * const name = (argc > 1) ? argv[1] : "/bfgminer";
+	const struct bfg_shmstats *s;
+	struct bfg_shmstats *copy;
+	struct bfg_shmstats_proc *procs;
+	struct stat st;
+	uint32_t i, seq;
+	int fd;
+	
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0 || fstat(fd, &st))
+	{
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return 1;
+	}
+	if ((size_t)st.st_size < sizeof(*s))
+	{
+		fprintf(stderr, "%s: Too small to be BFGMiner stats\n", name);
+		return 1;
+	}
+	s = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: mmap: %s\n", name, strerror(errno));
+		return 1;
+	}
+	if (s->magic != BFG_SHMSTATS_MAGIC || s->version != BFG_SHMSTATS_VERSION
+	 || bfg_shmstats_size(s->pools_max, s->procs_max) > (size_t)st.st_size)
+	{
+		fprintf(stderr, "%s: Not BFGMiner stats, or an unsupported version\n", name);
+		return 1;
+	}
+	
+	copy = malloc(st.st_size);
+	do {
+		if (!bfg_shmstats_read_begin(s, &seq))
+		{
+			fprintf(stderr, "%s: Stale; the miner stopped in the middle of an update %lds ago\n",
+			        name, (long)(time(NULL) - s->updated));
+			return 1;
+		}
+		memcpy(copy, s, st.st_size);
+	} while (bfg_shmstats_read_retry(s, seq));
+	procs = bfg_shmstats_procs(copy);
+	
+	printf("Updated %lds ago, elapsed %.0fs\n",
+	       (long)(time(NULL) - copy->updated), copy->summary.elapsed);
+	printf("Summary: %.3f Mh/s, %.0f Mh total, A:%.0f R:%.0f S:%.0f HW:%lu Blocks:%lu\n",
+	       copy->summary.rolling_mhs, copy->summary.total_mhashes,
+	       copy->summary.diff_accepted, copy->summary.diff_rejected, copy->summary.diff_stale,
+	       (unsigned long)copy->summary.hw_errors, (unsigned long)copy->summary.found_blocks);
+	for (i = 0; i < copy->pools; ++i)
+		printf("Pool %ld: A:%.0f R:%.0f S:%.0f latency %.3fs %s\n",
+		       (long)copy->pool[i].pool_no,
+		       copy->pool[i].diff_accepted, copy->pool[i].diff_rejected, copy->pool[i].diff_stale,
+		       copy->pool[i].getwork_latency, copy->pool[i].url);
+	for (i = 0; i < copy->procs; ++i)
+	{
+		printf("%-8s %.3f Mh/s A:%.0f R:%.0f S:%.0f HW:%lu",
+		       procs[i].name, procs[i].rolling_mhs,
+		       procs[i].diff_accepted, procs[i].diff_rejected, procs[i].diff_stale,
+		       (unsigned long)procs[i].hw_errors);
+		if (procs[i].temp > 0)
+			printf(" %.1fC", procs[i].temp);
+		printf("\n");
+	}
+	
+	return 0;
+}
@@ -187,13 +187,11 @@ int restart_wait(struct thr_info *thr, unsigned int mstime)
 }
 
 static
-struct work *get_and_prepare_work(struct thr_info *thr)
+struct work *prepare_work(struct thr_info * const thr, struct work * const work)
 {
 	struct cgpu_info *proc = thr->cgpu;
 	struct device_drv *api = proc->drv;
-	struct work *work;
 	
-	work = get_work(thr);
 	if (!work)
 		return NULL;
 	if (api->prepare_work && !api->prepare_work(thr, work)) {
@@ -206,6 +204,12 @@ struct work *get_and_prepare_work(struct thr_info *thr)
 	return work;
 }
 
+static
+struct work *get_and_prepare_work(struct thr_info *thr)
+{
+	return prepare_work(thr, get_work(thr));
+}
+
 // Miner loop to manage a single processor (with possibly multiple threads per processor)
 void minerloop_scanhash(struct thr_info *mythr)
 {
@@ -289,19 +293,27 @@ bool do_job_prepare(struct thr_info *mythr, struct timeval *tvp_now)
 	struct cgpu_info *proc = mythr->cgpu;
 	struct device_drv *api = proc->drv;
 	struct timeval tv_worktime;
+	struct work *work;
 	
 	mythr->tv_morework.tv_sec = -1;
 	mythr->_job_transition_in_progress = true;
+	mythr->_getwork_retry = false;
 	if (mythr->work)
 		timersub(tvp_now, &mythr->work->tv_work_start, &tv_worktime);
 	if ((!mythr->work) || abandon_work(mythr->work, &tv_worktime, proc->max_hashes))
 	{
 		mythr->work_restart = false;
 		request_work(mythr);
-		// FIXME: Allow get_work to return NULL to retry on notification
+		work = try_get_work(mythr);
+		if (!work)
+		{
+			// Stop the stale job; minerloop_async retries once hash_push wakes us up
+			mythr->_getwork_retry = true;
+			return false;
+		}
 		if (mythr->next_work)
 			free_work(mythr->next_work);
-		mythr->next_work = get_and_prepare_work(mythr);
+		mythr->next_work = prepare_work(mythr, work);
 		if (!mythr->next_work)
 			return false;
 		mythr->starting_next_work = true;
@@ -546,6 +558,15 @@ void minerloop_async(struct thr_info *mythr)
 			
 			if (should_be_running)
 			{
+				if (unlikely(mythr->_getwork_retry))
+				{
+					// Let the stale job wind down, then wait for hash_push to wake us
+					if (mythr->_job_transition_in_progress || mythr->getwork_waiting)
+						goto defer_events;
+					if (mythr->_mt_disable_called)
+						mt_disable_finish(mythr);
+					goto djp;
+				}
 				if (unlikely(!(is_running || mythr->_job_transition_in_progress)))
 				{
 					mt_disable_finish(mythr);
@@ -556,6 +577,12 @@ void minerloop_async(struct thr_info *mythr)
 			}
 			else  // ! should_be_running
 			{
+				if (unlikely(mythr->_getwork_retry))
+				{
+					// Stop waiting for work, so the job can be wound down
+					mythr->_getwork_retry = false;
+					mythr->_job_transition_in_progress = false;
+				}
 				if (unlikely((is_running || !mythr->_mt_disable_called) && !mythr->_job_transition_in_progress))
 				{
 disabled: ;
@@ -568,8 +595,12 @@ disabled: ;
 							// Avoid starting job when pending result fetch completes
 							mythr->_proceed_with_new_job = false;
 					}
-					else  // !mythr->_mt_disable_called
+					else
+					if (!mythr->_mt_disable_called)
 						mt_disable_start__async(mythr);
+					else
+						// Still waiting on work since an earlier underrun
+						mythr->_job_transition_in_progress = false;
 				}
 			}
 			
@@ -656,8 +687,7 @@ redo:
 					else
 					{
 						request_work(mythr);
-						// FIXME: Allow get_work to return NULL to retry on notification
-						work = get_and_prepare_work(mythr);
+						work = prepare_work(mythr, try_get_work(mythr));
 					}
 					if (!work)
 						break;
@@ -682,7 +712,8 @@ redo:
 			}
 			
 			should_be_running = (proc->deven == DEV_ENABLED && !mythr->pause);
-			if (should_be_running && !mythr->queue_full)
+			// If no work was available, wait for hash_push to wake us
+			if (should_be_running && !(mythr->queue_full || mythr->getwork_waiting))
 				goto redo;
 			
 			reduce_timeout_to(&tv_timeout, &mythr->tv_poll);
@@ -761,6 +792,7 @@ bool _add_cgpu(struct cgpu_info *cgpu)
 	
 	cgpu->dev_repr = malloc(6);
 	cgpu->dev_repr_ns = malloc(6);
+	mutex_init(&cgpu->work_magazine_lock);
 	
 #ifdef NEED_BFG_LOWL_VCOM
 	maybe_strdup_if_null(&cgpu->dev_manufacturer, detectone_meta_info.manufacturer);
@@ -783,6 +815,7 @@ bool _add_cgpu(struct cgpu_info *cgpu)
 			*slave = *cgpu;
 			slave->proc_id = i;
 			slave->threads = tpp;
+			mutex_init(&slave->work_magazine_lock);
 			devices_new[total_devices_new++] = slave;
 			*nlp_p = slave;
 			nlp_p = &slave->next_proc;
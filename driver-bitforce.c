@@ -1351,7 +1351,8 @@ void bitforce_process_result_nonces(struct thr_info *thr, struct work *work, cha
 {
 	struct cgpu_info *bitforce = thr->cgpu;
 	struct bitforce_data *data = bitforce->device_data;
-	uint32_t nonce;
+	uint32_t nonce, nonces[8];
+	int count = 0;
 	
 	while (1) {
 		hex2bin((void*)&nonce, pnoncebuf, 4);
@@ -1363,11 +1364,18 @@ void bitforce_process_result_nonces(struct thr_info *thr, struct work *work, cha
 				bitforce_change_mode(bitforce, BFP_WORK);
 		}
 			
-		submit_nonce(thr, work, nonce);
+		nonces[count++] = nonce;
+		if (count == sizeof(nonces) / sizeof(*nonces))
+		{
+			submit_nonces_batch(thr, work, nonces, count);
+			count = 0;
+		}
 		if (strncmp(&pnoncebuf[8], ",", 1))
 			break;
 		pnoncebuf += 9;
 	}
+	if (count)
+		submit_nonces_batch(thr, work, nonces, count);
 }
 
 static
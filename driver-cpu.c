@@ -35,6 +35,8 @@
 #include "logging.h"
 #include "util.h"
 #include "driver-cpu.h"
+#include "scrypt.h"
+#include "sha2.h"
 
 #if defined(unix)
 	#include <errno.h>
@@ -134,7 +136,25 @@ extern bool scanhash_sse2_32(struct thr_info*, const unsigned char *pmidstate, u
 	uint32_t max_nonce, uint32_t *last_nonce,
 	uint32_t nonce);
 
+extern bool ScanHash_8WayAVX2(struct thr_info*, const unsigned char *pmidstate,
+	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, uint32_t *last_nonce, uint32_t nonce);
+
+extern bool ScanHash_16WayAVX512(struct thr_info*, const unsigned char *pmidstate,
+	unsigned char *pdata, unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, uint32_t *last_nonce, uint32_t nonce);
+
+extern bool scanhash_shani(struct thr_info*, const unsigned char *pmidstate, unsigned char *pdata,
+	unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, uint32_t *last_nonce,
+	uint32_t nonce);
+
 extern bool scanhash_scrypt(struct thr_info *, const unsigned char *pmidstate, unsigned char *pdata, unsigned char *phash1, unsigned char __maybe_unused *phash, const unsigned char *ptarget, uint32_t max_nonce, uint32_t *last_nonce, uint32_t nonce);
+extern bool scanhash_scrypt_4way(struct thr_info *, const unsigned char *pmidstate, unsigned char *pdata, unsigned char *phash1, unsigned char __maybe_unused *phash, const unsigned char *ptarget, uint32_t max_nonce, uint32_t *last_nonce, uint32_t nonce);
+extern bool scanhash_scrypt_avx2_8way(struct thr_info *, const unsigned char *pmidstate, unsigned char *pdata, unsigned char *phash1, unsigned char __maybe_unused *phash, const unsigned char *ptarget, uint32_t max_nonce, uint32_t *last_nonce, uint32_t nonce);
 
 
 
@@ -163,10 +183,25 @@ const char *algo_names[] = {
 	[ALGO_SSE4_64]		= "sse4_64",
 #endif
 #ifdef WANT_ALTIVEC_4WAY
-    [ALGO_ALTIVEC_4WAY] = "altivec_4way",
+	[ALGO_ALTIVEC_4WAY]	= "altivec_4way",
+#endif
+#ifdef WANT_AVX2_8WAY
+	[ALGO_AVX2_8WAY]	= "avx2_8way",
+#endif
+#ifdef WANT_AVX512_16WAY
+	[ALGO_AVX512_16WAY]	= "avx512_16way",
+#endif
+#ifdef WANT_SHANI
+	[ALGO_SHANI]		= "shani",
 #endif
 #ifdef WANT_SCRYPT
-    [ALGO_SCRYPT] = "scrypt",
+	[ALGO_SCRYPT]		= "scrypt",
+#endif
+#ifdef WANT_SCRYPT_4WAY
+	[ALGO_SCRYPT_4WAY]	= "scrypt_4way",
+#endif
+#ifdef WANT_SCRYPT_AVX2_8WAY
+	[ALGO_SCRYPT_AVX2_8WAY]	= "scrypt_avx2_8way",
 #endif
 	[ALGO_FASTAUTO] = "fastauto",
 	[ALGO_AUTO] = "auto",
@@ -178,7 +213,7 @@ static const sha256_func sha256_funcs[] = {
 	[ALGO_4WAY]		= (sha256_func)ScanHash_4WaySSE2,
 #endif
 #ifdef WANT_ALTIVEC_4WAY
-    [ALGO_ALTIVEC_4WAY] = (sha256_func) ScanHash_altivec_4way,
+	[ALGO_ALTIVEC_4WAY]	= (sha256_func)ScanHash_altivec_4way,
 #endif
 #ifdef WANT_VIA_PADLOCK
 	[ALGO_VIA]		= (sha256_func)scanhash_via,
@@ -196,8 +231,23 @@ static const sha256_func sha256_funcs[] = {
 #ifdef WANT_X8664_SSE4
 	[ALGO_SSE4_64]		= (sha256_func)scanhash_sse4_64,
 #endif
+#ifdef WANT_AVX2_8WAY
+	[ALGO_AVX2_8WAY]	= (sha256_func)ScanHash_8WayAVX2,
+#endif
+#ifdef WANT_AVX512_16WAY
+	[ALGO_AVX512_16WAY]	= (sha256_func)ScanHash_16WayAVX512,
+#endif
+#ifdef WANT_SHANI
+	[ALGO_SHANI]		= (sha256_func)scanhash_shani,
+#endif
 #ifdef WANT_SCRYPT
-	[ALGO_SCRYPT]		= (sha256_func)scanhash_scrypt
+	[ALGO_SCRYPT]		= (sha256_func)scanhash_scrypt,
+#endif
+#ifdef WANT_SCRYPT_4WAY
+	[ALGO_SCRYPT_4WAY]	= (sha256_func)scanhash_scrypt_4way,
+#endif
+#ifdef WANT_SCRYPT_AVX2_8WAY
+	[ALGO_SCRYPT_AVX2_8WAY]	= (sha256_func)scanhash_scrypt_avx2_8way,
 #endif
 };
 #endif
@@ -220,6 +270,22 @@ static const uint32_t hash1_init[] = {
 
 
 #ifdef WANT_CPUMINE
+// Number of nonces a scrypt algorithm hashes per scratchpad pass, or 0 for SHA256d
+static int scrypt_algo_lanes(const enum sha256_algos algo)
+{
+	switch (algo)
+	{
+		case ALGO_SCRYPT:
+			return 1;
+		case ALGO_SCRYPT_4WAY:
+			return 4;
+		case ALGO_SCRYPT_AVX2_8WAY:
+			return 8;
+		default:
+			return 0;
+	}
+}
+
 // Algo benchmark, crash-prone, system independent stage
 double bench_algo_stage3(
 	enum sha256_algos algo
@@ -235,6 +301,10 @@ double bench_algo_stage3(
 	struct timeval end;
 	struct timeval start;
 	uint32_t max_nonce = opt_algo == ALGO_FASTAUTO ? (1<<8) : (1<<22);
+	// scrypt is about a thousand times slower, but every algorithm still needs
+	// several passes of its widest lanes to be measured at all
+	if (scrypt_algo_lanes(algo))
+		max_nonce = opt_algo == ALGO_FASTAUTO ? (1<<6) : (1<<10);
 	uint32_t last_nonce = 0;
 
 	memcpy(&hash1[0], &hash1_init[0], sizeof(hash1));
@@ -554,6 +624,34 @@ static double bench_algo_stage2(
 	return rate;
 }
 
+// Kernels built for newer instruction sets than the binary targets must be
+// checked against the running CPU before use
+static bool algo_cpu_supported(const enum sha256_algos algo)
+{
+	switch (algo)
+	{
+#ifdef WANT_AVX2_8WAY
+		case ALGO_AVX2_8WAY:
+#ifdef WANT_SCRYPT_AVX2_8WAY
+		case ALGO_SCRYPT_AVX2_8WAY:
+#endif
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2");
+#endif
+#ifdef WANT_AVX512_16WAY
+		case ALGO_AVX512_16WAY:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx512f");
+#endif
+#ifdef WANT_SHANI
+		case ALGO_SHANI:
+			return sha256_shani_supported();
+#endif
+		default:
+			return true;
+	}
+}
+
 static void bench_algo(
 	double            *best_rate,
 	enum sha256_algos *best_algo,
@@ -564,6 +662,17 @@ static void bench_algo(
 	memset(name_spaces_pad, ' ', n);
 	name_spaces_pad[n] = 0;
 
+	if (!algo_cpu_supported(algo))
+	{
+		applog(
+			LOG_ERR,
+			"\"%s\"%s : algorithm not supported by this CPU",
+			algo_names[algo],
+			name_spaces_pad
+		);
+		return;
+	}
+
 	applog(
 		LOG_ERR,
 		"\"%s\"%s : benchmarking algorithm ...",
@@ -618,6 +727,26 @@ static enum sha256_algos pick_fastest_algo()
 {
 	double best_rate = -1.0;
 	enum sha256_algos best_algo = 0;
+	size_t n;
+#ifdef WANT_SCRYPT
+	if (opt_scrypt)
+	{
+		applog(LOG_ERR, "benchmarking all scrypt algorithms ...");
+
+		bench_algo(&best_rate, &best_algo, ALGO_SCRYPT);
+
+		#if defined(WANT_SCRYPT_4WAY)
+			bench_algo(&best_rate, &best_algo, ALGO_SCRYPT_4WAY);
+		#endif
+
+		#if defined(WANT_SCRYPT_AVX2_8WAY)
+			bench_algo(&best_rate, &best_algo, ALGO_SCRYPT_AVX2_8WAY);
+		#endif
+
+		goto out;
+	}
+#endif
+
 	applog(LOG_ERR, "benchmarking all sha256 algorithms ...");
 
 	bench_algo(&best_rate, &best_algo, ALGO_C);
@@ -652,7 +781,22 @@ static enum sha256_algos pick_fastest_algo()
                 bench_algo(&best_rate, &best_algo, ALGO_ALTIVEC_4WAY);
         #endif
 
-	size_t n = max_name_len - strlen(algo_names[best_algo]);
+	#if defined(WANT_AVX2_8WAY)
+		bench_algo(&best_rate, &best_algo, ALGO_AVX2_8WAY);
+	#endif
+
+	#if defined(WANT_AVX512_16WAY)
+		bench_algo(&best_rate, &best_algo, ALGO_AVX512_16WAY);
+	#endif
+
+	#if defined(WANT_SHANI)
+		bench_algo(&best_rate, &best_algo, ALGO_SHANI);
+	#endif
+
+#ifdef WANT_SCRYPT
+out:
+#endif
+	n = max_name_len - strlen(algo_names[best_algo]);
 	memset(name_spaces_pad, ' ', n);
 	name_spaces_pad[n] = 0;
 	applog(
@@ -670,11 +814,12 @@ char *set_algo(const char *arg, enum sha256_algos *algo)
 {
 	enum sha256_algos i;
 
-	if (opt_scrypt)
-		return "Can only use scrypt algorithm";
-
 	for (i = 0; i < ARRAY_SIZE(algo_names); i++) {
 		if (algo_names[i] && !strcmp(arg, algo_names[i])) {
+			if (opt_scrypt && !(scrypt_algo_lanes(i) || i == ALGO_AUTO || i == ALGO_FASTAUTO))
+				return "Can only use scrypt algorithm";
+			if (!algo_cpu_supported(i))
+				return "Algorithm not supported by this CPU";
 			*algo = i;
 			return NULL;
 		}
@@ -685,7 +830,16 @@ char *set_algo(const char *arg, enum sha256_algos *algo)
 #ifdef WANT_SCRYPT
 void set_scrypt_algo(enum sha256_algos *algo)
 {
-	*algo = ALGO_SCRYPT;
+	switch (*algo)
+	{
+		case ALGO_AUTO:
+		case ALGO_FASTAUTO:
+			// pick_fastest_algo only tries scrypt ones
+			break;
+		default:
+			if (!scrypt_algo_lanes(*algo))
+				*algo = ALGO_SCRYPT;
+	}
 }
 #endif
 
@@ -693,6 +847,89 @@ void show_algo(char buf[OPT_SHOW_LEN], const enum sha256_algos *algo)
 {
 	strncpy(buf, algo_names[*algo], OPT_SHOW_LEN);
 }
+
+// The wide and SHA-NI kernels must find the same nonce, and hash, as the plain C one
+void test_cpu_algos()
+{
+	// Block 125552, whose nonce is 0x42a14695
+	static const char * const header =
+		"01000000"
+		"81cd02ab7e569e8bcd9317e2fe99f2de44d49ab2b8851ba4a308000000000000"
+		"e320b6c2fffc8d750423db8b1eb942ae710e951ed797f7affc8892b0f1fc122b"
+		"c7f5d74d"
+		"f2b9441a"
+		"42a14695";
+	static const uint32_t nonce = 0x42a14695;
+	static const enum sha256_algos algos[] = {
+#ifdef WANT_AVX2_8WAY
+		ALGO_AVX2_8WAY,
+#endif
+#ifdef WANT_AVX512_16WAY
+		ALGO_AVX512_16WAY,
+#endif
+#ifdef WANT_SHANI
+		ALGO_SHANI,
+#endif
+	};
+	static struct thr_info dummy;
+	struct work work __attribute__((aligned(128)));
+	unsigned char hdr[80], hash1[64], expect_hash[32];
+	uint32_t * const data32 = (uint32_t *)work.data;
+	uint32_t last_nonce;
+	sha256_ctx ctx;
+	bool rc;
+	int i;
+	
+	if (!ARRAY_SIZE(algos))
+		return;
+	
+	memset(&work, 0, sizeof(work));
+	hex2bin(hdr, header, 80);
+	swap32yes(work.data, hdr, 80 / 4);
+	data32[20] = htole32(0x80000000);
+	data32[31] = htole32(80 * 8);
+	sha256_init(&ctx);
+	sha256_update(&ctx, hdr, 64);
+	memcpy(work.midstate, ctx.h, sizeof(work.midstate));
+	swap32tole(work.midstate, work.midstate, 8);
+	set_target_to_pdiff(work.target, 1);
+	
+	for (i = -1; i < (int)ARRAY_SIZE(algos); ++i)
+	{
+		const enum sha256_algos algo = (i < 0) ? ALGO_C : algos[i];
+		const sha256_func func = sha256_funcs[algo];
+		
+		if (!algo_cpu_supported(algo))
+		{
+			applog(LOG_DEBUG, "CPU algorithm test skipped: %s not supported by this CPU", algo_names[algo]);
+			continue;
+		}
+		
+		// Nothing to find short of the nonce, even with the last pass' extra lanes
+		memcpy(hash1, hash1_init, sizeof(hash1));
+		rc = func(&dummy, work.midstate, work.data, hash1, work.hash, work.target, nonce - 0x20, &last_nonce, nonce - 0x121);
+		if (rc)
+			applog(LOG_ERR, "CPU algorithm test failed: %s found nonce %08lx below the real one",
+			       algo_names[algo], (unsigned long)le32toh(data32[19]));
+		
+		// Start off the lane boundaries, so the nonce is in the middle of a pass
+		memcpy(hash1, hash1_init, sizeof(hash1));
+		rc = func(&dummy, work.midstate, work.data, hash1, work.hash, work.target, nonce + 0x40, &last_nonce, nonce - 0x43);
+		if (!rc || le32toh(data32[19]) != nonce)
+		{
+			applog(LOG_ERR, "CPU algorithm test failed: %s did not find nonce %08lx",
+			       algo_names[algo], (unsigned long)nonce);
+			continue;
+		}
+		
+		if (i < 0)
+			memcpy(expect_hash, work.hash, sizeof(expect_hash));
+		else
+		if (memcmp(work.hash, expect_hash, sizeof(expect_hash)))
+			applog(LOG_ERR, "CPU algorithm test failed: %s hash differs from %s",
+			       algo_names[algo], algo_names[ALGO_C]);
+	}
+}
 #endif
 
 #ifdef WANT_CPUMINE
@@ -805,8 +1042,19 @@ static bool cpu_thread_init(struct thr_info *thr)
 
 	cgpu->kname = algo_names[opt_algo];
 	
-	if (opt_algo == ALGO_SCRYPT)
+#ifdef WANT_SCRYPT
+	const int scrypt_lanes = scrypt_algo_lanes(opt_algo);
+	if (scrypt_lanes)
+	{
 		cgpu->min_nonce_diff = 1./0x10000;
+		thr->cgpu_data = scrypt_scratchbuf_alloc(scrypt_lanes);
+		if (!thr->cgpu_data)
+		{
+			applog(LOG_ERR, "%"PRIpreprv": Failed to allocate scrypt scratchpad", cgpu->proc_repr);
+			return false;
+		}
+	}
+#endif
 	
 	/* Set worker threads to nice 19 and then preferentially to SCHED_IDLE
 	 * and if that fails, then SCHED_BATCH. No need for this to be an
@@ -863,6 +1111,13 @@ CPUSearch:
 	return last_nonce - first_nonce + 1;
 }
 
+static void cpu_thread_shutdown(struct thr_info *thr)
+{
+	// The scrypt scratchpad from cpu_thread_init, if any
+	free(thr->cgpu_data);
+	thr->cgpu_data = NULL;
+}
+
 struct device_drv cpu_drv = {
 	.dname = "cpu",
 	.name = "CPU",
@@ -873,6 +1128,7 @@ struct device_drv cpu_drv = {
 	.can_limit_work = cpu_can_limit_work,
 	.thread_init = cpu_thread_init,
 	.scanhash = cpu_scanhash,
+	.thread_shutdown = cpu_thread_shutdown,
 };
 #endif
 
@@ -46,8 +46,25 @@
 #define WANT_X8664_SSE4 1
 #endif
 
+#if (defined(__i386__) || defined(__x86_64__)) && defined(HAVE_AVX2)
+#define WANT_AVX2_8WAY 1
+#endif
+
+#if (defined(__i386__) || defined(__x86_64__)) && defined(HAVE_AVX512F)
+#define WANT_AVX512_16WAY 1
+#endif
+
+#if defined(WANT_CPUMINE) && defined(HAVE_SHANI)
+#define WANT_SHANI 1
+#endif
+
 #ifdef USE_SCRYPT
 #define WANT_SCRYPT
+#define WANT_SCRYPT_4WAY 1
+#endif
+
+#if defined(WANT_SCRYPT) && defined(WANT_AVX2_8WAY)
+#define WANT_SCRYPT_AVX2_8WAY 1
 #endif
 
 enum sha256_algos {
@@ -60,7 +77,12 @@ enum sha256_algos {
 	ALGO_SSE2_64,		/* SSE2 for x86_64 */
 	ALGO_SSE4_64,		/* SSE4 for x86_64 */
 	ALGO_ALTIVEC_4WAY,	/* parallel Altivec */
+	ALGO_AVX2_8WAY,		/* parallel AVX2 */
+	ALGO_AVX512_16WAY,	/* parallel AVX-512F */
+	ALGO_SHANI,		/* x86 SHA extensions */
 	ALGO_SCRYPT,		/* scrypt */
+	ALGO_SCRYPT_4WAY,	/* parallel scrypt, SSE2 on x86 */
+	ALGO_SCRYPT_AVX2_8WAY,	/* parallel scrypt, AVX2 */
 	
 	ALGO_FASTAUTO,		/* fast autodetect */
 	ALGO_AUTO		/* autodetect */
@@ -75,5 +97,6 @@ extern char *force_nthreads_int(const char *arg, int *i);
 extern void init_max_name_len();
 extern double bench_algo_stage3(enum sha256_algos algo);
 extern void set_scrypt_algo(enum sha256_algos *algo);
+extern void test_cpu_algos();
 
 #endif /* __DEVICE_CPU_H__ */
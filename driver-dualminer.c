@@ -279,8 +279,10 @@ void dualminer_thread_shutdown(struct thr_info *thr)
 	dualminer_teardown_device(thr->cgpu->device_fd);
 
 	// icarus teardown
+	struct icarus_state * const state = thr->cgpu_data;
 	do_icarus_close(thr);
-	free(thr->cgpu_data);
+	vcom_reactor_destroy(&state->reactor);
+	free(state);
 }
 
 static
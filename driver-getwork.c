@@ -25,11 +25,18 @@
 #include <jansson.h>
 #include <microhttpd.h>
 #include <uthash.h>
+#include <utlist.h>
 
 #include "deviceapi.h"
 #include "driver-proxy.h"
 #include "httpsrv.h"
 #include "miner.h"
+#include "util.h"
+
+// nonce2 values reserved from the pool at a time, for each client
+#define GETWORK_NONCE2_RANGE 0x100
+// Most work kept for each client, before expiry
+#define MAX_CLIENT_WORKS 0x1000
 
 static
 void getwork_prepare_resp(struct MHD_Response *resp)
@@ -59,6 +66,138 @@ int getwork_error(struct MHD_Connection *conn, int16_t errcode, const char *errm
 	return ret;
 }
 
+/* Forgets work that has expired, or that is too old to fit within
+ * MAX_CLIENT_WORKS with one more; needs client->work_lock held */
+static
+void getwork_prune(struct proxy_client * const client)
+{
+	struct work *work, *tmp;
+	struct timeval tv_now;
+	int count = HASH_COUNT(client->work);
+	
+	timer_set_now(&tv_now);
+	DL_FOREACH_SAFE(client->work_list, work, tmp)
+	{
+		if (count < MAX_CLIENT_WORKS && timer_elapsed(&work->tv_work_start, &tv_now) <= opt_expiry)
+			break;
+		HASH_DEL(client->work, work);
+		DL_DELETE(client->work_list, work);
+		free_work(work);
+		--count;
+	}
+}
+
+/* Generates work straight from the current pool's stratum job, using a range
+ * of nonce2 reserved for the client, instead of going through the staged
+ * work queue; returns NULL if the pool has no stratum job to use */
+static
+struct work *getwork_gen_stratum_work(struct proxy_client * const client, struct thr_info * const thr)
+{
+	struct cgpu_info * const cgpu = thr->cgpu;
+	struct pool * const pool = current_pool();
+	uint32_t merkle_root[8];
+	struct work *work;
+	
+	if (!pool->has_stratum)
+		return NULL;
+	
+	cg_rlock(&pool->data_lock);
+	if (!(pool->stratum_active && pool->stratum_notify))
+	{
+		cg_runlock(&pool->data_lock);
+		return NULL;
+	}
+	if (client->nonce2_job_id != pool->swork.job_id || client->nonce2_next == client->nonce2_end)
+	{
+		// The pool's nonce2 counter starts over with each job
+		cg_runlock(&pool->data_lock);
+		cg_wlock(&pool->data_lock);
+		// The job may have gone while the lock was dropped
+		if (!(pool->stratum_active && pool->stratum_notify))
+		{
+			cg_wunlock(&pool->data_lock);
+			return NULL;
+		}
+		refstr_unref(client->nonce2_job_id);
+		client->nonce2_job_id = refstr_ref(pool->swork.job_id);
+		client->nonce2_next = pool->nonce2;
+		pool->nonce2 += GETWORK_NONCE2_RANGE;
+		client->nonce2_end = pool->nonce2;
+		cg_dwlock(&pool->data_lock);
+	}
+	work = make_work();
+	stratum_work_set_nonce2(work, pool, client->nonce2_next++);
+	stratum_work_merkle_root2(merkle_root, &pool->swork, bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
+	gen_stratum_work3(work, &pool->swork, pool->nonce1, merkle_root);
+	cg_runlock(&pool->data_lock);
+	
+	cgtime(&work->tv_staged);
+	work->thr_id = thr->id;
+	work->mined = true;
+	if (work->work_difficulty >= 1)
+		work->nonce_diff = 1;
+	else
+	if (work->work_difficulty < cgpu->min_nonce_diff)
+		work->nonce_diff = cgpu->min_nonce_diff;
+	else
+		work->nonce_diff = work->work_difficulty;
+	
+	return work;
+}
+
+/* Handles the usual getwork requests without building a jansson tree: an
+ * integer or null id, and either no params or just the data to submit (which
+ * is NUL terminated in place).  Anything else returns false, untouched, for
+ * the full parser to deal with. */
+static
+bool getwork_parse_fast(char * const s, char ** const idstr_p, const char ** const submit_p)
+{
+	struct stratum_fastjson fj;
+	const char *p, *data = NULL;
+	char idbuf[0x18];
+	size_t len;
+	long long id;
+	
+	if (!stratum_fastjson_scan(&fj, s))
+		return false;
+	if (fj.method && !(fj.method_len == 7 && !memcmp(fj.method, "getwork", 7)))
+		return false;
+	
+	if (!fj.id)
+		idbuf[0] = '\0';
+	else
+	if (fastjson_is(fj.id, "null"))
+		strcpy(idbuf, "null");
+	else
+	if (fastjson_int(fj.id, &id))
+		snprintf(idbuf, sizeof(idbuf), "%lld", id);
+	else
+		return false;
+	
+	if (fj.params)
+	{
+		if (*fj.params != '[')
+			return false;
+		p = fastjson_ws(&fj.params[1]);
+		if (*p != ']')
+		{
+			if (!(data = fastjson_string(p, &len, &p)))
+				return false;
+			if (*fastjson_ws(p) != ']')
+				return false;
+		}
+	}
+	
+	if (data)
+	{
+		((char*)data)[len] = '\0';
+		*submit_p = data;
+	}
+	if (idbuf[0])
+		*idstr_p = strdup(idbuf);
+	return true;
+}
+
 int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 {
 	struct proxy_client *client;
@@ -78,25 +217,33 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 	if (bytes_len(upbuf))
 	{
 		bytes_nullterminate(upbuf);
-		json = JSON_LOADS((char*)bytes_buf(upbuf), &jerr);
-		if (!json)
+		if (getwork_parse_fast((char*)bytes_buf(upbuf), &idstr, &submit))
 		{
-			ret = getwork_error(conn, -32700, "JSON parse error", idstr, idstr_sz);
-			goto out;
+			if (idstr)
+				idstr_sz = strlen(idstr);
 		}
-		j2 = json_object_get(json, "id");
-		if (j2)
-		{
-			idstr = json_dumps_ANY(j2, 0);
-			idstr_sz = strlen(idstr);
-		}
-		if (strcmp("getwork", bfg_json_obj_string(json, "method", "getwork")))
+		else
 		{
-			ret = getwork_error(conn, -32601, "Only getwork supported", idstr, idstr_sz);
-			goto out;
+			json = JSON_LOADS((char*)bytes_buf(upbuf), &jerr);
+			if (!json)
+			{
+				ret = getwork_error(conn, -32700, "JSON parse error", idstr, idstr_sz);
+				goto out;
+			}
+			j2 = json_object_get(json, "id");
+			if (j2)
+			{
+				idstr = json_dumps_ANY(j2, 0);
+				idstr_sz = strlen(idstr);
+			}
+			if (strcmp("getwork", bfg_json_obj_string(json, "method", "getwork")))
+			{
+				ret = getwork_error(conn, -32601, "Only getwork supported", idstr, idstr_sz);
+				goto out;
+			}
+			j2 = json_object_get(json, "params");
+			submit = j2 ? __json_array_string(j2, 0) : NULL;
 		}
-		j2 = json_object_get(json, "params");
-		submit = j2 ? __json_array_string(j2, 0) : NULL;
 	}
 	
 	user = MHD_basic_auth_get_username_password(conn, NULL);
@@ -128,6 +275,7 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 		// NOTE: expecting hex2bin to fail since we only parse 80 of the 128
 		hex2bin(hdr, submit, 80);
 		nonce = le32toh(*(uint32_t *)&hdr[76]);
+		mutex_lock(&client->work_lock);
 		HASH_FIND(hh, client->work, hdr, 76, work);
 		if (!work)
 		{
@@ -152,6 +300,7 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 					hashesdone = "0x100000000";
 			}
 		}
+		mutex_unlock(&client->work_lock);
 		
 		reply = malloc(36 + idstr_sz);
 		const size_t replysz =
@@ -179,7 +328,16 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 	{
 		size_t replysz = 590 + idstr_sz;
 		
-		work = get_work(thr);
+		mutex_lock(&client->work_lock);
+		work = getwork_gen_stratum_work(client, thr);
+		mutex_unlock(&client->work_lock);
+		if (!work)
+		{
+			// get_work can block for a while, so don't hold up submissions
+			mutex_lock(&client->getwork_lock);
+			work = get_work(thr);
+			mutex_unlock(&client->getwork_lock);
+		}
 		reply = malloc(replysz);
 		memcpy(reply, "{\"error\":null,\"result\":{\"target\":\"ffffffffffffffffffffffffffffffffffffffffffffffffffffffff00000000\",\"data\":\"", 108);
 		bin2hex(&reply[108], work->data, 128);
@@ -198,7 +356,11 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 		}
 		
 		timer_set_now(&work->tv_work_start);
+		mutex_lock(&client->work_lock);
+		getwork_prune(client);
 		HASH_ADD_KEYPTR(hh, client->work, work->data, 76, work);
+		DL_APPEND(client->work_list, work);
+		mutex_unlock(&client->work_lock);
 		
 		resp = MHD_create_response_from_buffer(replysz, reply, MHD_RESPMEM_MUST_FREE);
 		getwork_prepare_resp(resp);
@@ -209,7 +371,7 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 	
 out:
 	if (hashesdone)
-		hashes_done2(thr, strtoll(hashesdone, NULL, 0), NULL);
+		proxy_hashes_done(thr, strtoll(hashesdone, NULL, 0), NULL);
 	
 	free(idstr);
 	if (json)
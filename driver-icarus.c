@@ -52,10 +52,6 @@
   #include <windows.h>
   #include <io.h>
 #endif
-#ifdef HAVE_SYS_EPOLL_H
-  #include <sys/epoll.h>
-  #define HAVE_EPOLL
-#endif
 
 #include "compat.h"
 #include "dynclock.h"
@@ -180,104 +176,88 @@ void icarus_log_protocol(int fd, const void *buf, size_t bufLen, const char *pre
 	applog(LOG_DEBUG, "%s fd=%d: DEVPROTO: %s %s", icarus_drv.dname, fd, prefix, hex);
 }
 
-int icarus_gets(unsigned char *buf, int fd, struct timeval *tv_finish, struct thr_info *thr, int read_count, int read_size)
+static
+int _icarus_gets(unsigned char *buf, struct vcom_port * const port, struct vcom_reactor * const reactor, struct timeval * const tv_finish, struct thr_info * const thr, const int read_count, const int read_size)
 {
-	ssize_t ret = 0;
-	int rc = 0;
-	int epollfd = -1;
-	int epoll_timeout = ICARUS_READ_FAULT_DECISECONDS * 100;
+	// Without a registered port, fall back to blocking reads
+	const bool have_reactor = (reactor && port->registered);
+	const int timeout_ms = ICARUS_READ_FAULT_DECISECONDS * 100 * read_count;
+	struct timeval tv_timeout;
+	int rc = 0, remaining_ms;
 	int read_amount = read_size;
+	size_t got;
 	bool first = true;
-
-#ifdef HAVE_EPOLL
-	struct epoll_event ev = {
-		.events = EPOLLIN,
-		.data.fd = fd,
-	};
-	struct epoll_event evr[2];
-	if (thr && thr->work_restart_notifier[1] != -1) {
-	epollfd = epoll_create(2);
-	if (epollfd != -1) {
-		if (-1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev)) {
-			close(epollfd);
-			epollfd = -1;
-		}
-		{
-			ev.data.fd = thr->work_restart_notifier[0];
-			if (-1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, thr->work_restart_notifier[0], &ev))
-				applog(LOG_ERR, "%s: Error adding work restart fd to epoll", __func__);
-			else
-			{
-				epoll_timeout *= read_count;
-				read_count = 1;
-			}
-		}
-	}
-	else
-		applog(LOG_ERR, "%s: Error creating epoll", __func__);
-	}
-#endif
-
-	// Read reply 1 byte at a time to get earliest tv_finish
+	
+	timer_set_delay_from_now(&tv_timeout, (long)timeout_ms * 1000);
 	while (true) {
-#ifdef HAVE_EPOLL
-		if (epollfd != -1 && (ret = epoll_wait(epollfd, evr, 2, epoll_timeout)) != -1)
+		// The port may already hold (part of) the reply
+		got = vcom_port_take(port, buf, read_amount, first ? tv_finish : NULL);
+		if (got)
 		{
-			if (ret == 1 && evr[0].data.fd == fd)
-				ret = read(fd, buf, 1);
-			else
+			buf += got;
+			read_amount -= got;
+			first = false;
+			if (!read_amount)
 			{
-				if (ret)
-					notifier_read(thr->work_restart_notifier);
-				ret = 0;
+				if (opt_dev_protocol && opt_debug)
+					icarus_log_protocol(port->fd, buf - read_size, read_size, "RECV");
+				return ICA_GETS_OK;
 			}
 		}
-		else
-#endif
-		ret = read(fd, buf, 1);
-		if (ret < 0)
+		
+		if (port->error)
 			return ICA_GETS_ERROR;
-
-		if (first)
-			cgtime(tv_finish);
-
-		if (ret >= read_amount)
-		{
-			if (epollfd != -1)
-				close(epollfd);
-
-			if (opt_dev_protocol && opt_debug)
-				icarus_log_protocol(fd, buf, read_size, "RECV");
-
-			return ICA_GETS_OK;
-		}
-
-		if (ret > 0) {
-			buf += ret;
-			read_amount -= ret;
-			first = false;
-			continue;
-		}
-			
+		
 		if (thr && thr->work_restart) {
-			if (epollfd != -1)
-				close(epollfd);
+			if (first)
+				cgtime(tv_finish);
 			applog(LOG_DEBUG, "%s: Interrupted by work restart", __func__);
 			return ICA_GETS_RESTART;
 		}
-
-		rc++;
-		if (rc >= read_count) {
-			if (epollfd != -1)
-				close(epollfd);
+		
+		if (have_reactor)
+		{
+			remaining_ms = -timer_elapsed_us(&tv_timeout, NULL) / 1000;
+			if (remaining_ms <= 0)
+				rc = read_count;
+			else
+			if (vcom_reactor_wait(reactor, remaining_ms) < 0)
+				return ICA_GETS_ERROR;
+		}
+		else
+		{
+			// Blocks for up to ICARUS_READ_FAULT_DECISECONDS; only reads what the caller wants, as the port may not outlive this call
+			if (vcom_port_fill(port, read_amount, NULL) < 0)
+				return ICA_GETS_ERROR;
+			if (!port->len)
+				++rc;
+		}
+		
+		if (first && !port->len)
+			cgtime(tv_finish);
+		
+		if (rc >= read_count && !port->len) {
 			applog(LOG_DEBUG, "%s: No data in %.2f seconds",
 			       __func__,
-			       (float)rc * epoll_timeout / 1000.);
+			       (float)timeout_ms / 1000.);
 			return ICA_GETS_TIMEOUT;
 		}
 	}
 }
 
+int icarus_gets(unsigned char *buf, int fd, struct timeval *tv_finish, struct thr_info *thr, int read_count, int read_size)
+{
+	struct icarus_state * const state = thr ? thr->cgpu_data : NULL;
+	struct vcom_port port;
+	
+	// Only the mining thread keeps a port open between reads
+	if (state && state->port.fd == fd)
+		return _icarus_gets(buf, &state->port, &state->reactor, tv_finish, thr, read_count, read_size);
+	
+	vcom_port_init(&port, fd);
+	return _icarus_gets(buf, &port, NULL, tv_finish, thr, read_count, read_size);
+}
+
 int icarus_write(int fd, const void *buf, size_t bufLen)
 {
 	size_t ret;
@@ -297,12 +277,28 @@ int icarus_write(int fd, const void *buf, size_t bufLen)
 
 #define icarus_close(fd) serial_close(fd)
 
+static
+void icarus_port_open(struct thr_info * const thr, const int fd)
+{
+	struct icarus_state * const state = thr->cgpu_data;
+	
+	vcom_port_init(&state->port, fd);
+	// On failure, port.registered stays false and _icarus_gets uses blocking reads
+	vcom_reactor_add(&state->reactor, &state->port);
+}
+
 void do_icarus_close(struct thr_info *thr)
 {
 	struct cgpu_info *icarus = thr->cgpu;
+	struct icarus_state * const state = thr->cgpu_data;
 	const int fd = icarus->device_fd;
 	if (fd == -1)
 		return;
+	if (state && state->port.fd == fd)
+	{
+		vcom_reactor_del(&state->reactor, &state->port);
+		vcom_port_init(&state->port, -1);
+	}
 	icarus_close(fd);
 	icarus->device_fd = -1;
 }
@@ -631,15 +627,8 @@ static bool icarus_prepare(struct thr_info *thr)
 	struct icarus_state *state;
 	thr->cgpu_data = state = calloc(1, sizeof(*state));
 	state->firstrun = true;
-
-#ifdef HAVE_EPOLL
-	int epollfd = epoll_create(2);
-	if (epollfd != -1)
-	{
-		close(epollfd);
-		notifier_init(thr->work_restart_notifier);
-	}
-#endif
+	vcom_port_init(&state->port, -1);
+	vcom_reactor_init(&state->reactor, &thr->work_restart_notifier);
 
 	icarus->status = LIFE_INIT2;
 	
@@ -661,6 +650,7 @@ bool icarus_init(struct thr_info *thr)
 		return false;
 	}
 	applog(LOG_INFO, "%s: Opened %s", icarus->dev_repr, icarus->device_path);
+	icarus_port_open(thr, fd);
 	
 	BFGINIT(info->job_start_func, icarus_job_start);
 	BFGINIT(state->ob_bin, malloc(info->ob_size));
@@ -734,6 +724,7 @@ static bool icarus_reopen(struct cgpu_info *icarus, struct icarus_state *state,
 		state->firstrun = true;
 		return false;
 	}
+	icarus_port_open(icarus->thr[0], *fdp);
 	return true;
 }
 
@@ -775,6 +766,9 @@ bool icarus_job_start(struct thr_info *thr)
 		dclk_updateFreq(&info->dclk, info->dclk_change_clock_func, thr);
 	}
 	
+	// Whatever is still buffered came in for the last job, and its timestamp
+	// would make this one look like it finished before it started
+	vcom_port_purge(&state->port);
 	cgtime(&state->tv_workstart);
 
 	ret = icarus_write(fd, ob_bin, info->ob_size);
@@ -841,7 +835,7 @@ void handle_identify(struct thr_info * const thr, int ret, const bool was_first_
 			
 			// Try to get more nonces (ignoring work restart)
 			memset(nonce_bin, 0, sizeof(nonce_bin));
-			ret = icarus_gets(nonce_bin, fd, &tv_now, NULL, (info->fullnonce - delapsed) * 10, info->read_size);
+			ret = _icarus_gets(nonce_bin, &state->port, &state->reactor, &tv_now, NULL, (info->fullnonce - delapsed) * 10, info->read_size);
 			if (ret == ICA_GETS_OK)
 			{
 				memcpy(&nonce, nonce_bin, sizeof(nonce));
@@ -969,6 +963,9 @@ keepwaiting:
 
 		tv_start = state->tv_workstart;
 		timersub(&state->tv_workfinish, &tv_start, &elapsed);
+		// A result stamped before the job was sent would make qsec below negative
+		if (elapsed.tv_sec < 0)
+			elapsed.tv_sec = elapsed.tv_usec = 0;
 	}
 	else
 	{
@@ -1344,8 +1341,11 @@ const char *icarus_set_reopen(struct cgpu_info * const proc, const char * const
 
 static void icarus_shutdown(struct thr_info *thr)
 {
+	struct icarus_state * const state = thr->cgpu_data;
+	
 	do_icarus_close(thr);
-	free(thr->cgpu_data);
+	vcom_reactor_destroy(&state->reactor);
+	free(state);
 }
 
 const struct bfg_set_device_definition icarus_set_device_funcs[] = {
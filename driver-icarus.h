@@ -17,6 +17,7 @@
 #include <sys/time.h>
 
 #include "dynclock.h"
+#include "lowl-vcom.h"
 #include "miner.h"
 
 // Fraction of a second, USB timeout is measured in
@@ -131,6 +132,10 @@ struct icarus_state {
 	bool identify;
 	
 	uint8_t *ob_bin;
+	
+	// Stays registered while the device is open, so replies can be read as they arrive
+	struct vcom_reactor reactor;
+	struct vcom_port port;
 };
 
 bool icarus_detect_custom(const char *devpath, struct device_drv *, struct ICARUS_INFO *);
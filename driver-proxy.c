@@ -9,8 +9,6 @@
 
 #include "config.h"
 
-#include <unistd.h>
-
 #include <pthread.h>
 
 #include <uthash.h>
@@ -26,61 +24,14 @@ static
 struct proxy_client *proxy_clients;
 static
 pthread_mutex_t proxy_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-static
-void prune_worklog()
-{
-	struct proxy_client *client, *tmp;
-	struct work *work, *tmp2;
-	struct timeval tv_now;
-	
-	timer_set_now(&tv_now);
-	
-	mutex_lock(&proxy_clients_mutex);
-	HASH_ITER(hh, proxy_clients, client, tmp)
-	{
-		HASH_ITER(hh, client->work, work, tmp2)
-		{
-			if (timer_elapsed(&work->tv_work_start, &tv_now) <= opt_expiry)
-				break;
-			HASH_DEL(client->work, work);
-			free_work(work);
-		}
-	}
-	mutex_unlock(&proxy_clients_mutex);
-}
-
-static
-pthread_t prune_worklog_pth;
-
 static
-void *prune_worklog_thread(void *userdata)
-{
-	struct cgpu_info *cgpu = userdata;
-	
-	pthread_detach(pthread_self());
-	RenameThread("PXY_pruner");
-	
-	while (!cgpu->shutdown)
-	{
-		prune_worklog();
-		sleep(60);
-	}
-	return NULL;
-}
-
-static
-void proxy_first_client(struct cgpu_info *cgpu)
-{
-	pthread_create(&prune_worklog_pth, NULL, prune_worklog_thread, cgpu);
-}
+pthread_mutex_t proxy_hashes_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 struct proxy_client *proxy_find_or_create_client(const char *username)
 {
 	struct proxy_client *client;
 	struct cgpu_info *cgpu;
 	char *user;
-	int b;
 	
 	if (!username)
 		return NULL;
@@ -111,13 +62,11 @@ struct proxy_client *proxy_find_or_create_client(const char *username)
 			.username = user,
 			.cgpu = cgpu,
 		};
+		mutex_init(&client->work_lock);
+		mutex_init(&client->getwork_lock);
 		
-		b = HASH_COUNT(proxy_clients);
 		HASH_ADD_KEYPTR(hh, proxy_clients, client->username, strlen(user), client);
 		mutex_unlock(&proxy_clients_mutex);
-		
-		if (!b)
-			proxy_first_client(cgpu);
 	}
 	else
 	{
@@ -128,6 +77,19 @@ struct proxy_client *proxy_find_or_create_client(const char *username)
 	return client;
 }
 
+/* hashes_done is not safe to call for the same thread concurrently, and both
+ * the getwork and stratum servers report for clients' threads; tvp_hashes may
+ * be NULL to use the time since the last call */
+void proxy_hashes_done(struct thr_info * const thr, const int64_t hashes, struct timeval * const tvp_hashes)
+{
+	mutex_lock(&proxy_hashes_mutex);
+	if (tvp_hashes)
+		hashes_done(thr, hashes, tvp_hashes, NULL);
+	else
+		hashes_done2(thr, hashes, NULL);
+	mutex_unlock(&proxy_hashes_mutex);
+}
+
 #ifdef HAVE_CURSES
 static
 void proxy_wlogprint_status(struct cgpu_info *cgpu)
@@ -1,6 +1,10 @@
 #ifndef BFG_DRIVER_PROXY_H
 #define BFG_DRIVER_PROXY_H
 
+#include <stdint.h>
+
+#include <pthread.h>
+
 #include <uthash.h>
 
 #include "miner.h"
@@ -8,12 +12,24 @@
 struct proxy_client {
 	char *username;
 	struct cgpu_info *cgpu;
-	struct work *work;
 	struct timeval tv_hashes_done;
 	
+	// Getwork server state, protected by work_lock
+	pthread_mutex_t work_lock;
+	// Keeps concurrent getwork requests from sharing the thread in get_work
+	pthread_mutex_t getwork_lock;
+	// Work handed out, by header, and in order of expiry
+	struct work *work;
+	struct work *work_list;
+	// Range of nonce2 values reserved from a stratum job
+	char *nonce2_job_id;
+	uint64_t nonce2_next;
+	uint64_t nonce2_end;
+	
 	UT_hash_handle hh;
 };
 
 extern struct proxy_client *proxy_find_or_create_client(const char *user);
+extern void proxy_hashes_done(struct thr_info *, int64_t hashes, struct timeval *tvp_hashes);
 
 #endif
@@ -15,10 +15,13 @@
 #include <winsock2.h>
 #endif
 
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
+#include <pthread.h>
+
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <event2/event.h>
@@ -32,15 +35,32 @@
 #include "util.h"
 
 #define MAX_CLIENTS 255
+#define MAX_JOB_MERKLE_ROOTS 0x400
+// Accepted shares (or their worth of time) between difficulty retargets
+#define VARDIFF_SHARES 0x10
+
+/* The listener, job list and notify updates live on one thread, while the
+ * connections are spread over stratumsrv_threads worker event bases.
+ * Everything shared between them is protected by _ssm_lock. */
+static pthread_mutex_t _ssm_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static bool _ssm_xnonce1s[MAX_CLIENTS + 1] = { true };
 static uint8_t _ssm_client_octets;
 static uint8_t _ssm_client_xnonce2sz;
 static char *_ssm_notify;
 static int _ssm_notify_sz;
+static unsigned _ssm_notify_gen;
+static const char *_ssm_boot_msg;
 static struct event *ev_notify;
 static notifier_t _ssm_update_notifier;
 
+struct stratumsrv_merkle_root {
+	uint32_t root[8];
+	
+	UT_hash_handle hh;
+	uint8_t nonce2[];
+};
+
 struct stratumsrv_job {
 	char *my_job_id;
 	
@@ -51,31 +71,138 @@ struct stratumsrv_job {
 	struct stratum_work swork;
 	char *nonce1;
 	
+	// One for _ssm_jobs, plus one for each share being checked
+	int refcount;
+	
+	/* Merkle roots already computed, keyed by the full nonce2 (so by
+	 * extranonce1 and extranonce2), least recently used first */
+	pthread_mutex_t merkle_roots_lock;
+	struct stratumsrv_merkle_root *merkle_roots;
+	
 	UT_hash_handle hh;
 };
 
 static struct stratumsrv_job *_ssm_jobs;
 static struct work _ssm_cur_job_work;
+// Highest difficulty (pdiff) a miner may be given without losing shares upstream
+static double _ssm_max_diff = 1;
 static uint64_t _ssm_jobid;
 
 static struct event_base *_smm_evbase;
 static bool _smm_running;
 static struct evconnlistener *_smm_listener;
 
+struct stratumsrv_conn;
+struct stratumsrv_share;
+
+struct stratumsrv_worker {
+	struct event_base *evbase;
+	notifier_t notifier;
+	struct stratumsrv_conn *connections;
+	unsigned notify_gen;
+	bytes_t notify;
+	double max_diff;
+	
+	// Handed over by other threads
+	pthread_mutex_t lock;
+	struct stratumsrv_conn *new_connections;
+	struct stratumsrv_share *checked_shares;
+};
+
+static struct stratumsrv_worker *_ssm_workers;
+static int _ssm_worker_count;
+static int _ssm_next_worker;
+
 struct stratumsrv_conn {
+	struct stratumsrv_worker *worker;
+	evutil_socket_t sock;
+	// NULL once closed, until the last pending share is done with it
 	struct bufferevent *bev;
 	uint32_t xnonce1_le;
 	struct timeval tv_hashes_done;
 	bool hashes_done_ext;
+	int shares_pending;
+	
+	/* Difficulty (pdiff) currently asked of the miner, and the lowest one
+	 * accepted until it gets a new job */
+	double diff;
+	double diff_min;
+	struct timeval tv_vardiff;
+	int vardiff_shares;
 	
 	struct stratumsrv_conn *next;
 };
 
-static struct stratumsrv_conn *_ssm_connections;
+struct stratumsrv_share {
+	struct stratumsrv_conn *conn;
+	struct thr_info *thr;
+	struct stratumsrv_job *ssj;
+	char *idstr;
+	uint32_t xnonce1_le;
+	char extranonce2[(sizeof(uint64_t) * 2) + 1];
+	uint8_t ntime[4];
+	uint32_t nonce;
+	// Difficulty the share is credited with, once checked
+	double diff;
+	double diff_min;
+	
+	int err;
+	const char *emsg;
+	
+	struct stratumsrv_share *prev;
+	struct stratumsrv_share *next;
+};
+
+static pthread_mutex_t _ssm_verify_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _ssm_verify_cond = PTHREAD_COND_INITIALIZER;
+static struct stratumsrv_share *_ssm_verify_queue;
+static bool _ssm_verify_threaded;
+
+static
+void stratumsrv_job_merkle_root(uint32_t * const root, struct stratumsrv_job * const ssj, const uint8_t * const nonce2)
+{
+	struct stratumsrv_merkle_root *mr;
+	
+	mutex_lock(&ssj->merkle_roots_lock);
+	HASH_FIND(hh, ssj->merkle_roots, nonce2, ssj->n2size, mr);
+	if (mr)
+	{
+		// Move it to the end, as the most recently used
+		HASH_DEL(ssj->merkle_roots, mr);
+		HASH_ADD_KEYPTR(hh, ssj->merkle_roots, mr->nonce2, ssj->n2size, mr);
+		memcpy(root, mr->root, sizeof(mr->root));
+		mutex_unlock(&ssj->merkle_roots_lock);
+		return;
+	}
+	mutex_unlock(&ssj->merkle_roots_lock);
+	
+	stratum_work_merkle_root2(root, &ssj->swork, nonce2, ssj->n2size);
+	
+	mutex_lock(&ssj->merkle_roots_lock);
+	// Another thread may have computed the same one meanwhile
+	HASH_FIND(hh, ssj->merkle_roots, nonce2, ssj->n2size, mr);
+	if (!mr)
+	{
+		if (HASH_COUNT(ssj->merkle_roots) >= MAX_JOB_MERKLE_ROOTS)
+		{
+			mr = ssj->merkle_roots;
+			HASH_DEL(ssj->merkle_roots, mr);
+		}
+		else
+			mr = malloc(sizeof(*mr) + ssj->n2size);
+		memcpy(mr->root, root, sizeof(mr->root));
+		memcpy(mr->nonce2, nonce2, ssj->n2size);
+		HASH_ADD_KEYPTR(hh, ssj->merkle_roots, mr->nonce2, ssj->n2size, mr);
+	}
+	mutex_unlock(&ssj->merkle_roots_lock);
+}
 
+/* Never modifies ssj->swork, so shares for the same job can be checked by
+ * several threads at once */
 static
 void _ssm_gen_dummy_work(struct work *work, struct stratumsrv_job *ssj, const char * const extranonce2, uint32_t xnonce1)
 {
+	uint32_t merkle_root[8];
 	uint8_t *p, *s;
 	
 	*work = (struct work){
@@ -96,7 +223,11 @@ void _ssm_gen_dummy_work(struct work *work, struct stratumsrv_job *ssj, const ch
 	memcpy(p, &xnonce1, _ssm_client_octets);
 	if (p != s)
 		memset(s, '\xbb', p - s);
-	gen_stratum_work2(work, &ssj->swork, ssj->nonce1);
+	if (extranonce2)
+		stratumsrv_job_merkle_root(merkle_root, ssj, s);
+	else
+		stratum_work_merkle_root2(merkle_root, &ssj->swork, s, ssj->n2size);
+	gen_stratum_work3(work, &ssj->swork, ssj->nonce1, merkle_root);
 }
 
 static
@@ -104,7 +235,6 @@ bool stratumsrv_update_notify_str(struct pool * const pool, bool clean)
 {
 	cg_rlock(&pool->data_lock);
 	
-	struct stratumsrv_conn *conn;
 	const struct stratum_work * const swork = &pool->swork;
 	const int n2size = pool->n2size;
 	char my_job_id[33];
@@ -112,7 +242,10 @@ bool stratumsrv_update_notify_str(struct pool * const pool, bool clean)
 	struct stratumsrv_job *ssj;
 	ssize_t n2pad = n2size - _ssm_client_octets - _ssm_client_xnonce2sz;
 	if (n2pad < 0)
+	{
+		cg_runlock(&pool->data_lock);
 		return false;
+	}
 	size_t coinb1in_lenx = swork->nonce2_offset * 2;
 	size_t n2padx = n2pad * 2;
 	size_t coinb1_lenx = coinb1in_lenx + n2padx;
@@ -122,7 +255,7 @@ bool stratumsrv_update_notify_str(struct pool * const pool, bool clean)
 	size_t bufsz = 166 + strlen(my_job_id) + coinb1_lenx + coinb2_lenx + (swork->merkles * 67);
 	char * const buf = malloc(bufsz);
 	char *p = buf;
-	char prevhash[65], coinb1[coinb1_lenx + 1], coinb2[coinb2_lenx], version[9], nbits[9], ntime[9];
+	char prevhash[65], coinb1[coinb1_lenx + 1], coinb2[coinb2_lenx + 1], version[9], nbits[9], ntime[9];
 	uint32_t ntime_n;
 	bin2hex(prevhash, &swork->header1[4], 32);
 	bin2hex(coinb1, bytes_buf(&swork->coinbase), swork->nonce2_offset);
@@ -152,8 +285,10 @@ bool stratumsrv_update_notify_str(struct pool * const pool, bool clean)
 		.pool = pool,
 		.work_restart_id = pool->work_restart_id,
 		.n2size = n2size,
-		.nonce1 = strdup(pool->nonce1),
+		.nonce1 = refstr_ref(pool->nonce1),
+		.refcount = 1,
 	};
+	mutex_init(&ssj->merkle_roots_lock);
 	timer_set_now(&ssj->tv_prepared);
 	stratum_work_cpy(&ssj->swork, swork);
 	
@@ -165,18 +300,14 @@ bool stratumsrv_update_notify_str(struct pool * const pool, bool clean)
 	if (likely(_ssm_cur_job_work.pool))
 		clean_work(&_ssm_cur_job_work);
 	_ssm_gen_dummy_work(&_ssm_cur_job_work, ssj, NULL, 0);
+	_ssm_max_diff = pow(2, floor(log2(bdiff_to_pdiff(_ssm_cur_job_work.work_difficulty))));
 	
 	_ssm_notify_sz = p - buf;
 	assert(_ssm_notify_sz <= bufsz);
 	free(_ssm_notify);
 	_ssm_notify = buf;
-	
-	LL_FOREACH(_ssm_connections, conn)
-	{
-		if (unlikely(!conn->xnonce1_le))
-			continue;
-		bufferevent_write(conn->bev, _ssm_notify, _ssm_notify_sz);
-	}
+	_ssm_boot_msg = NULL;
+	++_ssm_notify_gen;
 	
 	return true;
 }
@@ -184,12 +315,39 @@ bool stratumsrv_update_notify_str(struct pool * const pool, bool clean)
 static
 void _ssj_free(struct stratumsrv_job * const ssj)
 {
+	struct stratumsrv_merkle_root *mr, *tmp_mr;
+	
+	HASH_ITER(hh, ssj->merkle_roots, mr, tmp_mr)
+	{
+		HASH_DEL(ssj->merkle_roots, mr);
+		free(mr);
+	}
+	mutex_destroy(&ssj->merkle_roots_lock);
 	free(ssj->my_job_id);
 	stratum_work_clean(&ssj->swork);
-	free(ssj->nonce1);
+	refstr_unref(ssj->nonce1);
 	free(ssj);
 }
 
+// Must be called with _ssm_lock held
+static
+void _ssj_del(struct stratumsrv_job * const ssj)
+{
+	HASH_DEL(_ssm_jobs, ssj);
+	if (!--ssj->refcount)
+		_ssj_free(ssj);
+}
+
+static
+void stratumsrv_job_unref(struct stratumsrv_job * const ssj)
+{
+	mutex_lock(&_ssm_lock);
+	const bool free_ssj = !--ssj->refcount;
+	mutex_unlock(&_ssm_lock);
+	if (free_ssj)
+		_ssj_free(ssj);
+}
+
 static
 void stratumsrv_job_pruner()
 {
@@ -202,9 +360,8 @@ void stratumsrv_job_pruner()
 	{
 		if (timer_elapsed(&ssj->tv_prepared, &tv_now) <= opt_expiry)
 			break;
-		HASH_DEL(_ssm_jobs, ssj);
 		applog(LOG_DEBUG, "SSM: Pruning job_id %s", ssj->my_job_id);
-		_ssj_free(ssj);
+		_ssj_del(ssj);
 	}
 }
 
@@ -232,36 +389,32 @@ void stratumsrv_boot(struct stratumsrv_conn * const conn, const char * const msg
 	bufferevent_setcb(bev, NULL, stratumsrv_conn_close_completion_cb, stratumsrv_event, conn);
 }
 
+// Must be called with _ssm_lock held; msg must be a constant string
 static
 void stratumsrv_boot_all_subscribed(const char * const msg)
 {
-	struct stratumsrv_conn *conn, *tmp_conn;
-	
 	free(_ssm_notify);
 	_ssm_notify = NULL;
 	
-	// Boot all connections
-	LL_FOREACH_SAFE(_ssm_connections, conn, tmp_conn)
-	{
-		if (!conn->xnonce1_le)
-			continue;
-		stratumsrv_boot(conn, msg);
-	}
+	// Boot all connections, once each worker notices
+	_ssm_boot_msg = msg;
+	++_ssm_notify_gen;
 }
 
 static
-void _stratumsrv_update_notify(evutil_socket_t fd, short what, __maybe_unused void *p)
+void stratumsrv_wake_workers()
+{
+	for (int i = 0; i < _ssm_worker_count; ++i)
+		notifier_wake(_ssm_workers[i].notifier);
+}
+
+// Must be called with _ssm_lock held
+static
+void stratumsrv_update_notify()
 {
 	struct pool *pool = current_pool();
 	bool clean;
 	
-	if (fd == _ssm_update_notifier[0])
-	{
-		evtimer_del(ev_notify);
-		notifier_read(_ssm_update_notifier);
-		applog(LOG_DEBUG, "SSM: Update triggered by notifier");
-	}
-	
 	clean = _ssm_cur_job_work.pool ? stale_work(&_ssm_cur_job_work, true) : true;
 	if (clean)
 	{
@@ -269,10 +422,7 @@ void _stratumsrv_update_notify(evutil_socket_t fd, short what, __maybe_unused vo
 		
 		applog(LOG_DEBUG, "SSM: Current replacing job stale, pruning all jobs");
 		HASH_ITER(hh, _ssm_jobs, ssj, tmp)
-		{
-			HASH_DEL(_ssm_jobs, ssj);
-			_ssj_free(ssj);
-		}
+			_ssj_del(ssj);
 	}
 	else
 		stratumsrv_job_pruner();
@@ -282,7 +432,7 @@ void _stratumsrv_update_notify(evutil_socket_t fd, short what, __maybe_unused vo
 		applog(LOG_WARNING, "SSM: Not using a stratum server upstream!");
 		if (clean)
 			stratumsrv_boot_all_subscribed("Current upstream pool does not have active stratum");
-		goto out;
+		return;
 	}
 	
 	if (!stratumsrv_update_notify_str(pool, clean))
@@ -291,22 +441,33 @@ void _stratumsrv_update_notify(evutil_socket_t fd, short what, __maybe_unused vo
 		if (clean)
 			stratumsrv_boot_all_subscribed("Current upstream pool does not have active stratum");
 	}
+}
+
+static
+void _stratumsrv_update_notify(evutil_socket_t fd, short what, __maybe_unused void *p)
+{
+	if (fd == _ssm_update_notifier[0])
+	{
+		evtimer_del(ev_notify);
+		notifier_read(_ssm_update_notifier);
+		applog(LOG_DEBUG, "SSM: Update triggered by notifier");
+	}
+	
+	mutex_lock(&_ssm_lock);
+	stratumsrv_update_notify();
+	mutex_unlock(&_ssm_lock);
+	stratumsrv_wake_workers();
 	
-out: ;
 	struct timeval tv_scantime = {
 		.tv_sec = opt_scantime,
 	};
 	evtimer_add(ev_notify, &tv_scantime);
 }
 
-static struct proxy_client *_stratumsrv_find_or_create_client(const char *);
-
-static
-struct proxy_client *(*stratumsrv_find_or_create_client)(const char *) = _stratumsrv_find_or_create_client;
-
 static
-struct proxy_client *_stratumsrv_find_or_create_client(const char *user)
+struct proxy_client *stratumsrv_find_or_create_client(const char *user)
 {
+	static bool restart_notifier_set;
 	struct proxy_client * const client = proxy_find_or_create_client(user);
 	struct cgpu_info *cgpu;
 	struct thr_info *thr;
@@ -314,11 +475,16 @@ struct proxy_client *_stratumsrv_find_or_create_client(const char *user)
 	if (!client)
 		return NULL;
 	
-	cgpu = client->cgpu;
-	thr = cgpu->thr[0];
-	
-	memcpy(thr->work_restart_notifier, _ssm_update_notifier, sizeof(thr->work_restart_notifier));
-	stratumsrv_find_or_create_client = proxy_find_or_create_client;
+	// Worker threads can get here for their first clients at the same time
+	mutex_lock(&_ssm_lock);
+	if (!restart_notifier_set)
+	{
+		cgpu = client->cgpu;
+		thr = cgpu->thr[0];
+		memcpy(thr->work_restart_notifier, _ssm_update_notifier, sizeof(thr->work_restart_notifier));
+		restart_notifier_set = true;
+	}
+	mutex_unlock(&_ssm_lock);
 	
 	return client;
 }
@@ -352,18 +518,26 @@ void _stratumsrv_success(struct bufferevent * const bev, const char * const idst
 }
 
 static
-void stratumsrv_mining_subscribe(struct bufferevent *bev, json_t *params, const char *idstr, uint32_t *xnonce1_p)
+void stratumsrv_mining_subscribe(struct bufferevent *bev, json_t *params, const char *idstr, struct stratumsrv_conn * const conn)
 {
+	uint32_t * const xnonce1_p = &conn->xnonce1_le;
 	char buf[90 + strlen(idstr) + (_ssm_client_octets * 2 * 2) + 0x10];
 	char xnonce1x[(_ssm_client_octets * 2) + 1];
+	unsigned notify_gen;
 	int bufsz;
 	
+	mutex_lock(&_ssm_lock);
+	notify_gen = _ssm_notify_gen;
+	
 	if (!_ssm_notify)
 	{
-		evtimer_del(ev_notify);
-		_stratumsrv_update_notify(-1, 0, NULL);
+		// The periodic timer keeps running; the new notify goes to everyone
+		stratumsrv_update_notify();
 		if (!_ssm_notify)
+		{
+			mutex_unlock(&_ssm_lock);
 			return_stratumsrv_failure(20, "No notify set (upstream not stratum?)");
+		}
 	}
 	
 	if (!*xnonce1_p)
@@ -371,7 +545,10 @@ void stratumsrv_mining_subscribe(struct bufferevent *bev, json_t *params, const
 		uint32_t xnonce1;
 		for (xnonce1 = MAX_CLIENTS; _ssm_xnonce1s[xnonce1]; --xnonce1)
 			if (!xnonce1)
+			{
+				mutex_unlock(&_ssm_lock);
 				return_stratumsrv_failure(20, "Maximum clients already connected");
+			}
 		_ssm_xnonce1s[xnonce1] = true;
 		*xnonce1_p = htole32(xnonce1);
 	}
@@ -381,6 +558,16 @@ void stratumsrv_mining_subscribe(struct bufferevent *bev, json_t *params, const
 	bufferevent_write(bev, buf, bufsz);
 	bufferevent_write(bev, "{\"params\":[0.9999847412109375],\"id\":null,\"method\":\"mining.set_difficulty\"}\n", 75);
 	bufferevent_write(bev, _ssm_notify, _ssm_notify_sz);
+	// A (re)subscribed miner starts over at difficulty 1, so vardiff does too
+	conn->diff = conn->diff_min = 1;
+	conn->vardiff_shares = 0;
+	timer_set_now(&conn->tv_vardiff);
+	
+	const bool updated = (notify_gen != _ssm_notify_gen);
+	mutex_unlock(&_ssm_lock);
+	
+	if (updated)
+		stratumsrv_wake_workers();
 }
 
 static
@@ -394,15 +581,137 @@ void stratumsrv_mining_authorize(struct bufferevent *bev, json_t *params, const
 	_stratumsrv_success(bev, idstr);
 }
 
+/* Checks a share against its job, without touching the connection, so this
+ * can run on any thread */
 static
-void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const char *idstr, struct stratumsrv_conn * const conn)
+void stratumsrv_check_share(struct stratumsrv_share * const share)
 {
-	uint32_t * const xnonce1_p = &conn->xnonce1_le;
 	struct work _work, *work;
+	
+	// Generate dummy work
+	work = &_work;
+	_ssm_gen_dummy_work(work, share->ssj, share->extranonce2, share->xnonce1_le);
+	
+	memcpy(&work->data[68], share->ntime, 4);
+	
+	// Shares below the miner's own difficulty are never submitted
+	if (share->diff > 1 && test_nonce(work, share->nonce, false))
+	{
+		uint8_t target[32];
+		set_target_to_pdiff(target, share->diff);
+		if (!hash_target_check_v(work->hash, target))
+		{
+			// Miners may keep using their old difficulty until the next job
+			share->diff = share->diff_min;
+			set_target_to_pdiff(target, share->diff);
+			if (share->diff > 1 && !hash_target_check_v(work->hash, target))
+			{
+				share->err = 23;
+				share->emsg = "low-difficulty";
+				goto out;
+			}
+		}
+	}
+	
+	// Submit nonce
+	if (!submit_nonce(share->thr, work, share->nonce))
+	{
+		share->err = 23;
+		share->emsg = "H-not-zero";
+	}
+	else
+	if (stale_work(work, true))
+	{
+		share->err = 21;
+		share->emsg = "stale";
+	}
+	
+out:
+	clean_work(work);
+	
+	stratumsrv_job_unref(share->ssj);
+	share->ssj = NULL;
+}
+
+static
+void stratumsrv_set_difficulty(struct stratumsrv_conn * const conn, const double pdiff)
+{
+	char buf[0x80];
+	int bufsz;
+	
+	conn->diff = pdiff;
+	if (pdiff < conn->diff_min)
+		conn->diff_min = pdiff;
+	bufsz = sprintf(buf, "{\"params\":[%.16g],\"id\":null,\"method\":\"mining.set_difficulty\"}\n", pdiff * 0.9999847412109375);
+	bufferevent_write(conn->bev, buf, bufsz);
+}
+
+/* Moves the miner's difficulty towards stratumsrv_share_rate shares per
+ * minute, in powers of two so small hashrate changes are ignored */
+static
+void stratumsrv_vardiff(struct stratumsrv_conn * const conn)
+{
+	struct timeval tv_now;
+	double elapsed, pdiff;
+	
+	++conn->vardiff_shares;
+	timer_set_now(&tv_now);
+	elapsed = tdiff(&tv_now, &conn->tv_vardiff);
+	if (conn->vardiff_shares < VARDIFF_SHARES && elapsed < VARDIFF_SHARES * 60. / stratumsrv_share_rate)
+		return;
+	
+	pdiff = conn->diff * conn->vardiff_shares * 60. / (elapsed * stratumsrv_share_rate);
+	pdiff = pow(2, floor(log2(pdiff)));
+	if (pdiff > conn->worker->max_diff)
+		pdiff = conn->worker->max_diff;
+	if (pdiff < 1)
+		pdiff = 1;
+	
+	conn->vardiff_shares = 0;
+	conn->tv_vardiff = tv_now;
+	if (pdiff != conn->diff)
+		stratumsrv_set_difficulty(conn, pdiff);
+}
+
+// Replies to a checked share, on its connection's worker thread
+static
+void stratumsrv_share_done(struct stratumsrv_share * const share)
+{
+	struct stratumsrv_conn * const conn = share->conn;
+	struct bufferevent * const bev = conn->bev;
+	
+	if (bev)
+	{
+		if (share->err)
+			_stratumsrv_failure(bev, share->idstr, share->err, share->emsg);
+		else
+			_stratumsrv_success(bev, share->idstr);
+		
+		if (!conn->hashes_done_ext)
+		{
+			struct timeval tv_now, tv_delta;
+			timer_set_now(&tv_now);
+			timersub(&tv_now, &conn->tv_hashes_done, &tv_delta);
+			conn->tv_hashes_done = tv_now;
+			proxy_hashes_done(share->thr, share->diff * 0x100000000, &tv_delta);
+		}
+		
+		// Scrypt shares are only ever checked at difficulty 1
+		if (stratumsrv_share_rate && !(share->err || opt_scrypt))
+			stratumsrv_vardiff(conn);
+	}
+	
+	free(share->idstr);
+	free(share);
+}
+
+static
+void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const char *idstr, struct stratumsrv_conn * const conn)
+{
 	struct stratumsrv_job *ssj;
+	struct stratumsrv_share *share;
 	struct proxy_client *client = stratumsrv_find_or_create_client(__json_array_string(params, 0));
 	struct cgpu_info *cgpu;
-	struct thr_info *thr;
 	const char * const job_id = __json_array_string(params, 1);
 	const char * const extranonce2 = __json_array_string(params, 2);
 	const char * const ntime = __json_array_string(params, 3);
@@ -421,39 +730,43 @@ void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const cha
 		return_stratumsrv_failure(20, "extranonce2 too short");
 	
 	cgpu = client->cgpu;
-	thr = cgpu->thr[0];
 	
 	// Lookup job_id
+	mutex_lock(&_ssm_lock);
 	HASH_FIND_STR(_ssm_jobs, job_id, ssj);
+	if (ssj)
+		++ssj->refcount;
+	mutex_unlock(&_ssm_lock);
 	if (!ssj)
 		return_stratumsrv_failure(21, "Job not found");
 	
-	// Generate dummy work
-	work = &_work;
-	_ssm_gen_dummy_work(work, ssj, extranonce2, *xnonce1_p);
-	
-	// Submit nonce
-	hex2bin(&work->data[68], ntime, 4);
+	share = malloc(sizeof(*share));
+	*share = (struct stratumsrv_share){
+		.conn = conn,
+		.thr = cgpu->thr[0],
+		.ssj = ssj,
+		.idstr = maybe_strdup(idstr),
+		.xnonce1_le = conn->xnonce1_le,
+		.diff = conn->diff,
+		.diff_min = conn->diff_min,
+	};
+	memcpy(share->extranonce2, extranonce2, _ssm_client_xnonce2sz * 2);
+	hex2bin(share->ntime, ntime, 4);
 	hex2bin((void*)&nonce_n, nonce, 4);
-	nonce_n = le32toh(nonce_n);
-	if (!submit_nonce(thr, work, nonce_n))
-		_stratumsrv_failure(bev, idstr, 23, "H-not-zero");
-	else
-	if (stale_work(work, true))
-		_stratumsrv_failure(bev, idstr, 21, "stale");
-	else
-		_stratumsrv_success(bev, idstr);
-	
-	clean_work(work);
+	share->nonce = le32toh(nonce_n);
 	
-	if (!conn->hashes_done_ext)
+	if (!_ssm_verify_threaded)
 	{
-		struct timeval tv_now, tv_delta;
-		timer_set_now(&tv_now);
-		timersub(&tv_now, &conn->tv_hashes_done, &tv_delta);
-		conn->tv_hashes_done = tv_now;
-		hashes_done(thr, 0x100000000, &tv_delta, NULL);
+		stratumsrv_check_share(share);
+		stratumsrv_share_done(share);
+		return;
 	}
+	
+	++conn->shares_pending;
+	mutex_lock(&_ssm_verify_lock);
+	DL_APPEND(_ssm_verify_queue, share);
+	pthread_cond_signal(&_ssm_verify_cond);
+	mutex_unlock(&_ssm_verify_lock);
 }
 
 static
@@ -478,7 +791,7 @@ void stratumsrv_mining_hashes_done(struct bufferevent * const bev, json_t * cons
 	tv_delta.tv_usec = (f - tv_delta.tv_sec) * 1e6;
 	
 	f = json_number_value(jhashcount);
-	hashes_done(thr, f, &tv_delta, NULL);
+	proxy_hashes_done(thr, f, &tv_delta);
 	
 	conn->hashes_done_ext = true;
 }
@@ -531,7 +844,7 @@ errout:
 		stratumsrv_mining_authorize(bev, params, idstr, &conn->xnonce1_le);
 	else
 	if (!strcasecmp(method, "mining.subscribe"))
-		stratumsrv_mining_subscribe(bev, params, idstr, &conn->xnonce1_le);
+		stratumsrv_mining_subscribe(bev, params, idstr, conn);
 	else
 		_stratumsrv_failure(bev, idstr, -3, "Method not supported");
 	
@@ -547,9 +860,16 @@ void stratumsrv_client_close(struct stratumsrv_conn * const conn)
 	uint32_t xnonce1 = le32toh(conn->xnonce1_le);
 	
 	bufferevent_free(bev);
-	LL_DELETE(_ssm_connections, conn);
-	free(conn);
-	_ssm_xnonce1s[xnonce1] = false;
+	conn->bev = NULL;
+	LL_DELETE(conn->worker->connections, conn);
+	if (!conn->shares_pending)
+		free(conn);
+	if (xnonce1)
+	{
+		mutex_lock(&_ssm_lock);
+		_ssm_xnonce1s[xnonce1] = false;
+		mutex_unlock(&_ssm_lock);
+	}
 }
 
 static
@@ -584,19 +904,153 @@ void stratumsrv_event(struct bufferevent *bev, short events, void *p)
 	}
 }
 
+// Brings a worker up to date with the latest notify (or boot)
+static
+void stratumsrv_worker_update_notify(struct stratumsrv_worker * const worker)
+{
+	struct stratumsrv_conn *conn, *tmp_conn;
+	const char *boot_msg = NULL;
+	
+	mutex_lock(&_ssm_lock);
+	if (worker->notify_gen == _ssm_notify_gen)
+	{
+		mutex_unlock(&_ssm_lock);
+		return;
+	}
+	worker->notify_gen = _ssm_notify_gen;
+	worker->max_diff = _ssm_max_diff;
+	if (_ssm_notify)
+	{
+		bytes_resize(&worker->notify, _ssm_notify_sz);
+		memcpy(bytes_buf(&worker->notify), _ssm_notify, _ssm_notify_sz);
+	}
+	else
+	{
+		bytes_resize(&worker->notify, 0);
+		boot_msg = _ssm_boot_msg;
+	}
+	mutex_unlock(&_ssm_lock);
+	
+	LL_FOREACH_SAFE(worker->connections, conn, tmp_conn)
+	{
+		if (unlikely(!conn->xnonce1_le))
+			continue;
+		if (boot_msg)
+			stratumsrv_boot(conn, boot_msg);
+		else
+		if (bytes_len(&worker->notify))
+		{
+			// The new job may have an easier upstream target than the miner's
+			if (conn->diff > worker->max_diff && conn->diff > 1)
+				stratumsrv_set_difficulty(conn, (worker->max_diff > 1) ? worker->max_diff : 1);
+			bufferevent_write(conn->bev, bytes_buf(&worker->notify), bytes_len(&worker->notify));
+			conn->diff_min = conn->diff;
+		}
+	}
+}
+
+static
+void stratumsrv_worker_wake(__maybe_unused evutil_socket_t fd, __maybe_unused short what, void * const p)
+{
+	struct stratumsrv_worker * const worker = p;
+	struct stratumsrv_conn *conn, *tmp_conn, *new_connections;
+	struct stratumsrv_share *share, *tmp_share, *checked_shares;
+	
+	notifier_read(worker->notifier);
+	
+	mutex_lock(&worker->lock);
+	new_connections = worker->new_connections;
+	worker->new_connections = NULL;
+	checked_shares = worker->checked_shares;
+	worker->checked_shares = NULL;
+	mutex_unlock(&worker->lock);
+	
+	LL_FOREACH_SAFE(new_connections, conn, tmp_conn)
+	{
+		struct bufferevent * const bev = bufferevent_socket_new(worker->evbase, conn->sock, BEV_OPT_CLOSE_ON_FREE);
+		conn->bev = bev;
+		timer_set_now(&conn->tv_vardiff);
+		LL_PREPEND(worker->connections, conn);
+		bufferevent_setcb(bev, stratumsrv_read, NULL, stratumsrv_event, conn);
+		bufferevent_enable(bev, EV_READ | EV_WRITE);
+	}
+	
+	DL_FOREACH_SAFE(checked_shares, share, tmp_share)
+	{
+		conn = share->conn;
+		--conn->shares_pending;
+		stratumsrv_share_done(share);
+		if (unlikely(!(conn->bev || conn->shares_pending)))
+			free(conn);
+	}
+	
+	stratumsrv_worker_update_notify(worker);
+}
+
+static
+void *stratumsrv_worker_thread(void * const p)
+{
+	struct stratumsrv_worker * const worker = p;
+	
+	pthread_detach(pthread_self());
+	RenameThread("stratumsrv_io");
+	
+	event_base_dispatch(worker->evbase);
+	
+	return NULL;
+}
+
+static
+void *stratumsrv_verify_thread(__maybe_unused void *p)
+{
+	struct stratumsrv_worker *worker;
+	struct stratumsrv_share *share;
+	
+	pthread_detach(pthread_self());
+	RenameThread("stratumsrv_chk");
+	
+	while (true)
+	{
+		mutex_lock(&_ssm_verify_lock);
+		while (!_ssm_verify_queue)
+			pthread_cond_wait(&_ssm_verify_cond, &_ssm_verify_lock);
+		share = _ssm_verify_queue;
+		DL_DELETE(_ssm_verify_queue, share);
+		mutex_unlock(&_ssm_verify_lock);
+		
+		stratumsrv_check_share(share);
+		
+		// The connection is kept around until its pending shares are done
+		worker = share->conn->worker;
+		mutex_lock(&worker->lock);
+		DL_APPEND(worker->checked_shares, share);
+		mutex_unlock(&worker->lock);
+		notifier_wake(worker->notifier);
+	}
+	
+	return NULL;
+}
+
 static
 void stratumlistener(struct evconnlistener *listener, evutil_socket_t sock, struct sockaddr *addr, int len, void *p)
 {
+	struct stratumsrv_worker * const worker = &_ssm_workers[_ssm_next_worker];
 	struct stratumsrv_conn *conn;
-	struct event_base *evbase = evconnlistener_get_base(listener);
-	struct bufferevent *bev = bufferevent_socket_new(evbase, sock, BEV_OPT_CLOSE_ON_FREE);
+	
+	_ssm_next_worker = (_ssm_next_worker + 1) % _ssm_worker_count;
+	
 	conn = malloc(sizeof(*conn));
 	*conn = (struct stratumsrv_conn){
-		.bev = bev,
+		.worker = worker,
+		.sock = sock,
+		// mining.subscribe always starts miners at difficulty 1
+		.diff = 1,
+		.diff_min = 1,
 	};
-	LL_PREPEND(_ssm_connections, conn);
-	bufferevent_setcb(bev, stratumsrv_read, NULL, stratumsrv_event, conn);
-	bufferevent_enable(bev, EV_READ | EV_WRITE);
+	mutex_lock(&worker->lock);
+	LL_PREPEND(worker->new_connections, conn);
+	mutex_unlock(&worker->lock);
+	notifier_wake(worker->notifier);
 }
 
 void stratumsrv_start();
@@ -621,7 +1075,7 @@ void stratumsrv_change_port()
 	};
 	_smm_listener = evconnlistener_new_bind(evbase, stratumlistener, NULL, (
 		LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC | LEV_OPT_REUSEABLE
-	), 0x10, (void*)&sin, sizeof(sin));
+	), 0x100, (void*)&sin, sizeof(sin));
 }
 
 static
@@ -634,6 +1088,30 @@ void *stratumsrv_thread(__maybe_unused void *p)
 		++_ssm_client_octets;
 	_ssm_client_xnonce2sz = 2;
 	
+	_ssm_worker_count = (stratumsrv_threads > 0) ? stratumsrv_threads : 1;
+	_ssm_workers = calloc(_ssm_worker_count, sizeof(*_ssm_workers));
+	for (int i = 0; i < _ssm_worker_count; ++i)
+	{
+		struct stratumsrv_worker * const worker = &_ssm_workers[i];
+		pthread_t pth;
+		
+		worker->evbase = event_base_new();
+		notifier_init(worker->notifier);
+		mutex_init(&worker->lock);
+		struct event *ev_wake = event_new(worker->evbase, worker->notifier[0], EV_READ | EV_PERSIST, stratumsrv_worker_wake, worker);
+		event_add(ev_wake, NULL);
+		if (unlikely(pthread_create(&pth, NULL, stratumsrv_worker_thread, worker)))
+			quit(1, "stratumsrv worker thread create failed");
+	}
+	
+	_ssm_verify_threaded = (stratumsrv_verify_threads > 0);
+	for (int i = 0; i < stratumsrv_verify_threads; ++i)
+	{
+		pthread_t pth;
+		if (unlikely(pthread_create(&pth, NULL, stratumsrv_verify_thread, NULL)))
+			quit(1, "stratumsrv verify thread create failed");
+	}
+	
 	struct event_base *evbase = event_base_new();
 	_smm_evbase = evbase;
 	{
@@ -657,4 +1135,89 @@ void stratumsrv_start()
 	pthread_t pth;
 	if (unlikely(pthread_create(&pth, NULL, stratumsrv_thread, NULL)))
 		quit(1, "stratumsrv thread create failed");
-}
\ No newline at end of file
+}
+static
+void _test_stratumsrv_vardiff(struct stratumsrv_conn * const conn, struct evbuffer * const sent, const double diff, const int shares, const int secs, const double expect)
+{
+	const double expect_min = (expect < diff) ? expect : diff;
+	const bool due = (shares >= VARDIFF_SHARES || secs * stratumsrv_share_rate >= VARDIFF_SHARES * 60);
+	
+	conn->diff = conn->diff_min = diff;
+	conn->vardiff_shares = shares - 1;
+	timer_set_now(&conn->tv_vardiff);
+	conn->tv_vardiff.tv_sec -= secs;
+	evbuffer_drain(sent, evbuffer_get_length(sent));
+	
+	stratumsrv_vardiff(conn);
+	if (conn->diff != expect || conn->diff_min != expect_min)
+		applog(LOG_ERR, "%s: %d shares in %ds at diff %g retargeted to %g (min %g), expected %g (min %g)",
+		       __func__, shares, secs, diff, conn->diff, conn->diff_min, expect, expect_min);
+	// The miner is only told about changes
+	if ((expect != diff) != (evbuffer_search(sent, "mining.set_difficulty", 21, NULL).pos != -1))
+		applog(LOG_ERR, "%s: %d shares in %ds at diff %g: set_difficulty %ssent",
+		       __func__, shares, secs, diff, (expect != diff) ? "not " : "");
+	if (due ? (conn->vardiff_shares || timer_elapsed_us(&conn->tv_vardiff, NULL) > 1000000) : (conn->vardiff_shares != shares))
+		applog(LOG_ERR, "%s: %d shares in %ds at diff %g: Share count and timer %sreset",
+		       __func__, shares, secs, diff, due ? "not " : "");
+}
+
+void test_stratumsrv_vardiff()
+{
+	const int share_rate = stratumsrv_share_rate;
+	struct stratumsrv_worker worker = {
+		.max_diff = 0x400,
+	};
+	struct stratumsrv_conn conn = {
+		.worker = &worker,
+		.xnonce1_le = htole32(1),
+	};
+	struct event_base * const evbase = event_base_new();
+	struct bufferevent *pair[2];
+	struct evbuffer *sent;
+	char *notify, *old_notify;
+	int old_notify_sz;
+	
+	// Whatever is written to the connection turns up in sent
+	bufferevent_pair_new(evbase, 0, pair);
+	bufferevent_enable(pair[1], EV_READ);
+	conn.bev = pair[0];
+	sent = bufferevent_get_input(pair[1]);
+	stratumsrv_share_rate = 20;
+	
+	_test_stratumsrv_vardiff(&conn, sent, 1, 0x10, 5, 8);
+	_test_stratumsrv_vardiff(&conn, sent, 0x40, 1, 120, 1);
+	_test_stratumsrv_vardiff(&conn, sent, 4, 0x10, 40, 4);
+	// Never above what the upstream job allows, nor below 1
+	_test_stratumsrv_vardiff(&conn, sent, 0x200, 0x10, 1, 0x400);
+	_test_stratumsrv_vardiff(&conn, sent, 1, 1, 600, 1);
+	// Too soon and too few shares to say anything yet
+	_test_stratumsrv_vardiff(&conn, sent, 8, 2, 1, 8);
+	
+	// A re-subscribe puts the miner back at difficulty 1, and vardiff with it
+	_test_stratumsrv_vardiff(&conn, sent, 1, 0x10, 5, 8);
+	notify = strdup("{\"params\":[],\"id\":null,\"method\":\"mining.notify\"}\n");
+	mutex_lock(&_ssm_lock);
+	old_notify = _ssm_notify;
+	old_notify_sz = _ssm_notify_sz;
+	_ssm_notify = notify;
+	_ssm_notify_sz = strlen(notify);
+	mutex_unlock(&_ssm_lock);
+	evbuffer_drain(sent, evbuffer_get_length(sent));
+	conn.vardiff_shares = 5;
+	stratumsrv_mining_subscribe(conn.bev, NULL, "1", &conn);
+	if (conn.diff != 1 || conn.diff_min != 1 || conn.vardiff_shares)
+		applog(LOG_ERR, "%s: Re-subscribe left diff %g (min %g) with %d shares counted",
+		       __func__, conn.diff, conn.diff_min, conn.vardiff_shares);
+	if (evbuffer_search(sent, "[0.9999847412109375]", 20, NULL).pos == -1)
+		applog(LOG_ERR, "%s: Re-subscribe did not send difficulty 1", __func__);
+	mutex_lock(&_ssm_lock);
+	_ssm_notify = old_notify;
+	_ssm_notify_sz = old_notify_sz;
+	mutex_unlock(&_ssm_lock);
+	free(notify);
+	
+	stratumsrv_share_rate = share_rate;
+	bufferevent_free(pair[0]);
+	bufferevent_free(pair[1]);
+	event_base_free(evbase);
+}
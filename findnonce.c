@@ -161,12 +161,9 @@ static void *postcalc_hash(void *userdata)
 		pcd->res[found] &= found;
 	}
 
-	for (entry = 0; entry < pcd->res[found]; entry++) {
-		uint32_t nonce = pcd->res[entry];
-
-		applog(LOG_DEBUG, "OCL NONCE %u found in slot %d", nonce, entry);
-		submit_nonce(thr, &pcd->work, nonce);
-	}
+	for (entry = 0; entry < pcd->res[found]; entry++)
+		applog(LOG_DEBUG, "OCL NONCE %u found in slot %d", pcd->res[entry], entry);
+	submit_nonces_batch(thr, &pcd->work, pcd->res, pcd->res[found]);
 
 	clean_work(&pcd->work);
 	free(pcd);
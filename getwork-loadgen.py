@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+# Copyright 2026 agent <agent@local>
+#
+# This program is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 3 of the License, or (at your option) any
+# later version.  See COPYING for more details.
+
+# Simulates many getwork miners on keep-alive connections to the getwork
+# server (--http-port), and reports requests per second and latency.
+# Submitted shares are random, so nearly all are rejected, but each one still
+# goes through the same lookup and checking as a real share.
+
+import argparse
+import base64
+import json
+import random
+import selectors
+import socket
+import time
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--hostname", default="localhost")
+parser.add_argument("--port", type=int, default=8330)
+parser.add_argument("--clients", type=int, default=100)
+parser.add_argument("--users", type=int, default=1, help="number of distinct usernames")
+parser.add_argument("--pipeline", type=int, default=1, help="requests in flight on each connection")
+parser.add_argument("--submit-ratio", type=float, default=0.5, help="fraction of requests that submit a share for earlier work")
+parser.add_argument("--duration", type=float, default=0, help="seconds to run (0 means forever)")
+args = parser.parse_args()
+
+sel = selectors.DefaultSelector()
+
+class Client:
+	def __init__(self, n):
+		user = "loadgen%d" % (n % args.users,)
+		self.auth = base64.b64encode(("%s:x" % (user,)).encode()).decode()
+		self.sock = socket.create_connection((args.hostname, args.port))
+		self.sock.setblocking(False)
+		self.inbuf = b''
+		self.outbuf = b''
+		self.work = []
+		self.nextid = 1
+		self.sent = []
+		sel.register(self.sock, selectors.EVENT_READ, self)
+		for i in range(args.pipeline):
+			self.request()
+
+	def request(self):
+		params = []
+		if self.work and random.random() < args.submit_ratio:
+			data = random.choice(self.work)
+			params = [data[:152] + '%08x' % (random.getrandbits(32),) + data[160:]]
+		body = json.dumps({"method": "getwork", "params": params, "id": self.nextid}).encode()
+		self.nextid += 1
+		self.outbuf += (
+			"POST / HTTP/1.1\r\n"
+			"Host: %s:%d\r\n"
+			"Authorization: Basic %s\r\n"
+			"Content-Type: application/json\r\n"
+			"Content-Length: %d\r\n"
+			"\r\n" % (args.hostname, args.port, self.auth, len(body))
+		).encode() + body
+		self.sent.append((time.time(), bool(params)))
+		self.flush()
+
+	def flush(self):
+		try:
+			n = self.sock.send(self.outbuf)
+		except BlockingIOError:
+			n = 0
+		self.outbuf = self.outbuf[n:]
+		sel.modify(self.sock, selectors.EVENT_READ | (selectors.EVENT_WRITE if self.outbuf else 0), self)
+
+	def read(self):
+		try:
+			data = self.sock.recv(0x10000)
+		except BlockingIOError:
+			return
+		if not data:
+			raise EOFError
+		self.inbuf += data
+		while True:
+			hdrend = self.inbuf.find(b'\r\n\r\n')
+			if hdrend < 0:
+				break
+			headers = self.inbuf[:hdrend].decode().split('\r\n')
+			status = int(headers[0].split()[1])
+			length = 0
+			rejreason = None
+			for line in headers[1:]:
+				(k, v) = line.split(':', 1)
+				k = k.lower()
+				if k == 'content-length':
+					length = int(v)
+				elif k == 'x-reject-reason':
+					rejreason = v.strip()
+			if len(self.inbuf) < hdrend + 4 + length:
+				break
+			body = self.inbuf[hdrend + 4:hdrend + 4 + length]
+			self.inbuf = self.inbuf[hdrend + 4 + length:]
+			self.handle(status, rejreason, body)
+
+	def handle(self, status, rejreason, body):
+		(t, submit) = self.sent.pop(0)
+		latency = time.time() - t
+		stats['latencies'].append(latency)
+		stats['submits' if submit else 'getworks'] += 1
+		if status != 200:
+			err = 'HTTP %d' % (status,)
+			stats['errors'][err] = stats['errors'].get(err, 0) + 1
+		elif rejreason:
+			stats['errors'][rejreason] = stats['errors'].get(rejreason, 0) + 1
+		elif not submit:
+			self.work.append(json.loads(body.decode())['result']['data'])
+			del self.work[:-0x10]
+		self.request()
+
+def reset_stats():
+	return {'getworks': 0, 'submits': 0, 'latencies': [], 'errors': {}}
+
+def drop(client):
+	print('Client disconnected')
+	sel.unregister(client.sock)
+	client.sock.close()
+	clients.remove(client)
+
+stats = reset_stats()
+clients = []
+for i in range(args.clients):
+	clients.append(Client(i))
+
+start = last_report = time.time()
+while clients:
+	now = time.time()
+	if args.duration and now - start >= args.duration:
+		break
+
+	for (key, events) in sel.select(timeout=0.1):
+		client = key.data
+		try:
+			if events & selectors.EVENT_READ:
+				client.read()
+			if events & selectors.EVENT_WRITE:
+				client.flush()
+		except (EOFError, ConnectionError):
+			drop(client)
+
+	if now - last_report >= 1:
+		elapsed = now - last_report
+		latencies = sorted(stats['latencies'])
+		if latencies:
+			avglatency = sum(latencies) / len(latencies)
+			p99latency = latencies[int(len(latencies) * .99)]
+		else:
+			avglatency = p99latency = 0
+		print('%d clients: %.0f requests/s (%.0f getwork, %.0f submit), latency avg %.1fms p99 %.1fms, errors %s' % (
+			len(clients), len(latencies) / elapsed,
+			stats['getworks'] / elapsed, stats['submits'] / elapsed,
+			avglatency * 1e3, p99latency * 1e3, stats['errors']))
+		stats = reset_stats()
+		last_report = now
@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef WIN32
 #include <sys/types.h>
@@ -28,11 +29,13 @@
 #include <microhttpd.h>
 
 #include "logging.h"
+#include "miner.h"
 #include "util.h"
 
 static struct MHD_Daemon *httpsrv;
 
 extern int handle_getwork(struct MHD_Connection *, bytes_t *);
+extern int handle_metrics(struct MHD_Connection *);
 
 void httpsrv_prepare_resp(struct MHD_Response *resp)
 {
@@ -42,6 +45,8 @@ void httpsrv_prepare_resp(struct MHD_Response *resp)
 static
 int httpsrv_handle_req(struct MHD_Connection *conn, const char *url, const char *method, bytes_t *upbuf)
 {
+	if (httpsrv_metrics && !strcmp(url, "/metrics"))
+		return handle_metrics(conn);
 	return handle_getwork(conn, upbuf);
 }
 
@@ -90,15 +95,44 @@ void httpsrv_log(void *arg, const char *fmt, va_list ap)
 	_applog(LOG_DEBUG, tmp42);
 }
 
-void httpsrv_start(unsigned short port)
+static
+struct MHD_Daemon *httpsrv_start_daemon(const unsigned int flags, const unsigned short port)
 {
-	httpsrv = MHD_start_daemon(
-		MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG,
+	return MHD_start_daemon(
+		flags,
 		port, NULL, NULL,
 		&httpsrv_handle_access, NULL,
 		MHD_OPTION_NOTIFY_COMPLETED, &httpsrv_cleanup_request, NULL,
 		MHD_OPTION_EXTERNAL_LOGGER, &httpsrv_log, NULL,
+		MHD_OPTION_THREAD_POOL_SIZE, (unsigned int)((httpsrv_threads > 1) ? httpsrv_threads : 0),
 	MHD_OPTION_END);
+}
+
+void httpsrv_start(unsigned short port)
+{
+	unsigned int flags = MHD_USE_DEBUG;
+	
+	if (httpsrv_threads)
+	{
+		flags |= MHD_USE_SELECT_INTERNALLY;
+#if defined(__linux__) && MHD_VERSION >= 0x00092100
+		// Each thread of the pool polls its own share of the connections
+		if (httpsrv_threads > 1)
+			flags |= MHD_USE_EPOLL_LINUX_ONLY;
+#endif
+	}
+	else
+		flags |= MHD_USE_THREAD_PER_CONNECTION;
+	
+	httpsrv = httpsrv_start_daemon(flags, port);
+#if defined(__linux__) && MHD_VERSION >= 0x00092100
+	if (!httpsrv && (flags & MHD_USE_EPOLL_LINUX_ONLY))
+	{
+		// libmicrohttpd may have been built without epoll support
+		applog(LOG_WARNING, "Failed to start HTTP server with epoll, retrying with select");
+		httpsrv = httpsrv_start_daemon(flags & ~MHD_USE_EPOLL_LINUX_ONLY, port);
+	}
+#endif
 	if (httpsrv)
 		applog(LOG_NOTICE, "HTTP server listening on port %d", (int)port);
 	else
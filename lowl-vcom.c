@@ -78,6 +78,10 @@ enum {
 #include <sys/ioctl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #include "logging.h"
 #include "lowlevel.h"
 #include "miner.h"
@@ -1095,8 +1099,291 @@ ssize_t _serial_read(int fd, char *buf, size_t bufsiz, char *eol)
 	return tlen;
 }
 
+void vcom_port_init(struct vcom_port * const port, const int fd)
+{
+	port->fd = fd;
+	port->len = 0;
+	port->error = false;
+	port->registered = false;
+}
+
+ssize_t vcom_port_fill(struct vcom_port * const port, size_t maxlen, const struct timeval *tv_ready)
+{
+	struct timeval tv_now;
+	ssize_t r;
+	
+	if (maxlen > sizeof(port->buf) - port->len)
+		maxlen = sizeof(port->buf) - port->len;
+	if (!maxlen)
+		return 0;
+	r = read(port->fd, &port->buf[port->len], maxlen);
+	if (r < 0)
+	{
+		port->error = true;
+		return r;
+	}
+	if (!r)
+		return 0;
+	// Without a wakeup time, the read returning is the best estimate we have
+	if (!tv_ready)
+	{
+		cgtime(&tv_now);
+		tv_ready = &tv_now;
+	}
+	port->tv_last = *tv_ready;
+	if (!port->len)
+	{
+		port->tv_first = *tv_ready;
+		port->first_len = r;
+	}
+	port->len += r;
+	return r;
+}
+
+size_t vcom_port_take(struct vcom_port * const port, void * const buf, size_t count, struct timeval * const tv_first)
+{
+	if (count > port->len)
+		count = port->len;
+	if (!count)
+		return 0;
+	if (tv_first)
+		*tv_first = port->tv_first;
+	memcpy(buf, port->buf, count);
+	port->len -= count;
+	memmove(port->buf, &port->buf[count], port->len);
+	if (count < port->first_len)
+		port->first_len -= count;
+	else
+	{
+		// Anything left came from later reads, which only the latest is remembered for
+		port->tv_first = port->tv_last;
+		port->first_len = port->len;
+	}
+	return count;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+bool vcom_reactor_init(struct vcom_reactor * const reactor, notifier_t * const wakeup)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+	
+	reactor->epfd = epoll_create(0x10);
+	reactor->wakeup = NULL;
+	if (reactor->epfd == -1)
+	{
+		applog(LOG_ERR, "%s: epoll_create failed: %s", __func__, bfg_strerror(errno, BST_ERRNO));
+		return false;
+	}
+	if (wakeup)
+	{
+		if ((*wakeup)[1] == INVSOCK)
+			notifier_init(*wakeup);
+		if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, (*wakeup)[0], &ev))
+			applog(LOG_ERR, "%s: Failed to watch wakeup notifier: %s", __func__, bfg_strerror(errno, BST_ERRNO));
+		else
+			reactor->wakeup = wakeup;
+	}
+	return true;
+}
+
+bool vcom_reactor_add(struct vcom_reactor * const reactor, struct vcom_port * const port)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = port,
+	};
+	
+	if (reactor->epfd == -1 || port->fd == -1)
+		return false;
+	// A port reopened with the same fd may still be registered
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, port->fd, &ev) && (errno != EEXIST || epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, port->fd, &ev)))
+	{
+		applog(LOG_ERR, "%s: Failed to watch fd %d: %s", __func__, port->fd, bfg_strerror(errno, BST_ERRNO));
+		return false;
+	}
+	port->registered = true;
+	return true;
+}
+
+void vcom_reactor_del(struct vcom_reactor * const reactor, struct vcom_port * const port)
+{
+	struct epoll_event ev;
+	
+	// Closed fds are removed automatically, so failure here is fine
+	if (reactor->epfd != -1 && port->fd != -1)
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, port->fd, &ev);
+	port->registered = false;
+}
+
+int vcom_reactor_wait(struct vcom_reactor * const reactor, const int timeout_ms)
+{
+	struct epoll_event evs[0x10];
+	struct vcom_port *port;
+	struct timeval tv_ready;
+	int i, n;
+	
+	n = epoll_wait(reactor->epfd, evs, sizeof(evs) / sizeof(*evs), timeout_ms);
+	if (n < 0)
+		return (errno == EINTR) ? 0 : -1;
+	// Taken before reading, so it is as close as we can get to when the bytes arrived
+	cgtime(&tv_ready);
+	for (i = 0; i < n; ++i)
+	{
+		port = evs[i].data.ptr;
+		if (!port)
+		{
+			notifier_read(*reactor->wakeup);
+			continue;
+		}
+		// Readable with nothing to read means the device went away
+		if (port->len < sizeof(port->buf) && !vcom_port_fill(port, sizeof(port->buf), &tv_ready))
+			port->error = true;
+	}
+	return n;
+}
+
+void vcom_reactor_destroy(struct vcom_reactor * const reactor)
+{
+	if (reactor->epfd == -1)
+		return;
+	close(reactor->epfd);
+	reactor->epfd = -1;
+}
+
+#else
+
+bool vcom_reactor_init(struct vcom_reactor * const reactor, __maybe_unused notifier_t * const wakeup)
+{
+	reactor->epfd = -1;
+	reactor->wakeup = NULL;
+	return false;
+}
+
+bool vcom_reactor_add(__maybe_unused struct vcom_reactor * const reactor, __maybe_unused struct vcom_port * const port)
+{
+	return false;
+}
+
+void vcom_reactor_del(__maybe_unused struct vcom_reactor * const reactor, __maybe_unused struct vcom_port * const port)
+{}
+
+int vcom_reactor_wait(__maybe_unused struct vcom_reactor * const reactor, __maybe_unused const int timeout_ms)
+{
+	return -1;
+}
+
+void vcom_reactor_destroy(__maybe_unused struct vcom_reactor * const reactor)
+{}
+
+#endif
+
 #ifndef WIN32
 
+static
+void _test_vcom_fill(struct vcom_port * const port, const int wfd, const char * const data, const time_t sec)
+{
+	const size_t len = strlen(data);
+	const struct timeval tv = { .tv_sec = sec, };
+	
+	if (write(wfd, data, len) != len || vcom_port_fill(port, sizeof(port->buf), &tv) != len)
+		applog(LOG_ERR, "%s: Failed to fill \"%s\"", __func__, data);
+}
+
+static
+void _test_vcom_take(struct vcom_port * const port, const char * const expect, const time_t sec)
+{
+	const size_t len = strlen(expect);
+	char buf[VCOM_PORT_BUFSZ];
+	struct timeval tv;
+	
+	if (vcom_port_take(port, buf, len, &tv) != len || memcmp(buf, expect, len) || tv.tv_sec != sec)
+		applog(LOG_ERR, "%s: Failed to take \"%s\" read at %ld (got %ld)", __func__, expect, (long)sec, (long)tv.tv_sec);
+}
+
+void test_vcom_port()
+{
+	struct vcom_port port;
+	int pfd[2];
+	
+	if (pipe(pfd))
+	{
+		applog(LOG_ERR, "%s: pipe failed: %s", __func__, bfg_strerror(errno, BST_ERRNO));
+		return;
+	}
+	vcom_port_init(&port, pfd[0]);
+	
+	// Partial takes leave the rest, still stamped with when it was read
+	_test_vcom_fill(&port, pfd[1], "abcdef", 1);
+	_test_vcom_take(&port, "abcd", 1);
+	_test_vcom_fill(&port, pfd[1], "gh", 2);
+	_test_vcom_take(&port, "ef", 1);
+	_test_vcom_take(&port, "gh", 2);
+	
+	// A take spanning two reads is stamped with the first
+	_test_vcom_fill(&port, pfd[1], "ij", 3);
+	_test_vcom_fill(&port, pfd[1], "kl", 4);
+	_test_vcom_take(&port, "i", 3);
+	_test_vcom_take(&port, "jk", 3);
+	_test_vcom_take(&port, "l", 4);
+	if (port.len || port.error)
+		applog(LOG_ERR, "%s: %lu bytes left over%s", __func__, (unsigned long)port.len, port.error ? ", with error" : "");
+	
+#ifdef HAVE_SYS_EPOLL_H
+	struct vcom_reactor reactor;
+	struct timeval tv_before, tv_first;
+	notifier_t wakeup;
+	char buf[4];
+	long us;
+	
+	notifier_init_invalid(wakeup);
+	if (!vcom_reactor_init(&reactor, &wakeup))
+	{
+		applog(LOG_ERR, "%s: vcom_reactor_init failed", __func__);
+		goto out;
+	}
+	if (!(vcom_reactor_add(&reactor, &port) && port.registered))
+		applog(LOG_ERR, "%s: vcom_reactor_add failed", __func__);
+	
+	// Bytes are stamped with when the reactor woke up for them
+	cgtime(&tv_before);
+	if (write(pfd[1], "xyz", 3) != 3 || vcom_reactor_wait(&reactor, 1000) != 1
+	 || vcom_port_take(&port, buf, sizeof(buf), &tv_first) != 3 || memcmp(buf, "xyz", 3)
+	 || timercmp(&tv_first, &tv_before, <) || timer_elapsed_us(&tv_first, NULL) > 500000)
+		applog(LOG_ERR, "%s: Reactor did not read what was written", __func__);
+	
+	// The notifier interrupts a wait
+	cgtime(&tv_before);
+	notifier_wake(wakeup);
+	if (vcom_reactor_wait(&reactor, 1000) != 1 || port.len)
+		applog(LOG_ERR, "%s: Notifier did not wake the reactor", __func__);
+	us = timer_elapsed_us(&tv_before, NULL);
+	if (us > 500000)
+		applog(LOG_ERR, "%s: Notifier took %ldus to wake the reactor", __func__, us);
+	if (vcom_reactor_wait(&reactor, 10) != 0)
+		applog(LOG_ERR, "%s: Reactor woke up with nothing to read", __func__);
+	
+	// End of file is an error
+	close(pfd[1]);
+	pfd[1] = -1;
+	if (vcom_reactor_wait(&reactor, 1000) != 1 || !port.error)
+		applog(LOG_ERR, "%s: End of file did not set error", __func__);
+	
+	vcom_reactor_del(&reactor, &port);
+	if (port.registered)
+		applog(LOG_ERR, "%s: vcom_reactor_del left the port registered", __func__);
+	vcom_reactor_destroy(&reactor);
+	notifier_destroy(wakeup);
+out:
+#endif
+	close(pfd[0]);
+	if (pfd[1] != -1)
+		close(pfd[1]);
+}
+
 enum bfg_gpio_value get_serial_cts(int fd)
 {
 	int flags;
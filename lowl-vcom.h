@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "deviceapi.h"
@@ -39,6 +40,45 @@ extern ssize_t _serial_read(int fd, char *buf, size_t buflen, char *eol);
 	_serial_read(fd, buf, bufsiz, &eol)
 extern int serial_close(int fd);
 
+#define VCOM_PORT_BUFSZ  0x40
+
+// Buffers what a serial port has sent, remembering when it was read
+struct vcom_port {
+	int fd;
+	bool error;
+	// Set while the port is watched by a vcom_reactor
+	bool registered;
+	size_t len;
+	uint8_t buf[VCOM_PORT_BUFSZ];
+	// When buf[0] was read, and how many of the buffered bytes that read returned
+	struct timeval tv_first;
+	size_t first_len;
+	// When the latest read was, which is used for the bytes after those
+	struct timeval tv_last;
+};
+
+extern void vcom_port_init(struct vcom_port *, int fd);
+extern ssize_t vcom_port_fill(struct vcom_port *, size_t maxlen, const struct timeval *tv_ready);
+extern size_t vcom_port_take(struct vcom_port *, void *buf, size_t count, struct timeval *tv_first);
+#define vcom_port_purge(port)  ((void)((port)->len = 0))
+
+/* Waits on any number of ports (and optionally a wakeup notifier) at once,
+ * keeping them registered between waits, and fills the ports that are ready.
+ * Only available with epoll; on other platforms vcom_reactor_init returns false
+ * and ports must be read with vcom_port_fill, which blocks for up to the port's
+ * read timeout */
+struct vcom_reactor {
+	int epfd;
+	notifier_t *wakeup;
+};
+
+extern bool vcom_reactor_init(struct vcom_reactor *, notifier_t *wakeup);
+extern bool vcom_reactor_add(struct vcom_reactor *, struct vcom_port *);
+extern void vcom_reactor_del(struct vcom_reactor *, struct vcom_port *);
+extern int vcom_reactor_wait(struct vcom_reactor *, int timeout_ms);
+extern void vcom_reactor_destroy(struct vcom_reactor *);
+extern void test_vcom_port();
+
 extern enum bfg_gpio_value get_serial_cts(int fd);
 extern enum bfg_gpio_value set_serial_dtr(int fd, enum bfg_gpio_value dtr);
 extern enum bfg_gpio_value set_serial_rts(int fd, enum bfg_gpio_value rts);
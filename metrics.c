@@ -0,0 +1,167 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+// Prometheus text format metrics, served at /metrics by the HTTP server
+
+#include "config.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <microhttpd.h>
+
+#include "httpsrv.h"
+#include "miner.h"
+#include "util.h"
+
+static
+void metrics_printf(bytes_t * const b, const char * const fmt, ...)
+{
+	va_list ap;
+	size_t avail = 0x100;
+	int len;
+	
+	while (true)
+	{
+		char * const p = bytes_preappend(b, avail);
+		va_start(ap, fmt);
+		len = vsnprintf(p, avail, fmt, ap);
+		va_end(ap);
+		if (len < 0)
+			return;
+		if ((size_t)len < avail)
+			break;
+		avail = len + 1;
+	}
+	bytes_postappend(b, len);
+}
+
+static
+void metrics_header(bytes_t * const b, const char * const name, const char * const type, const char * const help)
+{
+	metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static
+void metrics_label(bytes_t * const b, const char * const label, const char * const labelval)
+{
+	const char *p;
+	
+	metrics_printf(b, "%s=\"", label);
+	for (p = labelval; *p; ++p)
+		switch (*p)
+		{
+			case '\\':
+				bytes_append(b, "\\\\", 2);
+				break;
+			case '"':
+				bytes_append(b, "\\\"", 2);
+				break;
+			case '\n':
+				bytes_append(b, "\\n", 2);
+				break;
+			default:
+				bytes_append(b, p, 1);
+		}
+	bytes_append(b, "\"", 1);
+}
+
+static
+void metrics_sample(bytes_t * const b, const char * const name, const char * const label, const char * const labelval, const double val)
+{
+	metrics_printf(b, "%s{", name);
+	metrics_label(b, label, labelval);
+	metrics_printf(b, "} %.15g\n", val);
+}
+
+#define METRICS_PROC(name, type, help, cond, val)  do {  \
+	metrics_header(b, name, type, help);  \
+	for (i = 0; i < total_devices; ++i)  \
+	{  \
+		proc = get_devices(i);  \
+		if (cond)  \
+			metrics_sample(b, name, "proc", proc->proc_repr_ns, val);  \
+	}  \
+} while(0)
+
+#define METRICS_POOL(name, type, help, val)  do {  \
+	metrics_header(b, name, type, help);  \
+	for (i = 0; i < total_pools; ++i)  \
+	{  \
+		pool = pools[i];  \
+		if (pool->removed)  \
+			continue;  \
+		snprintf(pool_no, sizeof(pool_no), "%d", pool->pool_no);  \
+		metrics_sample(b, name, "pool", pool_no, val);  \
+	}  \
+} while(0)
+
+// Streams straight from the live counters, like the API does, but without
+// building api_data lists in between
+static
+void metrics_write(bytes_t * const b)
+{
+	struct cgpu_info *proc;
+	struct pool *pool;
+	char pool_no[12];
+	int i;
+	
+	METRICS_PROC("bfgminer_proc_hashes_total", "counter", "Hashes done by the processor",
+	             true, proc->total_mhashes * 1e6);
+	METRICS_PROC("bfgminer_proc_hashrate", "gauge", "Hashes per second, averaged over the log interval",
+	             true, proc->rolling * 1e6);
+	METRICS_PROC("bfgminer_proc_accepted_diff_total", "counter", "Difficulty of accepted shares",
+	             true, proc->diff_accepted);
+	METRICS_PROC("bfgminer_proc_rejected_diff_total", "counter", "Difficulty of rejected shares",
+	             true, proc->diff_rejected);
+	METRICS_PROC("bfgminer_proc_stale_diff_total", "counter", "Difficulty of stale shares",
+	             true, proc->diff_stale);
+	METRICS_PROC("bfgminer_proc_hw_errors_total", "counter", "Hardware errors",
+	             true, proc->hw_errors);
+	METRICS_PROC("bfgminer_proc_getwork_wait_seconds_total", "counter", "Time spent waiting for work",
+	             true, proc->cgminer_stats.getwork_wait.tv_sec + proc->cgminer_stats.getwork_wait.tv_usec / 1e6);
+	METRICS_PROC("bfgminer_proc_temperature_celsius", "gauge", "Temperature of the processor",
+	             proc->temp > 0, proc->temp);
+	
+	metrics_header(b, "bfgminer_pool_info", "gauge", "Pool URL, always 1");
+	for (i = 0; i < total_pools; ++i)
+	{
+		pool = pools[i];
+		if (pool->removed)
+			continue;
+		metrics_printf(b, "bfgminer_pool_info{pool=\"%d\",", pool->pool_no);
+		metrics_label(b, "url", pool->rpc_url);
+		metrics_printf(b, "} 1\n");
+	}
+	METRICS_POOL("bfgminer_pool_accepted_diff_total", "counter", "Difficulty of shares accepted by the pool",
+	             pool->diff_accepted);
+	METRICS_POOL("bfgminer_pool_rejected_diff_total", "counter", "Difficulty of shares rejected by the pool",
+	             pool->diff_rejected);
+	METRICS_POOL("bfgminer_pool_stale_diff_total", "counter", "Difficulty of stale shares for the pool",
+	             pool->diff_stale);
+	METRICS_POOL("bfgminer_pool_getwork_latency_seconds", "gauge", "Rolling average time to get work from the pool",
+	             pool->cgminer_pool_stats.getwork_wait_rolling);
+}
+
+int handle_metrics(struct MHD_Connection * const conn)
+{
+	struct MHD_Response *resp;
+	bytes_t b = BYTES_INIT;
+	int ret;
+	
+	metrics_write(&b);
+	resp = MHD_create_response_from_buffer(bytes_len(&b), bytes_buf(&b), MHD_RESPMEM_MUST_FREE);
+	httpsrv_prepare_resp(resp);
+	MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain; version=0.0.4");
+	ret = MHD_queue_response(conn, 200, resp);
+	MHD_destroy_response(resp);
+	return ret;
+}
@@ -49,9 +49,11 @@
 #ifndef WIN32
 #include <sys/resource.h>
 #include <sys/socket.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #if defined(HAVE_LIBUDEV) && defined(HAVE_SYS_EPOLL_H)
 #include <libudev.h>
-#include <sys/epoll.h>
 #define HAVE_BFG_HOTPLUG
 #endif
 #else
@@ -98,6 +100,14 @@
 #include "scrypt.h"
 #endif
 
+#ifdef HAVE_SHM_OPEN
+#include "shmstats.h"
+#endif
+
+#ifdef NEED_BFG_LOWL_VCOM
+#include "lowl-vcom.h"
+#endif
+
 #if defined(USE_AVALON) || defined(USE_BITFORCE) || defined(USE_ICARUS) || defined(USE_MODMINER) || defined(USE_NANOFURY) || defined(USE_X6500) || defined(USE_ZTEX)
 #	define USE_FPGA
 #endif
@@ -183,9 +193,17 @@ bool opt_restart = true;
 #ifdef USE_LIBMICROHTTPD
 #include "httpsrv.h"
 int httpsrv_port = -1;
+int httpsrv_threads = 1;
+bool httpsrv_metrics;
 #endif
 #ifdef USE_LIBEVENT
 int stratumsrv_port = -1;
+int stratumsrv_share_rate = 20;
+int stratumsrv_threads = 1;
+int stratumsrv_verify_threads;
+#endif
+#ifdef HAVE_SHM_OPEN
+static char *opt_shmstats;
 #endif
 
 const
@@ -219,7 +237,11 @@ bool use_curses;
 bool have_libusb;
 #endif
 static bool opt_submit_stale = true;
+#ifdef HAVE_SYS_EPOLL_H
+static bool opt_stratum_evloop;
+#endif
 static float opt_shares;
+static int opt_sharelog_interval = 1000;
 static int opt_submit_threads = 0x40;
 bool opt_fail_only;
 int opt_fail_switch_delay = 300;
@@ -227,9 +249,11 @@ bool opt_autofan;
 bool opt_autoengine;
 bool opt_noadl;
 char *opt_api_allow = NULL;
+int opt_api_cache = 1000;
 char *opt_api_groups;
 char *opt_api_description = PACKAGE_STRING;
 int opt_api_port = 4028;
+int opt_api_threads = 4;
 bool opt_api_listen;
 bool opt_api_mcast;
 char *opt_api_mcast_addr = API_MCAST_ADDR;
@@ -299,8 +323,8 @@ int total_accepted, total_rejected;
 int total_getworks, total_stale, total_discarded;
 uint64_t total_bytes_rcvd, total_bytes_sent;
 double total_diff1, total_bad_diff1;
+static uint64_t total_submit_copies_avoided;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
-static int staged_rollable;
 unsigned int new_blocks;
 unsigned int found_blocks;
 
@@ -392,6 +416,7 @@ struct stratum_share {
 	bool block;
 	struct work *work;
 	int id;
+	struct timeval tv_submit;
 };
 
 static struct stratum_share *stratum_shares = NULL;
@@ -428,7 +453,24 @@ struct thread_q *getq;
 
 static int total_work;
 static bool staged_full;
-struct work *staged_work = NULL;
+
+/* Staged works are kept in two binary min-heaps ordered by staging time, so
+ * pushing and popping is O(log n) instead of re-sorting everything; rollable
+ * works are kept apart so hash_pop can prefer the others without scanning */
+struct staged_heap {
+	struct work **works;
+	int count;
+	int alloc;
+};
+
+enum staged_heap_id {
+	SHI_NOROLL,
+	SHI_ROLLABLE,
+	SHI_COUNT,
+};
+
+static struct staged_heap staged_heaps[SHI_COUNT];
+static int getwork_waiters;
 
 struct schedtime {
 	bool enable;
@@ -880,7 +922,6 @@ int cgpu_search(const char * const pattern, const int first)
 	return -1;
 }
 
-static pthread_mutex_t sharelog_lock;
 static FILE *sharelog_file = NULL;
 
 struct thr_info *get_thread(int thr_id)
@@ -912,9 +953,122 @@ struct cgpu_info *get_devices(int id)
 	return cgpu;
 }
 
-static pthread_mutex_t noncelog_lock = PTHREAD_MUTEX_INITIALIZER;
 static FILE *noncelog_file = NULL;
 
+/* Share and nonce log lines are buffered here by the mining threads, and
+ * written out together every opt_sharelog_interval ms by logbuf_thread.  If
+ * the file can't keep up, lines are dropped (and counted) instead of waiting. */
+#define LOGBUF_MAX_SIZE  0x100000
+
+struct logbuf {
+	const char *name;
+	FILE **filep;
+	
+	pthread_mutex_t lock;
+	bytes_t buf;
+	unsigned long dropped;
+	
+	// Only one thread at a time writes to the file, with wbuf
+	pthread_mutex_t write_lock;
+	bytes_t wbuf;
+};
+
+static struct logbuf sharelog_buf = {
+	.name = "sharelog",
+	.filep = &sharelog_file,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.write_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static struct logbuf noncelog_buf = {
+	.name = "noncelog",
+	.filep = &noncelog_file,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.write_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static
+void logbuf_write(struct logbuf * const lb, const void * const s, const size_t sz)
+{
+	FILE * const f = *lb->filep;
+	size_t ret;
+	
+	ret = fwrite(s, sz, 1, f);
+	fflush(f);
+	if (ret != 1)
+		applog(LOG_ERR, "%s fwrite error", lb->name);
+}
+
+static
+void logbuf_append(struct logbuf * const lb, const void * const s, const size_t sz)
+{
+	if (!opt_sharelog_interval)
+	{
+		mutex_lock(&lb->write_lock);
+		logbuf_write(lb, s, sz);
+		mutex_unlock(&lb->write_lock);
+		return;
+	}
+	
+	mutex_lock(&lb->lock);
+	if (unlikely(bytes_len(&lb->buf) + sz > LOGBUF_MAX_SIZE))
+		++lb->dropped;
+	else
+		bytes_append(&lb->buf, s, sz);
+	mutex_unlock(&lb->lock);
+}
+
+static
+void logbuf_flush(struct logbuf * const lb)
+{
+	unsigned long dropped;
+	bytes_t tmp;
+	
+	mutex_lock(&lb->write_lock);
+	
+	mutex_lock(&lb->lock);
+	tmp = lb->buf;
+	lb->buf = lb->wbuf;
+	lb->wbuf = tmp;
+	dropped = lb->dropped;
+	lb->dropped = 0;
+	mutex_unlock(&lb->lock);
+	
+	if (bytes_len(&lb->wbuf))
+	{
+		logbuf_write(lb, bytes_buf(&lb->wbuf), bytes_len(&lb->wbuf));
+		bytes_reset(&lb->wbuf);
+	}
+	
+	mutex_unlock(&lb->write_lock);
+	
+	if (unlikely(dropped))
+		applog(LOG_WARNING, "%s: Dropped %lu lines because the file could not keep up",
+		       lb->name, dropped);
+}
+
+static
+void logbufs_flush(void)
+{
+	if (sharelog_file)
+		logbuf_flush(&sharelog_buf);
+	if (noncelog_file)
+		logbuf_flush(&noncelog_buf);
+}
+
+static
+void *logbuf_thread(__maybe_unused void *userdata)
+{
+	pthread_detach(pthread_self());
+	RenameThread("logbuf");
+	
+	while (true)
+	{
+		cgsleep_ms(opt_sharelog_interval);
+		logbufs_flush();
+	}
+	return NULL;
+}
+
 static
 void noncelog(const struct work * const work)
 {
@@ -922,7 +1076,6 @@ void noncelog(const struct work * const work)
 	const struct cgpu_info *proc = get_thr_cgpu(thr_id);
 	char buf[0x200], hash[65], data[161], midstate[65];
 	int rv;
-	size_t ret;
 	
 	bin2hex(hash, work->hash, 32);
 	bin2hex(data, work->data, 80);
@@ -939,13 +1092,7 @@ void noncelog(const struct work * const work)
 		return;
 	}
 	
-	mutex_lock(&noncelog_lock);
-	ret = fwrite(buf, rv, 1, noncelog_file);
-	fflush(noncelog_file);
-	mutex_unlock(&noncelog_lock);
-	
-	if (ret != 1)
-		applog(LOG_ERR, "noncelog fwrite error");
+	logbuf_append(&noncelog_buf, buf, rv);
 }
 
 static void sharelog(const char*disposition, const struct work*work)
@@ -958,7 +1105,6 @@ static void sharelog(const char*disposition, const struct work*work)
 	struct pool *pool;
 	int thr_id, rv;
 	char s[1024];
-	size_t ret;
 
 	if (!sharelog_file)
 		return;
@@ -974,19 +1120,16 @@ static void sharelog(const char*disposition, const struct work*work)
 	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
 	rv = snprintf(s, sizeof(s), "%lu,%s,%s,%s,%s,%u,%s,%s\n", t, disposition, target, pool->rpc_url, cgpu->proc_repr_ns, thr_id, hash, data);
 	if (rv >= (int)(sizeof(s)))
+	{
 		s[sizeof(s) - 1] = '\0';
+		rv = sizeof(s) - 1;
+	}
 	else if (rv < 0) {
 		applog(LOG_ERR, "sharelog printf error");
 		return;
 	}
 
-	mutex_lock(&sharelog_lock);
-	ret = fwrite(s, rv, 1, sharelog_file);
-	fflush(sharelog_file);
-	mutex_unlock(&sharelog_lock);
-
-	if (ret != 1)
-		applog(LOG_ERR, "sharelog fwrite error");
+	logbuf_append(&sharelog_buf, s, rv);
 }
 
 static char *getwork_req = "{\"method\": \"getwork\", \"params\": [], \"id\":0}\n";
@@ -1067,8 +1210,11 @@ struct pool *add_pool(void)
 		return pool;
 	}
 	
+	// The stratum event loop snapshots pools under control_lock
+	cg_wlock(&control_lock);
 	pools = realloc(pools, sizeof(struct pool *) * (total_pools + 2));
 	pools[total_pools++] = pool;
+	cg_wunlock(&control_lock);
 	
 	adjust_quota_gcd();
 
@@ -1928,7 +2074,25 @@ static struct opt_table opt_config_table[] = {
 		     "\n\tsse4_64\t\tSSE4.1 64 bit implementation for x86_64 machines"
 #endif
 #ifdef WANT_ALTIVEC_4WAY
-    "\n\taltivec_4way\tAltivec implementation for PowerPC G4 and G5 machines"
+		     "\n\taltivec_4way\tAltivec implementation for PowerPC G4 and G5 machines"
+#endif
+#ifdef WANT_AVX2_8WAY
+		     "\n\tavx2_8way\t8-way AVX2 implementation for x86 machines"
+#endif
+#ifdef WANT_AVX512_16WAY
+		     "\n\tavx512_16way\t16-way AVX-512F implementation for x86 machines"
+#endif
+#ifdef WANT_SHANI
+		     "\n\tshani\t\tSHA extensions implementation for x86 machines"
+#endif
+#ifdef WANT_SCRYPT
+		     "\n\tscrypt\t\tscrypt, one nonce at a time"
+#endif
+#ifdef WANT_SCRYPT_4WAY
+		     "\n\tscrypt_4way\t4-way scrypt (SSE2 on x86)"
+#endif
+#ifdef WANT_SCRYPT_AVX2_8WAY
+		     "\n\tscrypt_avx2_8way\t8-way AVX2 scrypt"
 #endif
 		),
 	OPT_WITH_ARG("-a",
@@ -1938,6 +2102,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--api-allow",
 		     set_api_allow, NULL, NULL,
 		     "Allow API access only to the given list of [G:]IP[/Prefix] addresses[/subnets]"),
+	OPT_WITH_ARG("--api-cache",
+		     set_int_0_to_9999, opt_show_intval, &opt_api_cache,
+		     "Milliseconds to reuse the reply to a read-only API request, or 0 to always build a new one"),
 	OPT_WITH_ARG("--api-description",
 		     set_api_description, NULL, NULL,
 		     "Description placed in the API status header, default: BFGMiner version"),
@@ -1968,6 +2135,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--api-port",
 		     set_int_1_to_65535, opt_show_intval, &opt_api_port,
 		     "Port number of miner API"),
+	OPT_WITH_ARG("--api-threads",
+		     set_int_1_to_65535, opt_show_intval, &opt_api_threads,
+		     "Number of threads reading API requests and sending replies"),
 #ifdef HAVE_ADL
 	OPT_WITHOUT_ARG("--auto-fan",
 			opt_set_bool, &opt_autofan,
@@ -2046,9 +2216,15 @@ static struct opt_table opt_config_table[] = {
 			opt_set_bool, &opt_disable_pool,
 			"Automatically disable pools that continually reject shares"),
 #ifdef USE_LIBMICROHTTPD
+	OPT_WITHOUT_ARG("--http-metrics",
+	                opt_set_bool, &httpsrv_metrics,
+	                "Serve Prometheus metrics at /metrics on the HTTP server"),
 	OPT_WITH_ARG("--http-port",
 	             opt_set_intval, opt_show_intval, &httpsrv_port,
 	             "Port number to listen on for HTTP getwork miners (-1 means disabled)"),
+	OPT_WITH_ARG("--http-threads",
+	             set_int_0_to_9999, opt_show_intval, &httpsrv_threads,
+	             "Number of threads serving HTTP getwork miners (0 means one per connection)"),
 #endif
 	OPT_WITH_ARG("--expiry",
 		     set_int_0_to_9999, opt_show_intval, &opt_expiry,
@@ -2333,9 +2509,17 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--sharelog",
 		     set_sharelog, NULL, NULL,
 		     "Append share log to file"),
+	OPT_WITH_ARG("--sharelog-interval",
+		     set_int_0_to_9999, opt_show_intval, &opt_sharelog_interval,
+		     "Milliseconds between writes to the share and nonce logs, or 0 to write each line immediately"),
 	OPT_WITH_ARG("--shares",
 		     opt_set_floatval, NULL, &opt_shares,
 		     "Quit after mining 2^32 * N hashes worth of shares (default: unlimited)"),
+#ifdef HAVE_SHM_OPEN
+	OPT_WITH_ARG("--shm-stats",
+		     opt_set_charp, NULL, &opt_shmstats,
+		     "Publish stats in the named POSIX shared memory object, eg /bfgminer"),
+#endif
 	OPT_WITHOUT_ARG("--show-processors",
 			opt_set_bool, &opt_show_procs,
 			"Show per processor statistics in summary"),
@@ -2348,10 +2532,24 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--socks-proxy",
 		     opt_set_charp, NULL, &opt_socks_proxy,
 		     "Set socks proxy (host:port)"),
+#ifdef HAVE_SYS_EPOLL_H
+	OPT_WITHOUT_ARG("--stratum-event-loop",
+			opt_set_bool, &opt_stratum_evloop,
+			"Handle all stratum pool connections from a single thread"),
+#endif
 #ifdef USE_LIBEVENT
 	OPT_WITH_ARG("--stratum-port",
 	             opt_set_intval, opt_show_intval, &stratumsrv_port,
 	             "Port number to listen on for stratum miners (-1 means disabled)"),
+	OPT_WITH_ARG("--stratum-share-rate",
+	             set_int_0_to_9999, opt_show_intval, &stratumsrv_share_rate,
+	             "Shares per minute to aim for from each stratum miner, by adjusting its difficulty (0 means fixed difficulty 1)"),
+	OPT_WITH_ARG("--stratum-threads",
+	             set_int_1_to_65535, opt_show_intval, &stratumsrv_threads,
+	             "Number of threads handling connections from stratum miners"),
+	OPT_WITH_ARG("--stratum-verify-threads",
+	             set_int_0_to_9999, opt_show_intval, &stratumsrv_verify_threads,
+	             "Number of threads checking shares from stratum miners (0 means on the connection's thread)"),
 #endif
 	OPT_WITHOUT_ARG("--submit-stale",
 			opt_set_bool, &opt_submit_stale,
@@ -2681,12 +2879,158 @@ static void calc_midstate(struct work *work)
 	swap32tole(work->midstate, work->midstate, 8);
 }
 
-static struct work *make_work(void)
+/* Same as calc_midstate, but for several works at once, 4 lanes at a time */
+static void calc_midstates(struct work ** const works, const int count)
+{
+	uint32_t h[8 * 4], w[16 * 4], *midstate32;
+	const uint32_t *data32;
+	int i, j, lane;
+	
+	for (i = 0; i < count; i += 4)
+	{
+		for (lane = 0; lane < 4; ++lane)
+		{
+			// Lanes past the end just repeat the last work
+			data32 = (const uint32_t *)works[(i + lane < count) ? (i + lane) : (count - 1)]->data;
+			for (j = 0; j < 16; ++j)
+				w[(j * 4) + lane] = le32toh(data32[j]);
+			for (j = 0; j < 8; ++j)
+				h[(j * 4) + lane] = sha256_h0[j];
+		}
+		sha256_transf_4way(h, w);
+		for (lane = 0; lane < 4 && i + lane < count; ++lane)
+		{
+			midstate32 = (uint32_t *)works[i + lane]->midstate;
+			for (j = 0; j < 8; ++j)
+				midstate32[j] = htole32(h[(j * 4) + lane]);
+		}
+	}
+}
+
+/* Works are carved out of slabs and never given back to the system; freed
+ * ones go to a per-thread cache, and only whole batches of them move through
+ * work_slab_lock, so making and freeing works is mostly lock- and malloc-free */
+#define WORK_SLAB_SIZE  64
+#define WORK_CACHE_MAX  64
+
+static pthread_mutex_t work_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct work *work_slab_free;
+static uint64_t work_slabs;
+static struct work_cache *work_caches;
+// Counters from caches of threads that have exited
+static struct work_cache work_caches_retired;
+
+void work_cache_register(struct work_cache * const cache)
+{
+	*cache = (struct work_cache){
+		.works = NULL,
+	};
+	mutex_lock(&work_slab_lock);
+	DL_APPEND(work_caches, cache);
+	mutex_unlock(&work_slab_lock);
+}
+
+void work_cache_release(struct work_cache * const cache)
+{
+	struct work *work;
+
+	mutex_lock(&work_slab_lock);
+	while ( (work = cache->works) )
+	{
+		cache->works = work->next;
+		work->next = work_slab_free;
+		work_slab_free = work;
+	}
+	cache->count = 0;
+	work_caches_retired.allocs += cache->allocs;
+	work_caches_retired.frees += cache->frees;
+	work_caches_retired.refills += cache->refills;
+	DL_DELETE(work_caches, cache);
+	mutex_unlock(&work_slab_lock);
+}
+
+static void work_cache_refill(struct work_cache * const cache)
+{
+	struct work *work;
+	int i;
+
+	mutex_lock(&work_slab_lock);
+	++cache->refills;
+	for (i = 0; i < WORK_CACHE_MAX / 2 && work_slab_free; ++i)
+	{
+		work = work_slab_free;
+		work_slab_free = work->next;
+		work->next = cache->works;
+		cache->works = work;
+	}
+	cache->count += i;
+	if (!cache->works)
+	{
+		work = calloc(WORK_SLAB_SIZE, sizeof(struct work));
+		if (unlikely(!work))
+			quit(1, "Failed to calloc work slab in make_work");
+		++work_slabs;
+		for (i = 0; i < WORK_SLAB_SIZE; ++i)
+		{
+			work[i].next = cache->works;
+			cache->works = &work[i];
+		}
+		cache->count += WORK_SLAB_SIZE;
+	}
+	mutex_unlock(&work_slab_lock);
+}
+
+static void work_cache_spill(struct work_cache * const cache)
+{
+	struct work *work;
+
+	mutex_lock(&work_slab_lock);
+	while (cache->count > WORK_CACHE_MAX / 2)
+	{
+		work = cache->works;
+		cache->works = work->next;
+		work->next = work_slab_free;
+		work_slab_free = work;
+		--cache->count;
+	}
+	mutex_unlock(&work_slab_lock);
+}
+
+void get_work_alloc_stats(struct work_alloc_stats * const stats)
+{
+	struct work_cache *cache;
+
+	mutex_lock(&work_slab_lock);
+	*stats = (struct work_alloc_stats){
+		.allocs = work_caches_retired.allocs,
+		.frees = work_caches_retired.frees,
+		.refills = work_caches_retired.refills,
+		.slabs = work_slabs,
+	};
+	DL_FOREACH(work_caches, cache)
+	{
+		stats->allocs += cache->allocs;
+		stats->frees += cache->frees;
+		stats->refills += cache->refills;
+	}
+	mutex_unlock(&work_slab_lock);
+	mutex_lock(&stats_lock);
+	stats->copies_avoided = total_submit_copies_avoided;
+	mutex_unlock(&stats_lock);
+}
+
+struct work *make_work(void)
 {
-	struct work *work = calloc(1, sizeof(struct work));
+	struct work_cache * const cache = _bfg_work_cache();
+	struct work *work;
 
-	if (unlikely(!work))
-		quit(1, "Failed to calloc work in make_work");
+	if (unlikely(!cache->works))
+		work_cache_refill(cache);
+	work = cache->works;
+	cache->works = work->next;
+	--cache->count;
+	++cache->allocs;
+	work->next = NULL;
 
 	cg_wlock(&control_lock);
 	work->id = total_work++;
@@ -2699,9 +3043,9 @@ static struct work *make_work(void)
  * cleaned to remove any dynamically allocated arrays within the struct */
 void clean_work(struct work *work)
 {
-	free(work->job_id);
+	refstr_unref(work->job_id);
 	bytes_free(&work->nonce2);
-	free(work->nonce1);
+	refstr_unref(work->nonce1);
 	if (work->device_data_free_func)
 		work->device_data_free_func(work);
 
@@ -2719,12 +3063,30 @@ void clean_work(struct work *work)
 	memset(work, 0, sizeof(struct work));
 }
 
+/* Same as clean_work, but keeps the (emptied) nonce2 buffer allocated, for
+ * works that are about to be filled in again */
+static void _clean_work_for_reuse(struct work * const work)
+{
+	bytes_t nonce2 = work->nonce2;
+
+	bytes_init(&work->nonce2);
+	clean_work(work);
+	bytes_reset(&nonce2);
+	work->nonce2 = nonce2;
+}
+
 /* All dynamically allocated work structs should be freed here to not leak any
  * ram from arrays allocated within the work struct */
 void free_work(struct work *work)
 {
-	clean_work(work);
-	free(work);
+	struct work_cache * const cache = _bfg_work_cache();
+
+	_clean_work_for_reuse(work);
+	work->next = cache->works;
+	cache->works = work;
+	++cache->frees;
+	if (unlikely(++cache->count > WORK_CACHE_MAX))
+		work_cache_spill(cache);
 }
 
 static const char *workpadding_bin = "\0\0\0\x80\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\x80\x02\0\0";
@@ -2968,9 +3330,241 @@ void decay_time(double *f, double fadd, double fsecs)
 	*f /= ftotal;
 }
 
+// NOTE: Only tv_staged may be used here, since clone_available rolls staged works in place (changing their id)
+static
+bool staged_before(const struct work * const a, const struct work * const b)
+{
+	return timercmp(&a->tv_staged, &b->tv_staged, <);
+}
+
+static
+void staged_heap_sift_down(struct staged_heap * const heap, int i)
+{
+	struct work ** const works = heap->works;
+	struct work * const work = works[i];
+	int child;
+	
+	while ((child = (i * 2) + 1) < heap->count)
+	{
+		if (child + 1 < heap->count && staged_before(works[child + 1], works[child]))
+			++child;
+		if (!staged_before(works[child], work))
+			break;
+		works[i] = works[child];
+		i = child;
+	}
+	works[i] = work;
+}
+
+static
+void staged_heap_push(struct staged_heap * const heap, struct work * const work)
+{
+	struct work **works;
+	int i, parent;
+	
+	if (heap->count == heap->alloc)
+	{
+		heap->alloc = heap->alloc ? (heap->alloc * 2) : 0x40;
+		heap->works = realloc(heap->works, heap->alloc * sizeof(*heap->works));
+		if (unlikely(!heap->works))
+			quit(1, "Failed to realloc staged work heap");
+	}
+	works = heap->works;
+	for (i = heap->count++; i; i = parent)
+	{
+		parent = (i - 1) / 2;
+		if (!staged_before(work, works[parent]))
+			break;
+		works[i] = works[parent];
+	}
+	works[i] = work;
+}
+
+static
+struct work *staged_heap_pop(struct staged_heap * const heap)
+{
+	struct work * const work = heap->works[0];
+	
+	if (--heap->count)
+	{
+		heap->works[0] = heap->works[heap->count];
+		staged_heap_sift_down(heap, 0);
+	}
+	return work;
+}
+
+/* Removes (and hands to cb for disposal) every work cb accepts, then restores
+ * the heap property in one O(n) pass */
+static
+int staged_heap_remove_if(struct staged_heap * const heap, bool (*cb)(struct work *, void *), void * const userp)
+{
+	int i, j, removed;
+	
+	for (i = j = 0; i < heap->count; ++i)
+		if (!cb(heap->works[i], userp))
+			heap->works[j++] = heap->works[i];
+	removed = heap->count - j;
+	heap->count = j;
+	if (removed)
+		for (i = (heap->count / 2) - 1; i >= 0; --i)
+			staged_heap_sift_down(heap, i);
+	return removed;
+}
+
+static
+int staged_remove_if(bool (*cb)(struct work *, void *), void * const userp)
+{
+	int removed = 0;
+	
+	for (int i = 0; i < SHI_COUNT; ++i)
+		removed += staged_heap_remove_if(&staged_heaps[i], cb, userp);
+	return removed;
+}
+
+static
+bool _test_staged_heap_odd_cb(struct work * const work, void * const userp)
+{
+	return work->id & 1;
+}
+
+static
+int _test_staged_tv_sort(struct work * const worka, struct work * const workb)
+{
+	return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
+}
+
+struct _test_staged_bench {
+	// Protects everything below, standing in for stgd_lock
+	pthread_mutex_t lock;
+	bool uthash;
+	struct staged_heap heap;
+	struct work *uthash_works;
+	struct work *works;
+	int depth;
+	int ops;
+	time_t next_staged;
+};
+
+static
+void *_test_staged_bench_thread(void * const userp)
+{
+	struct _test_staged_bench * const bench = userp;
+	struct work *work;
+	int i;
+	
+	for (i = 0; i < bench->ops; ++i)
+	{
+		mutex_lock(&bench->lock);
+		if (bench->uthash)
+		{
+			work = bench->uthash_works;
+			HASH_DEL(bench->uthash_works, work);
+			work->tv_staged.tv_sec = bench->next_staged++;
+			HASH_ADD_INT(bench->uthash_works, id, work);
+			HASH_SORT(bench->uthash_works, _test_staged_tv_sort);
+		}
+		else
+		{
+			work = staged_heap_pop(&bench->heap);
+			work->tv_staged.tv_sec = bench->next_staged++;
+			staged_heap_push(&bench->heap, work);
+		}
+		mutex_unlock(&bench->lock);
+	}
+	return NULL;
+}
+
+// Returns how long threads (up to 0x10) took to do ops pop/push pairs between them
+static
+long _test_staged_bench_run(struct _test_staged_bench * const bench, const int threads, const int ops)
+{
+	pthread_t pth[0x10];
+	struct timeval tv_start;
+	long us;
+	int i;
+	
+	for (i = 0; i < bench->depth; ++i)
+	{
+		bench->works[i].id = i;
+		bench->works[i].tv_staged.tv_sec = i;
+		if (bench->uthash)
+			HASH_ADD_INT(bench->uthash_works, id, &bench->works[i]);
+		else
+			staged_heap_push(&bench->heap, &bench->works[i]);
+	}
+	bench->next_staged = bench->depth;
+	bench->ops = ops / threads;
+	
+	cgtime(&tv_start);
+	for (i = 0; i < threads; ++i)
+		if (unlikely(pthread_create(&pth[i], NULL, _test_staged_bench_thread, bench)))
+			quit(1, "Failed to create thread in %s", __func__);
+	for (i = 0; i < threads; ++i)
+		pthread_join(pth[i], NULL);
+	us = timer_elapsed_us(&tv_start, NULL);
+	
+	HASH_CLEAR(hh, bench->uthash_works);
+	bench->heap.count = 0;
+	return us;
+}
+
+static
+void test_staged_heap()
+{
+	static const int depth = 0x100, bench_ops = 0x4000, bench_threads = 4;
+	struct staged_heap heap = { .works = NULL, };
+	struct _test_staged_bench bench = { .heap = { .works = NULL, }, };
+	struct work *works, *work, *prev = NULL;
+	long us[2][2];
+	int i;
+	
+	works = calloc(depth, sizeof(*works));
+	if (unlikely(!works))
+		quit(1, "Failed to calloc works in %s", __func__);
+	
+	// Pseudo-random staging times must come back out in order
+	for (i = 0; i < depth; ++i)
+	{
+		works[i].id = i;
+		works[i].tv_staged.tv_sec = (i * 7919) % depth;
+		staged_heap_push(&heap, &works[i]);
+	}
+	staged_heap_remove_if(&heap, _test_staged_heap_odd_cb, NULL);
+	if (heap.count != depth / 2)
+		applog(LOG_ERR, "Staged work heap test failed: %d works left after removing half of %d", heap.count, depth);
+	while (heap.count)
+	{
+		work = staged_heap_pop(&heap);
+		if ((prev && staged_before(work, prev)) || (work->id & 1))
+			applog(LOG_ERR, "Staged work heap test failed: popped work %d (staged %ld) after %d (staged %ld)",
+			       work->id, (long)work->tv_staged.tv_sec, prev ? prev->id : -1, prev ? (long)prev->tv_staged.tv_sec : -1L);
+		prev = work;
+	}
+	
+	// Rough comparison with the sorted hashtable this replaced, at a steady state of one pop and push per work
+	bench.works = works;
+	bench.depth = depth;
+	mutex_init(&bench.lock);
+	for (i = 0; i < 2; ++i)
+	{
+		bench.uthash = i;
+		us[i][0] = _test_staged_bench_run(&bench, 1, bench_ops);
+		us[i][1] = _test_staged_bench_run(&bench, bench_threads, bench_ops);
+	}
+	mutex_destroy(&bench.lock);
+	
+	applog(LOG_DEBUG, "Staged work queue: %d pop/push pairs at depth %d in %ldus (sorted hashtable: %ldus)",
+	       bench_ops, depth, us[0][0], us[1][0]);
+	applog(LOG_DEBUG, "Staged work queue: %d pop/push pairs at depth %d from %d contending threads in %ldus (sorted hashtable: %ldus)",
+	       bench_ops, depth, bench_threads, us[0][1], us[1][1]);
+	free(bench.heap.works);
+	free(heap.works);
+	free(works);
+}
+
 static int __total_staged(void)
 {
-	return HASH_COUNT(staged_work);
+	return staged_heaps[SHI_NOROLL].count + staged_heaps[SHI_ROLLABLE].count;
 }
 
 static int total_staged(void)
@@ -3089,32 +3683,139 @@ double stats_elapsed(struct cgminer_stats *stats)
 	return elapsed;
 }
 
-bool drv_ready(struct cgpu_info *cgpu)
+static
+int latency_hist_bucket(const uint32_t us)
 {
-	switch (cgpu->status) {
-		case LIFE_INIT:
-		case LIFE_DEAD2:
-			return false;
-		default:
-			return true;
-	}
+	int e = 0;
+	
+	if (us < 8)
+		return us;
+	while (us >> e > 1)
+		++e;
+	return ((e - 2) * 8) + ((us >> (e - 3)) & 7);
 }
 
-double cgpu_utility(struct cgpu_info *cgpu)
+// Largest value that lands in the bucket
+static
+uint32_t latency_hist_bucket_max(const int bucket)
 {
-	double dev_runtime = cgpu_runtime(cgpu);
-	return cgpu->utility = cgpu->accepted / dev_runtime * 60;
+	const int shift = (bucket / 8) - 1;
+	
+	if (bucket < 8)
+		return bucket;
+	return ((uint32_t)(9 + (bucket % 8)) << shift) - 1;
 }
 
-#define suffix_string(val, buf, bufsiz, sigdigits)  do{ \
-	_Static_assert(sigdigits == 0, "suffix_string only supported with sigdigits==0");  \
-	format_unit3(buf, bufsiz, FUP_DIFF, "", H2B_SHORTV, val, -1);  \
-}while(0)
+void latency_hist_add_us(struct latency_hist * const hist, int64_t us)
+{
+	if (us < 0)
+		us = 0;
+	else
+	if (us > UINT32_MAX)
+		us = UINT32_MAX;
+	++hist->count;
+	hist->total_us += us;
+	if (us > hist->max_us)
+		hist->max_us = us;
+	++hist->buckets[latency_hist_bucket(us)];
+}
 
-static float
-utility_to_hashrate(double utility)
+void latency_hist_add(struct latency_hist * const hist, const struct timeval * const tv_start, const struct timeval * const tv_end)
 {
-	return utility * 0x4444444;
+	latency_hist_add_us(hist, timer_elapsed_us(tv_start, tv_end));
+}
+
+// Returns an upper bound for the given percentile, within 12.5% of the actual value
+uint32_t latency_hist_percentile(const struct latency_hist * const hist, const double percentile)
+{
+	uint64_t target, seen = 0;
+	uint32_t us;
+	int i;
+	
+	if (!hist->count)
+		return 0;
+	target = ceil(hist->count * percentile / 100);
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < LATENCY_HIST_BUCKETS; ++i)
+	{
+		seen += hist->buckets[i];
+		if (seen >= target)
+			break;
+	}
+	us = latency_hist_bucket_max(i);
+	return (us < hist->max_us) ? us : hist->max_us;
+}
+
+static
+void test_latency_hist()
+{
+	struct latency_hist hist = { .count = 0, };
+	uint64_t v;
+	uint32_t us, lower;
+	int i, bucket, prev = 0;
+	
+	// Buckets must be contiguous, in order, and never more than 12.5% wide
+	for (v = 1; v <= UINT32_MAX; v += (v < 0x10000) ? 1 : (v >> 9))
+	{
+		us = v;
+		bucket = latency_hist_bucket(us);
+		if (bucket < prev || bucket > prev + 1 || bucket >= LATENCY_HIST_BUCKETS
+		 || us > latency_hist_bucket_max(bucket) || us <= latency_hist_bucket_max(bucket - 1))
+		{
+			applog(LOG_ERR, "%s: %lu us landed in bucket %d (after %d)", __func__, (unsigned long)us, bucket, prev);
+			return;
+		}
+		lower = latency_hist_bucket_max(bucket - 1) + 1;
+		if (lower > 8 && latency_hist_bucket_max(bucket) - lower >= lower / 8)
+			applog(LOG_ERR, "%s: Bucket %d from %lu us is too wide", __func__, bucket, (unsigned long)lower);
+		prev = bucket;
+	}
+	if (latency_hist_bucket(UINT32_MAX) != LATENCY_HIST_BUCKETS - 1 || latency_hist_bucket_max(LATENCY_HIST_BUCKETS - 1) != UINT32_MAX)
+		applog(LOG_ERR, "%s: Largest value landed in bucket %d", __func__, latency_hist_bucket(UINT32_MAX));
+	
+	// 1..1000ms, so the percentiles are known
+	for (i = 1; i <= 1000; ++i)
+		latency_hist_add_us(&hist, i * 1000);
+	latency_hist_add_us(&hist, -1);
+	if (hist.count != 1001 || hist.max_us != 1000000 || hist.buckets[0] != 1)
+		applog(LOG_ERR, "%s: Bad totals (count %lu, max %lu)", __func__, (unsigned long)hist.count, (unsigned long)hist.max_us);
+	for (i = 0; i < 4; ++i)
+	{
+		static const double pcts[] = { 50, 90, 99, 100 };
+		const double expect = 10000 * pcts[i];
+		us = latency_hist_percentile(&hist, pcts[i]);
+		if (us < expect || us > expect * 1.125)
+			applog(LOG_ERR, "%s: P%g is %lu us, expected about %g", __func__, pcts[i], (unsigned long)us, expect);
+	}
+}
+
+bool drv_ready(struct cgpu_info *cgpu)
+{
+	switch (cgpu->status) {
+		case LIFE_INIT:
+		case LIFE_DEAD2:
+			return false;
+		default:
+			return true;
+	}
+}
+
+double cgpu_utility(struct cgpu_info *cgpu)
+{
+	double dev_runtime = cgpu_runtime(cgpu);
+	return cgpu->utility = cgpu->accepted / dev_runtime * 60;
+}
+
+#define suffix_string(val, buf, bufsiz, sigdigits)  do{ \
+	_Static_assert(sigdigits == 0, "suffix_string only supported with sigdigits==0");  \
+	format_unit3(buf, bufsiz, FUP_DIFF, "", H2B_SHORTV, val, -1);  \
+}while(0)
+
+static float
+utility_to_hashrate(double utility)
+{
+	return utility * 0x4444444;
 }
 
 static const char*_unitchar = "pn\xb5m kMGTPEZY?";
@@ -4261,6 +4962,21 @@ void maybe_local_submit(const struct work *work)
 #endif
 }
 
+// Records how long the share waited to be sent, and how long the pool took to answer
+static
+void share_latency_add(const struct work * const work, const struct timeval * const tv_submit, const struct timeval * const tv_submit_reply)
+{
+	struct cgpu_info * const cgpu = get_thr_cgpu(work->thr_id);
+	struct pool * const pool = work->pool;
+	
+	mutex_lock(&stats_lock);
+	latency_hist_add(&cgpu->lat_found_submit, &work->tv_work_found, tv_submit);
+	latency_hist_add(&pool->lat_found_submit, &work->tv_work_found, tv_submit);
+	latency_hist_add(&cgpu->lat_submit, tv_submit, tv_submit_reply);
+	latency_hist_add(&pool->lat_submit, tv_submit, tv_submit_reply);
+	mutex_unlock(&stats_lock);
+}
+
 /* Theoretically threads could race when modifying accepted and
  * rejected values but the chance of two submits completing at the
  * same time is zero so there is no point adding extra locking */
@@ -4400,8 +5116,9 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 
 static char *submit_upstream_work_request(struct work *work)
 {
-	char *hexstr = NULL;
-	char *s, *sd;
+	static const char getwork_pre[] = "{\"method\": \"getwork\", \"params\": [ \"";
+	static const char getwork_post[] = "\" ], \"id\":1}";
+	char *s, *sd, *p = NULL;
 	struct pool *pool = work->pool;
 
 	if (work->tmpl) {
@@ -4421,16 +5138,15 @@ static char *submit_upstream_work_request(struct work *work)
 		bin2hex(sd, data, 80);
 	} else {
 
-	/* build hex string */
-		hexstr = malloc((sizeof(work->data) * 2) + 1);
-		bin2hex(hexstr, work->data, sizeof(work->data));
-
-	/* build JSON-RPC request */
-		s = strdup("{\"method\": \"getwork\", \"params\": [ \"");
-		s = realloc_strcat(s, hexstr);
-		s = realloc_strcat(s, "\" ], \"id\":1}");
-
-		free(hexstr);
+	/* build JSON-RPC request, with room for the newline */
+		s = malloc((sizeof(getwork_pre) - 1) + (sizeof(work->data) * 2) + sizeof(getwork_post) + 1);
+		p = s;
+		memcpy(p, getwork_pre, sizeof(getwork_pre) - 1);
+		p += sizeof(getwork_pre) - 1;
+		bin2hex(p, work->data, sizeof(work->data));
+		p += sizeof(work->data) * 2;
+		memcpy(p, getwork_post, sizeof(getwork_post));
+		p += sizeof(getwork_post) - 1;
 		sd = s;
 
 	}
@@ -4439,7 +5155,7 @@ static char *submit_upstream_work_request(struct work *work)
 	if (work->tmpl)
 		free(sd);
 	else
-		s = realloc_strcat(s, "\n");
+		strcpy(p, "\n");
 
 	return s;
 }
@@ -4467,6 +5183,8 @@ static bool submit_upstream_work_completed(struct work *work, bool resubmit, str
 	} else if (pool_tclear(pool, &pool->submit_fail))
 		applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 
+	share_latency_add(work, ptv_submit, &tv_submit_reply);
+
 	res = json_object_get(val, "result");
 	err = json_object_get(val, "error");
 
@@ -4957,6 +5675,9 @@ tryagain:
 
 	cgtime(&work->tv_getwork_reply);
 	timersub(&(work->tv_getwork_reply), &(work->tv_getwork), &tv_elapsed);
+	mutex_lock(&stats_lock);
+	latency_hist_add(&pool->lat_getwork, &work->tv_getwork, &work->tv_getwork_reply);
+	mutex_unlock(&stats_lock);
 	pool_stats->getwork_wait_rolling += ((double)tv_elapsed.tv_sec + ((double)tv_elapsed.tv_usec / 1000000)) * 0.63;
 	pool_stats->getwork_wait_rolling /= 1.63;
 
@@ -5294,17 +6015,18 @@ static void roll_work(struct work *work)
 static void _copy_work(struct work *work, const struct work *base_work, int noffset)
 {
 	int id = work->id;
+	bytes_t nonce2;
 
-	clean_work(work);
+	_clean_work_for_reuse(work);
+	nonce2 = work->nonce2;
 	memcpy(work, base_work, sizeof(struct work));
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
 	work->id = id;
-	if (base_work->job_id)
-		work->job_id = strdup(base_work->job_id);
-	if (base_work->nonce1)
-		work->nonce1 = strdup(base_work->nonce1);
-	bytes_cpy(&work->nonce2, &base_work->nonce2);
+	work->nonce2 = nonce2;
+	bytes_cat(&work->nonce2, &base_work->nonce2);
+	work->job_id = refstr_ref(base_work->job_id);
+	work->nonce1 = refstr_ref(base_work->nonce1);
 
 	if (base_work->tmpl) {
 		struct pool *pool = work->pool;
@@ -5361,25 +6083,25 @@ static void stage_work(struct work *work);
 
 static bool clone_available(void)
 {
-	struct work *work_clone = NULL, *work, *tmp;
+	struct staged_heap * const heap = &staged_heaps[SHI_ROLLABLE];
+	struct work *work_clone = NULL, *work = NULL;
 	bool cloned = false;
+	int i;
 
 	mutex_lock(stgd_lock);
-	if (!staged_rollable)
-		goto out_unlock;
-
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (can_roll(work) && should_roll(work)) {
-			roll_work(work);
-			work_clone = make_clone(work);
-			applog(LOG_DEBUG, "%s: Rolling work %d to %d", __func__, work->id, work_clone->id);
-			roll_work(work);
-			cloned = true;
-			break;
-		}
+	// Roll the oldest work that can be
+	for (i = 0; i < heap->count; ++i)
+		if ((!work) || staged_before(heap->works[i], work))
+			if (can_roll(heap->works[i]) && should_roll(heap->works[i]))
+				work = heap->works[i];
+	if (work) {
+		roll_work(work);
+		work_clone = make_clone(work);
+		applog(LOG_DEBUG, "%s: Rolling work %d to %d", __func__, work->id, work_clone->id);
+		roll_work(work);
+		cloned = true;
 	}
 
-out_unlock:
 	mutex_unlock(stgd_lock);
 
 	if (cloned) {
@@ -5637,13 +6359,8 @@ static struct submit_work_state *begin_submission(struct work *work)
 		timer_set_delay_from_now(&sws->tv_staleexpire, 300000000);
 	}
 
-	if (work->stratum) {
-		char *s;
-
-		s = malloc(1024);
-
-		sws->s = s;
-	} else {
+	// Stratum submissions are encoded once their socket is ready to write
+	if (!work->stratum) {
 		/* submit solution to bitcoin via JSON-RPC */
 		sws->ce = pop_curl_entry2(pool, false);
 		if (sws->ce) {
@@ -5714,6 +6431,67 @@ static void free_sws(struct submit_work_state *sws)
 	free(sws);
 }
 
+/* Writes the mining.submit for a stratum share into buf, and returns its
+ * length; the buffer has room for stratum_send's newline. Everything up to
+ * nonce2 only depends on the user and job, so that is kept per pool and only
+ * rebuilt for a new job, leaving a few hex fields and the id per share. */
+static size_t stratum_submit_encode(bytes_t * const buf, struct pool * const pool, const struct work * const work, const int id)
+{
+	static const char head[] = "{\"params\": [\"%s\", \"%s\", \"";
+	static const char sep[] = "\", \"";
+	static const char mid[] = "\"], \"id\": ";
+	static const char tail[] = ", \"method\": \"mining.submit\"}";
+	const size_t n2len = bytes_len(&work->nonce2);
+	char digits[11], *p;
+	unsigned u;
+	size_t len;
+	int n;
+
+	if (pool->submit_tmpl_job != work->job_id || !pool->submit_tmpl_user || strcmp(pool->submit_tmpl_user, pool->rpc_user))
+	{
+		len = strlen(pool->rpc_user) + strlen(work->job_id) + sizeof(head);
+		bytes_resize(&pool->submit_tmpl, len);
+		len = snprintf((char *)bytes_buf(&pool->submit_tmpl), len, head, pool->rpc_user, work->job_id);
+		bytes_resize(&pool->submit_tmpl, len);
+		refstr_unref(pool->submit_tmpl_job);
+		pool->submit_tmpl_job = refstr_ref(work->job_id);
+		free(pool->submit_tmpl_user);
+		pool->submit_tmpl_user = strdup(pool->rpc_user);
+	}
+
+	len = bytes_len(&pool->submit_tmpl);
+	bytes_resize(buf, len + (n2len * 2) + ((sizeof(sep) - 1 + 8) * 2) + (sizeof(mid) - 1) + 1 + sizeof(digits) + sizeof(tail) + 1);
+	p = (char *)bytes_buf(buf);
+	memcpy(p, bytes_buf(&pool->submit_tmpl), len);
+	p += len;
+	bin2hex(p, bytes_buf(&work->nonce2), n2len);
+	p += n2len * 2;
+	memcpy(p, sep, sizeof(sep) - 1);
+	p += sizeof(sep) - 1;
+	bin2hex(p, &work->data[68], 4);  // ntime
+	p += 8;
+	memcpy(p, sep, sizeof(sep) - 1);
+	p += sizeof(sep) - 1;
+	bin2hex(p, &work->data[76], 4);  // nonce
+	p += 8;
+	memcpy(p, mid, sizeof(mid) - 1);
+	p += sizeof(mid) - 1;
+	if (id < 0)
+		(p++)[0] = '-';
+	u = (id < 0) ? -(unsigned)id : (unsigned)id;
+	n = 0;
+	do {
+		digits[n++] = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+	while (n)
+		(p++)[0] = digits[--n];
+	memcpy(p, tail, sizeof(tail));
+	p += sizeof(tail) - 1;
+
+	return p - (char *)bytes_buf(buf);
+}
+
 static void *submit_work_thread(__maybe_unused void *userdata)
 {
 	int wip = 0;
@@ -5723,6 +6501,7 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 	struct submit_work_state *sws, **swsp;
 	struct submit_work_state *write_sws = NULL;
 	unsigned tsreduce = 0;
+	bytes_t submit_buf = BYTES_INIT;
 
 	pthread_detach(pthread_self());
 
@@ -5756,7 +6535,7 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 			if ( (sws = begin_submission(work)) ) {
 				if (sws->ce)
 					curl_multi_add_handle(curlm, sws->ce->curl);
-				else if (sws->s) {
+				else if (work->stratum) {
 					sws->next = write_sws;
 					write_sws = sws;
 				}
@@ -5843,32 +6622,27 @@ next_write_sws_del:
 				continue;
 			}
 			
-			char *s = sws->s;
 			struct stratum_share *sshare = calloc(sizeof(struct stratum_share), 1);
 			int sshare_id;
-			uint32_t nonce;
-			char nonce2hex[(bytes_len(&work->nonce2) * 2) + 1];
-			char noncehex[9];
-			char ntimehex[9];
+			size_t slen;
+			char *s;
 			
 			sshare->work = copy_work(work);
-			bin2hex(nonce2hex, bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
-			nonce = *((uint32_t *)(work->data + 76));
-			bin2hex(noncehex, (const unsigned char *)&nonce, 4);
-			bin2hex(ntimehex, (void *)&work->data[68], 4);
+			cgtime(&sshare->tv_submit);
 			
 			mutex_lock(&sshare_lock);
 			/* Give the stratum share a unique id */
 			sshare_id =
 			sshare->id = swork_id++;
 			HASH_ADD_INT(stratum_shares, id, sshare);
-			snprintf(s, 1024, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-				pool->rpc_user, work->job_id, nonce2hex, ntimehex, noncehex, sshare->id);
 			mutex_unlock(&sshare_lock);
 			
+			slen = stratum_submit_encode(&submit_buf, pool, work, sshare_id);
+			s = (char *)bytes_buf(&submit_buf);
+			
 			applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->stratum_url, s);
 
-			if (likely(stratum_send(pool, s, strlen(s)))) {
+			if (likely(stratum_send(pool, s, slen))) {
 				if (pool_tclear(pool, &pool->submit_fail))
 					applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 				applog(LOG_DEBUG, "Successfully submitted, adding to stratum_shares db");
@@ -5935,6 +6709,7 @@ next_write_sws_del:
 	mutex_unlock(&submitting_lock);
 
 	curl_multi_cleanup(curlm);
+	bytes_free(&submit_buf);
 
 	applog(LOG_DEBUG, "submit_work thread exiting");
 
@@ -6070,6 +6845,18 @@ static bool pool_unusable(struct pool *pool)
 	return false;
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+static pthread_mutex_t stratum_evloop_lock;
+static notifier_t stratum_evloop_notifier;
+static int stratum_evloop_epfd = -1;
+
+static void stratum_evloop_wake(void)
+{
+	if (stratum_evloop_epfd != -1)
+		notifier_wake(stratum_evloop_notifier);
+}
+#endif
+
 void switch_pools(struct pool *selected)
 {
 	struct pool *pool, *last_pool;
@@ -6151,6 +6938,9 @@ void switch_pools(struct pool *selected)
 	mutex_lock(&lp_lock);
 	pthread_cond_broadcast(&lp_cond);
 	mutex_unlock(&lp_lock);
+#ifdef HAVE_SYS_EPOLL_H
+	stratum_evloop_wake();
+#endif
 
 }
 
@@ -6176,23 +6966,143 @@ static void wake_gws(void)
 	mutex_unlock(stgd_lock);
 }
 
-static void discard_stale(void)
+/* Each processor keeps a small magazine of staged work, refilled in bulk by
+ * hash_pop, so most get_work calls never touch stgd_lock; a processor that
+ * runs dry steals from the others before waiting on the shared queue.
+ * Lock order is stgd_lock before work_magazine_lock. */
+static struct work *work_magazine_take(struct cgpu_info * const cgpu)
 {
-	struct work *work, *tmp;
-	int stale = 0;
+	struct work *work = NULL;
 
-	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (stale_work(work, false)) {
-			HASH_DEL(staged_work, work);
-			discard_work(work);
-			stale++;
-			staged_full = false;
+	mutex_lock(&cgpu->work_magazine_lock);
+	if (cgpu->work_magazine_count)
+	{
+		work = cgpu->work_magazine[0];
+		--cgpu->work_magazine_count;
+		memmove(&cgpu->work_magazine[0], &cgpu->work_magazine[1], sizeof(*cgpu->work_magazine) * cgpu->work_magazine_count);
+	}
+	mutex_unlock(&cgpu->work_magazine_lock);
+
+	return work;
+}
+
+static struct work *work_magazine_steal(struct cgpu_info * const thief)
+{
+	struct cgpu_info *cgpu;
+	struct work *work;
+	int i;
+
+	for (i = 0; i < total_devices; ++i)
+	{
+		cgpu = get_devices(i);
+		if (cgpu == thief)
+			continue;
+		// Never wait on a busy magazine; it is about to be emptied anyway
+		if (mutex_trylock(&cgpu->work_magazine_lock))
+			continue;
+		work = NULL;
+		if (cgpu->work_magazine_count)
+			work = cgpu->work_magazine[--cgpu->work_magazine_count];
+		mutex_unlock(&cgpu->work_magazine_lock);
+		if (work)
+			return work;
+	}
+
+	return NULL;
+}
+
+/* Works held in magazines are still queued as far as the getwork scheduler
+ * is concerned.  Must be called with stgd_lock held */
+static int __total_magazined(void)
+{
+	struct cgpu_info *cgpu;
+	int i, ret = 0;
+
+	for (i = 0; i < total_devices; ++i)
+	{
+		cgpu = get_devices(i);
+		mutex_lock(&cgpu->work_magazine_lock);
+		ret += cgpu->work_magazine_count;
+		mutex_unlock(&cgpu->work_magazine_lock);
+	}
+
+	return ret;
+}
+
+/* Must be called with stgd_lock held */
+static void _getwork_waiting_clear(struct thr_info * const thr)
+{
+	if (unlikely(thr->getwork_waiting))
+	{
+		thr->getwork_waiting = false;
+		--getwork_waiters;
+	}
+}
+
+/* Must be called with stgd_lock held; takes only non-rollable surplus, so
+ * every other mining thread can still find something in the shared queue */
+static void _work_magazine_refill(struct cgpu_info * const cgpu)
+{
+	struct staged_heap * const heap = &staged_heaps[SHI_NOROLL];
+	int n = heap->count - mining_threads;
+
+	if (n <= 0)
+		return;
+	mutex_lock(&cgpu->work_magazine_lock);
+	if (n > WORK_MAGAZINE_SIZE - cgpu->work_magazine_count)
+		n = WORK_MAGAZINE_SIZE - cgpu->work_magazine_count;
+	while (n-- > 0)
+	{
+		cgpu->work_magazine[cgpu->work_magazine_count++] = heap->works[0];
+		staged_heap_pop(heap);
+	}
+	mutex_unlock(&cgpu->work_magazine_lock);
+}
+
+static int work_magazines_remove_if(bool (*cb)(struct work *, void *), void * const userp)
+{
+	struct cgpu_info *cgpu;
+	int i, j, k, removed = 0;
+
+	for (i = 0; i < total_devices; ++i)
+	{
+		cgpu = get_devices(i);
+		mutex_lock(&cgpu->work_magazine_lock);
+		for (j = k = 0; j < cgpu->work_magazine_count; ++j)
+		{
+			if (cb(cgpu->work_magazine[j], userp))
+				++removed;
+			else
+				cgpu->work_magazine[k++] = cgpu->work_magazine[j];
 		}
+		cgpu->work_magazine_count = k;
+		mutex_unlock(&cgpu->work_magazine_lock);
 	}
+
+	return removed;
+}
+
+static bool _discard_stale_cb(struct work * const work, void * const userp)
+{
+	if (!stale_work(work, false))
+		return false;
+	discard_work(work);
+	return true;
+}
+
+static void discard_stale(void)
+{
+	int stale;
+
+	mutex_lock(stgd_lock);
+	stale = staged_remove_if(_discard_stale_cb, NULL);
+	if (stale)
+		staged_full = false;
 	pthread_cond_signal(&gws_cond);
 	mutex_unlock(stgd_lock);
 
+	stale += work_magazines_remove_if(_discard_stale_cb, NULL);
+
 	if (stale)
 		applog(LOG_DEBUG, "Discarded %d stales that didn't match current hash", stale);
 }
@@ -6464,14 +7374,26 @@ out_free:
 	return ret;
 }
 
-static int tv_sort(struct work *worka, struct work *workb)
+static bool work_rollable(struct work *work)
 {
-	return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
+	return (!work->clone && work->rolltime);
 }
 
-static bool work_rollable(struct work *work)
+/* Must be called with stgd_lock held */
+static void _wake_getwork_waiters(void)
 {
-	return (!work->clone && work->rolltime);
+	struct thr_info *thr;
+	int i;
+
+	for (i = 0; i < mining_threads; ++i)
+	{
+		thr = mining_thr[i];
+		if (!thr->getwork_waiting)
+			continue;
+		thr->getwork_waiting = false;
+		notifier_wake(thr->notifier);
+	}
+	getwork_waiters = 0;
 }
 
 static bool hash_push(struct work *work)
@@ -6479,20 +7401,39 @@ static bool hash_push(struct work *work)
 	bool rc = true;
 
 	mutex_lock(stgd_lock);
-	if (work_rollable(work))
-		staged_rollable++;
+	if (likely(!getq->frozen))
+		staged_heap_push(&staged_heaps[work_rollable(work) ? SHI_ROLLABLE : SHI_NOROLL], work);
+	else
+		rc = false;
+	pthread_cond_broadcast(&getq->cond);
+	if (getwork_waiters)
+		_wake_getwork_waiters();
+	mutex_unlock(stgd_lock);
+
+	return rc;
+}
+
+/* Pushes several works with only one stgd_lock acquisition */
+static bool hash_push_batch(struct work ** const works, const int count)
+{
+	bool rc = true;
+	int i;
+
+	mutex_lock(stgd_lock);
 	if (likely(!getq->frozen)) {
-		HASH_ADD_INT(staged_work, id, work);
-		HASH_SORT(staged_work, tv_sort);
+		for (i = 0; i < count; ++i)
+			staged_heap_push(&staged_heaps[work_rollable(works[i]) ? SHI_ROLLABLE : SHI_NOROLL], works[i]);
 	} else
 		rc = false;
 	pthread_cond_broadcast(&getq->cond);
+	if (getwork_waiters)
+		_wake_getwork_waiters();
 	mutex_unlock(stgd_lock);
 
 	return rc;
 }
 
-static void stage_work(struct work *work)
+static void _stage_work_prepare(struct work *work)
 {
 	applog(LOG_DEBUG, "Pushing work %d from pool %d to hash queue",
 	       work->id, work->pool->pool_no);
@@ -6501,9 +7442,23 @@ static void stage_work(struct work *work)
 	cgtime(&work->pool->tv_last_work_time);
 	test_work_current(work);
 	work->pool->works++;
+}
+
+static void stage_work(struct work *work)
+{
+	_stage_work_prepare(work);
 	hash_push(work);
 }
 
+static void stage_work_batch(struct work ** const works, const int count)
+{
+	int i;
+	
+	for (i = 0; i < count; ++i)
+		_stage_work_prepare(works[i]);
+	hash_push_batch(works, count);
+}
+
 #ifdef HAVE_CURSES
 int curses_int(const char *query)
 {
@@ -6570,9 +7525,12 @@ static void display_pool_summary(struct pool *pool)
  * still be work referencing it. We just remove it from the pools list */
 void remove_pool(struct pool *pool)
 {
-	int i, last_pool = total_pools - 1;
+	int i, last_pool;
 	struct pool *other;
 
+	cg_wlock(&control_lock);
+	last_pool = total_pools - 1;
+
 	/* Boost priority of any lower prio than this one */
 	for (i = 0; i < total_pools; i++) {
 		other = pools[i];
@@ -6590,6 +7548,7 @@ void remove_pool(struct pool *pool)
 	pool->removed = true;
 	pool->has_stratum = false;
 	total_pools--;
+	cg_wunlock(&control_lock);
 }
 
 /* add a mutex if this needs to be thread safe in the future */
@@ -6750,6 +7709,10 @@ void write_config(FILE *fcfg)
 		fprintf(fcfg, ",\n\"stop-time\" : \"%d:%d\"", schedstop.tm.tm_hour, schedstop.tm.tm_min);
 	if (opt_socks_proxy && *opt_socks_proxy)
 		fprintf(fcfg, ",\n\"socks-proxy\" : \"%s\"", json_escape(opt_socks_proxy));
+#ifdef HAVE_SHM_OPEN
+	if (opt_shmstats)
+		fprintf(fcfg, ",\n\"shm-stats\" : \"%s\"", json_escape(opt_shmstats));
+#endif
 	
 	_write_config_string_elist(fcfg, "scan", scan_devices);
 #ifdef USE_LIBMICROHTTPD
@@ -7922,6 +8885,10 @@ static void hashmeter(int thr_id, struct timeval *diff,
 out_unlock:
 	mutex_unlock(&hash_lock);
 
+#ifdef HAVE_SHM_OPEN
+	shmstats_update();
+#endif
+
 	if (showlog) {
 		if (!curses_active) {
 			printf("%s          \r", logstatusline);
@@ -7952,7 +8919,10 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 				 struct stratum_share *sshare)
 {
 	struct work *work = sshare->work;
+	struct timeval tv_submit_reply;
 
+	cgtime(&tv_submit_reply);
+	share_latency_add(work, &sshare->tv_submit, &tv_submit_reply);
 	share_result(val, res_val, err_val, work, false, "");
 }
 
@@ -7962,10 +8932,22 @@ bool parse_stratum_response(struct pool *pool, char *s)
 {
 	json_t *val = NULL, *err_val, *res_val, *id_val;
 	struct stratum_share *sshare;
+	struct stratum_fastjson fj;
 	json_error_t err;
 	bool ret = false;
+	long long fj_id;
 	int id;
 
+	// Accepted shares are by far the most common response, and need no jansson tree
+	if (stratum_fastjson_scan(&fj, s) && fj.id && fastjson_int(fj.id, &fj_id)
+	 && fastjson_is(fj.result, "true") && (!fj.error || fastjson_is(fj.error, "null")))
+	{
+		res_val = json_true();
+		err_val = json_null();
+		id = fj_id;
+		goto have_id;
+	}
+
 	val = JSON_LOADS(s, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
@@ -8036,6 +9018,7 @@ fishy:
 
 	id = json_integer_value(id_val);
 
+have_id:
 	mutex_lock(&sshare_lock);
 	HASH_FIND_INT(stratum_shares, &id, sshare);
 	if (sshare)
@@ -8191,21 +9174,22 @@ static void resubmit_stratum_shares(struct pool *pool)
 	}
 }
 
-static void clear_pool_work(struct pool *pool)
+static bool _clear_pool_work_cb(struct work * const work, void * const userp)
 {
-	struct work *work, *tmp;
-	int cleared = 0;
+	if (work->pool != userp)
+		return false;
+	free_work(work);
+	return true;
+}
 
+static void clear_pool_work(struct pool *pool)
+{
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (work->pool == pool) {
-			HASH_DEL(staged_work, work);
-			free_work(work);
-			cleared++;
-			staged_full = false;
-		}
-	}
+	if (staged_remove_if(_clear_pool_work_cb, pool))
+		staged_full = false;
 	mutex_unlock(stgd_lock);
+
+	work_magazines_remove_if(_clear_pool_work_cb, pool);
 }
 
 static int cp_prio(void)
@@ -8286,6 +9270,84 @@ static bool supports_resume(struct pool *pool)
 	return ret;
 }
 
+/* Handles one message received from a stratum pool */
+static void stratum_handle_line(struct pool * const pool, char * const s)
+{
+	/* Check this pool hasn't died while being a backup pool and
+	 * has not had its idle flag cleared */
+	stratum_resumed(pool);
+
+	if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
+		applog(LOG_INFO, "Unknown stratum msg: %s", s);
+	if (pool->swork.clean) {
+		struct work *work = make_work();
+
+		/* Generate a single work item to update the current
+		 * block database */
+		pool->swork.clean = false;
+		gen_stratum_work(pool, work);
+
+		/* Try to extract block height from coinbase scriptSig */
+		uint8_t *bin_height = &bytes_buf(&pool->swork.coinbase)[4 /*version*/ + 1 /*txin count*/ + 36 /*prevout*/ + 1 /*scriptSig len*/ + 1 /*push opcode*/];
+		unsigned char cb_height_sz;
+		cb_height_sz = bin_height[-1];
+		if (cb_height_sz == 3) {
+			// FIXME: The block number will overflow this by AD 2173
+			uint32_t block_id = ((uint32_t*)work->data)[1];
+			uint32_t height = 0;
+			memcpy(&height, bin_height, 3);
+			height = le32toh(height);
+			have_block_height(block_id, height);
+		}
+
+		++pool->work_restart_id;
+		pool_update_work_restart_time(pool);
+		if (test_work_current(work)) {
+			/* Only accept a work update if this stratum
+			 * connection is from the current pool */
+			struct pool * const cp = current_pool();
+			if (pool == cp)
+				restart_threads();
+			
+			applog(
+			       ((!opt_quiet_work_updates) && pool_actively_in_use(pool, cp) ? LOG_NOTICE : LOG_DEBUG),
+			       "Stratum from pool %d requested work update", pool->pool_no);
+		} else
+			applog(LOG_NOTICE, "Stratum from pool %d detected new block", pool->pool_no);
+		free_work(work);
+	}
+
+	if (timer_passed(&pool->swork.tv_transparency, NULL)) {
+		// More than 4 timmills past since requested transactions
+		timer_unset(&pool->swork.tv_transparency);
+		pool_set_opaque(pool, true);
+	}
+}
+
+/* Marks the stratum connection as gone, and deals with everything that was
+ * depending on it; the caller decides whether to reconnect */
+static void stratum_interrupted(struct pool * const pool)
+{
+	applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
+	pool->getfail_occasions++;
+	total_go++;
+
+	mutex_lock(&pool->stratum_lock);
+	pool->stratum_active = pool->stratum_notify = false;
+	pool->sock = INVSOCK;
+	mutex_unlock(&pool->stratum_lock);
+
+	/* If the socket to our stratum pool disconnects, all
+	 * submissions need to be discarded or resent. */
+	if (!supports_resume(pool))
+		clear_stratum_shares(pool);
+	else
+		resubmit_stratum_shares(pool);
+	clear_pool_work(pool);
+	if (pool == current_pool())
+		restart_threads();
+}
+
 /* One stratum thread per pool that has stratum waits on the socket checking
  * for new messages and for the integrity of the socket connection. We reset
  * the connection based on the integrity of the receive side only as the send
@@ -8356,29 +9418,12 @@ static void *stratum_thread(void *userdata)
 			applog(LOG_DEBUG, "Stratum select failed on pool %d with value %d", pool->pool_no, sel_ret);
 			s = NULL;
 		} else
-			s = recv_line(pool);
+			s = _recv_line(pool, NULL);
 		if (!s) {
 			if (!pool->has_stratum)
 				break;
 
-			applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
-			pool->getfail_occasions++;
-			total_go++;
-
-			mutex_lock(&pool->stratum_lock);
-			pool->stratum_active = pool->stratum_notify = false;
-			pool->sock = INVSOCK;
-			mutex_unlock(&pool->stratum_lock);
-
-			/* If the socket to our stratum pool disconnects, all
-			 * submissions need to be discarded or resent. */
-			if (!supports_resume(pool))
-				clear_stratum_shares(pool);
-			else
-				resubmit_stratum_shares(pool);
-			clear_pool_work(pool);
-			if (pool == current_pool())
-				restart_threads();
+			stratum_interrupted(pool);
 
 			if (restart_stratum(pool))
 				continue;
@@ -8388,66 +9433,333 @@ static void *stratum_thread(void *userdata)
 			break;
 		}
 
-		/* Check this pool hasn't died while being a backup pool and
-		 * has not had its idle flag cleared */
-		stratum_resumed(pool);
+		stratum_handle_line(pool, s);
+	}
+
+out:
+	return NULL;
+}
 
-		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
-			applog(LOG_INFO, "Unknown stratum msg: %s", s);
-		free(s);
-		if (pool->swork.clean) {
-			struct work *work = make_work();
+#ifdef HAVE_SYS_EPOLL_H
+/* With --stratum-event-loop, one thread waits on the sockets of all stratum
+ * pools instead, making the same checks as stratum_thread does between
+ * messages. Reconnecting still blocks, so each attempt gets a short-lived
+ * thread of its own, while the waits between retries are timers here. */
 
-			/* Generate a single work item to update the current
-			 * block database */
-			pool->swork.clean = false;
-			gen_stratum_work(pool, work);
+static enum stratum_evloop_state stratum_evloop_get_state(struct pool * const pool)
+{
+	enum stratum_evloop_state state;
+
+	mutex_lock(&stratum_evloop_lock);
+	state = pool->evloop_state;
+	mutex_unlock(&stratum_evloop_lock);
+
+	return state;
+}
+
+static void stratum_evloop_set_state(struct pool * const pool, const enum stratum_evloop_state state)
+{
+	mutex_lock(&stratum_evloop_lock);
+	pool->evloop_state = state;
+	mutex_unlock(&stratum_evloop_lock);
+}
+
+static void *stratum_evloop_restart_thread(void *userdata)
+{
+	struct pool * const pool = userdata;
+	bool ok;
+
+	pthread_detach(pthread_self());
+
+	char threadname[20];
+	snprintf(threadname, 20, "stratumcnx%u", pool->pool_no);
+	RenameThread(threadname);
+
+	ok = restart_stratum(pool);
+
+	mutex_lock(&stratum_evloop_lock);
+	pool->evloop_restart_ok = ok;
+	pool->evloop_state = SELS_RESTARTED;
+	mutex_unlock(&stratum_evloop_lock);
+	notifier_wake(stratum_evloop_notifier);
+
+	return NULL;
+}
+
+static void stratum_evloop_restart(struct pool * const pool, const bool lost)
+{
+	pthread_t pth;
+
+	pool->evloop_lost = lost;
+	stratum_evloop_set_state(pool, SELS_RESTARTING);
+	if (unlikely(pthread_create(&pth, NULL, stratum_evloop_restart_thread, pool)))
+		quit(1, "Failed to create stratum restart thread");
+}
+
+static void stratum_evloop_lost(struct pool * const pool)
+{
+	if (!pool->has_stratum)
+	{
+		stratum_evloop_set_state(pool, SELS_NONE);
+		return;
+	}
+
+	stratum_interrupted(pool);
+	stratum_evloop_restart(pool, true);
+}
 
-			/* Try to extract block height from coinbase scriptSig */
-			uint8_t *bin_height = &bytes_buf(&pool->swork.coinbase)[4 /*version*/ + 1 /*txin count*/ + 36 /*prevout*/ + 1 /*scriptSig len*/ + 1 /*push opcode*/];
-			unsigned char cb_height_sz;
-			cb_height_sz = bin_height[-1];
-			if (cb_height_sz == 3) {
-				// FIXME: The block number will overflow this by AD 2173
-				uint32_t block_id = ((uint32_t*)work->data)[1];
-				uint32_t height = 0;
-				memcpy(&height, bin_height, 3);
-				height = le32toh(height);
-				have_block_height(block_id, height);
+/* Sockets are watched one-shot, so one which was replaced (even by another
+ * with the same number) can only ever wake us once; this (re)arms the current
+ * one */
+static void stratum_evloop_watch(struct pool * const pool)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLONESHOT,
+		.data.ptr = pool,
+	};
+
+	if (!epoll_ctl(stratum_evloop_epfd, EPOLL_CTL_MOD, pool->sock, &ev))
+		return;
+	if (errno != ENOENT || epoll_ctl(stratum_evloop_epfd, EPOLL_CTL_ADD, pool->sock, &ev))
+		applog(LOG_ERR, "Pool %u: Failed to watch stratum socket: %s",
+		       pool->pool_no, bfg_strerror(errno, BST_ERRNO));
+}
+
+/* Most lines handled for one pool before the event loop moves on to the
+ * others; anything left over is picked up on the next sweep */
+#define STRATUM_EVLOOP_MAX_LINES  0x10
+
+/* Reads and handles whatever the pool has sent, and decides what to do with
+ * its connection next. Anything the event loop needs to wake up for is
+ * reduced into *tvp_timeout */
+static void stratum_evloop_check(struct pool * const pool, struct timeval * const tvp_timeout)
+{
+	enum stratum_evloop_state state = stratum_evloop_get_state(pool);
+	struct timeval tv_now;
+	bool closed = false;
+	int lines = 0;
+	char *s;
+
+	switch (state)
+	{
+		case SELS_NONE:
+		case SELS_RESTARTING:
+			return;
+		case SELS_RESTARTED:
+			if (pool->evloop_restart_ok)
+			{
+				pool->evloop_restarts = 0;
+				break;
 			}
+			if (pool->evloop_lost)
+			{
+				shutdown_stratum(pool);
+				pool_died(pool);
+				stratum_evloop_set_state(pool, SELS_NONE);
+				return;
+			}
+			if (!pool->evloop_restarts++)
+			{
+				// Like stratum_thread, try again right away the first time
+				pool_died(pool);
+				timer_set_now(&pool->tv_evloop);
+			}
+			else
+			{
+				if (pool->removed)
+				{
+					stratum_evloop_set_state(pool, SELS_NONE);
+					return;
+				}
+				timer_set_delay_from_now(&pool->tv_evloop, 30000000);
+			}
+			stratum_evloop_set_state(pool, SELS_RETRY);
+			// Fallthru
+		case SELS_RETRY:
+			if (timer_passed(&pool->tv_evloop, NULL))
+				stratum_evloop_restart(pool, false);
+			else
+				reduce_timeout_to(tvp_timeout, &pool->tv_evloop);
+			return;
+		case SELS_SUSPENDED:
+			if (cnx_needed(pool))
+				stratum_evloop_restart(pool, false);
+			return;
+		case SELS_NEW:
+		case SELS_CONNECTED:
+			break;
+	}
 
-			++pool->work_restart_id;
-			pool_update_work_restart_time(pool);
-			if (test_work_current(work)) {
-				/* Only accept a work update if this stratum
-				 * connection is from the current pool */
-				struct pool * const cp = current_pool();
-				if (pool == cp)
-					restart_threads();
-				
-				applog(
-				       ((!opt_quiet_work_updates) && pool_actively_in_use(pool, cp) ? LOG_NOTICE : LOG_DEBUG),
-				       "Stratum from pool %d requested work update", pool->pool_no);
-			} else
-				applog(LOG_NOTICE, "Stratum from pool %d detected new block", pool->pool_no);
-			free_work(work);
+	if (state != SELS_CONNECTED)
+	{
+		stratum_evloop_set_state(pool, SELS_CONNECTED);
+		timer_set_delay_from_now(&pool->tv_evloop, 120000000);
+	}
+
+	while (true)
+	{
+		if (unlikely(!pool->has_stratum))
+		{
+			stratum_evloop_set_state(pool, SELS_NONE);
+			return;
 		}
 
-		if (timer_passed(&pool->swork.tv_transparency, NULL)) {
-			// More than 4 timmills past since requested transactions
-			timer_unset(&pool->swork.tv_transparency);
-			pool_set_opaque(pool, true);
+		if (pool->sock == INVSOCK)
+			applog(LOG_DEBUG, "Pool %u: Invalid socket, suspending",
+			       pool->pool_no);
+		else
+		if (!sock_full(pool) && !cnx_needed(pool))
+			applog(LOG_DEBUG, "Pool %u: Connection not needed, suspending",
+			       pool->pool_no);
+		else
+		{
+			if (lines++ >= STRATUM_EVLOOP_MAX_LINES)
+			{
+				// Let the other pools have a turn, then come right back
+				timer_set_now(&tv_now);
+				reduce_timeout_to(tvp_timeout, &tv_now);
+				break;
+			}
+			s = recv_line_nowait(pool, NULL, &closed);
+			if (!s)
+				break;
+			timer_set_delay_from_now(&pool->tv_evloop, 120000000);
+			stratum_handle_line(pool, s);
+			if (unlikely(pool->evloop_reconnect))
+			{
+				pool->evloop_reconnect = false;
+				stratum_evloop_restart(pool, false);
+				return;
+			}
+			continue;
 		}
+
+		suspend_stratum(pool);
+		clear_stratum_shares(pool);
+		clear_pool_work(pool);
+		stratum_evloop_set_state(pool, SELS_SUSPENDED);
+		if (cnx_needed(pool))
+			stratum_evloop_restart(pool, false);
+		return;
+	}
+
+	if (closed)
+	{
+		stratum_evloop_lost(pool);
+		return;
+	}
+
+	/* If we fail to receive any notify messages for 2 minutes we
+	 * assume the connection has been dropped and treat this pool
+	 * as dead */
+	if (timer_passed(&pool->tv_evloop, NULL))
+	{
+		applog(LOG_DEBUG, "Stratum receive timed out on pool %d", pool->pool_no);
+		stratum_evloop_lost(pool);
+		return;
+	}
+
+	stratum_evloop_watch(pool);
+	reduce_timeout_to(tvp_timeout, &pool->tv_evloop);
+}
+
+static void *stratum_evloop_thread(__maybe_unused void *userdata)
+{
+	struct epoll_event evs[0x10];
+	struct timeval tv_timeout, tv_wait, tv_now, *tvp;
+	struct pool *pool, **sweep_pools = NULL;
+	bool sweep = true;
+	int i, n, sweep_pools_sz = 0;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("stratum_evloop");
+
+	timer_unset(&tv_timeout);
+	while (42)
+	{
+		if (sweep)
+		{
+			timer_unset(&tv_timeout);
+			// addpool/removepool can change pools[] under us
+			cg_rlock(&control_lock);
+			n = total_pools;
+			if (n > sweep_pools_sz)
+			{
+				sweep_pools = realloc(sweep_pools, sizeof(*sweep_pools) * n);
+				sweep_pools_sz = n;
+			}
+			memcpy(sweep_pools, pools, sizeof(*sweep_pools) * n);
+			cg_runlock(&control_lock);
+			for (i = 0; i < n; ++i)
+				stratum_evloop_check(sweep_pools[i], &tv_timeout);
+		}
+
+		tv_wait = tv_timeout;
+		cgtime(&tv_now);
+		tvp = select_timeout(&tv_wait, &tv_now);
+		n = epoll_wait(stratum_evloop_epfd, evs, sizeof(evs) / sizeof(*evs),
+		               tvp ? (timeval_to_us(tvp) + 999) / 1000 : -1);
+
+		sweep = false;
+		for (i = 0; i < n; ++i)
+		{
+			pool = evs[i].data.ptr;
+			if (!pool)
+			{
+				notifier_read(stratum_evloop_notifier);
+				sweep = true;
+			}
+			else
+			if (stratum_evloop_get_state(pool) == SELS_CONNECTED)
+				stratum_evloop_check(pool, &tv_timeout);
+		}
+		if (timer_passed(&tv_timeout, NULL))
+			sweep = true;
 	}
 
-out:
 	return NULL;
 }
 
+static void stratum_evloop_add(struct pool * const pool)
+{
+	mutex_lock(&stratum_evloop_lock);
+	if (stratum_evloop_epfd == -1)
+	{
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = NULL,
+		};
+		pthread_t pth;
+
+		stratum_evloop_epfd = epoll_create(0x10);
+		if (unlikely(stratum_evloop_epfd == -1))
+			quit(1, "Failed to create stratum event loop: %s", bfg_strerror(errno, BST_ERRNO));
+		notifier_init(stratum_evloop_notifier);
+		if (unlikely(epoll_ctl(stratum_evloop_epfd, EPOLL_CTL_ADD, stratum_evloop_notifier[0], &ev)))
+			quit(1, "Failed to watch stratum event loop notifier: %s", bfg_strerror(errno, BST_ERRNO));
+		if (unlikely(pthread_create(&pth, NULL, stratum_evloop_thread, NULL)))
+			quit(1, "Failed to create stratum event loop thread");
+	}
+	pool->evloop_state = SELS_NEW;
+	mutex_unlock(&stratum_evloop_lock);
+
+	notifier_wake(stratum_evloop_notifier);
+}
+#endif
+
 static void init_stratum_thread(struct pool *pool)
 {
 	have_longpoll = true;
 
+#ifdef HAVE_SYS_EPOLL_H
+	if (opt_stratum_evloop)
+	{
+		stratum_evloop_add(pool);
+		return;
+	}
+#endif
+
 	if (unlikely(pthread_create(&pool->stratum_thread, NULL, stratum_thread, (void *)pool)))
 		quit(1, "Failed to create stratum thread");
 }
@@ -8671,16 +9983,29 @@ static void pool_resus(struct pool *pool)
 		applog(LOG_INFO, "Pool %d %s alive", pool->pool_no, pool->rpc_url);
 }
 
-static struct work *hash_pop(void)
+/* If blocking is false, returns NULL instead of waiting for work to be staged;
+ * thr is then woken through its notifier once there is some */
+static struct work *hash_pop(struct thr_info * const thr, const bool blocking)
 {
-	struct work *work = NULL, *tmp;
-	int hc;
+	struct staged_heap *heap;
+	struct work *work;
 	struct timespec ts;
 
 retry:
 	mutex_lock(stgd_lock);
-	while (!HASH_COUNT(staged_work))
+	while (!__total_staged())
 	{
+		if (!blocking)
+		{
+			if (!thr->getwork_waiting)
+			{
+				thr->getwork_waiting = true;
+				++getwork_waiters;
+			}
+			pthread_cond_signal(&gws_cond);
+			mutex_unlock(stgd_lock);
+			return NULL;
+		}
 		if (unlikely(staged_full))
 		{
 			if (likely(opt_queue < 10 + mining_threads))
@@ -8705,15 +10030,9 @@ retry:
 	
 	no_work = false;
 
-	hc = HASH_COUNT(staged_work);
 	/* Find clone work if possible, to allow masters to be reused */
-	if (hc > staged_rollable) {
-		HASH_ITER(hh, staged_work, work, tmp) {
-			if (!work_rollable(work))
-				break;
-		}
-	} else
-		work = staged_work;
+	heap = &staged_heaps[staged_heaps[SHI_NOROLL].count ? SHI_NOROLL : SHI_ROLLABLE];
+	work = heap->works[0];
 	
 	if (can_roll(work) && should_roll(work))
 	{
@@ -8723,9 +10042,9 @@ retry:
 		goto retry;
 	}
 	
-	HASH_DEL(staged_work, work);
-	if (work_rollable(work))
-		staged_rollable--;
+	staged_heap_pop(heap);
+	_work_magazine_refill(thr->cgpu);
+	_getwork_waiting_clear(thr);
 
 	/* Signal the getwork scheduler to look for more work */
 	pthread_cond_signal(&gws_cond);
@@ -8782,6 +10101,54 @@ void gen_hash(unsigned char *data, unsigned char *hash, int len)
 	sha256(hash1, 32, hash);
 }
 
+static
+void test_sha256()
+{
+	static const struct {
+		const char *msg;
+		const char *hash;
+	} vectors[] = {
+		{"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+		{"abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+		{"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+		{"abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1"},
+	};
+	unsigned char hash[32], expect[32];
+	int i;
+
+	// Whichever implementation sha256() picked for this CPU
+	for (i = 0; i < sizeof(vectors) / sizeof(*vectors); ++i)
+	{
+		hex2bin(expect, vectors[i].hash, 32);
+		sha256((const void *)vectors[i].msg, strlen(vectors[i].msg), hash);
+		if (memcmp(hash, expect, 32))
+			applog(LOG_ERR, "SHA256 test failed: \"%s\"", vectors[i].msg);
+	}
+
+#ifdef HAVE_SHANI
+	if (sha256_shani_supported())
+	{
+		uint32_t h[8], hc[8], w[64];
+		int j;
+
+		for (i = 0; i < 0x100; ++i)
+		{
+			for (j = 0; j < 8; ++j)
+				hc[j] = h[j] = sha256_h0[j] * (i + 1) + j;
+			for (j = 0; j < 16; ++j)
+				w[j] = 0x9e3779b9 * (i * 16 + j + 1);
+			sha256_transf_shani(h, w);
+			sha256_transf_c(hc, w);
+			if (memcmp(h, hc, sizeof(h)))
+			{
+				applog(LOG_ERR, "SHA-NI transform test failed: block %d", i);
+				break;
+			}
+		}
+	}
+#endif
+}
+
 /* PDiff 1 is a 256 bit unsigned integer of
  * 0x00000000ffffffffffffffffffffffffffffffffffffffffffffffffffffffff
  * so we use a big endian 32 bit unsigned integer positioned at the Nth byte to
@@ -8889,81 +10256,342 @@ void test_target()
 	TEST_TARGET(set_target_to_pdiff, true, expect, 0x100);
 }
 
-void stratum_work_cpy(struct stratum_work * const dst, const struct stratum_work * const src)
+void stratum_work_cpy(struct stratum_work * const dst, const struct stratum_work * const src)
+{
+	*dst = *src;
+	dst->job_id = refstr_ref(src->job_id);
+	bytes_cpy(&dst->coinbase, &src->coinbase);
+	bytes_cpy(&dst->merkle_bin, &src->merkle_bin);
+	bytes_cpy(&dst->merkle_words, &src->merkle_words);
+	bytes_cpy(&dst->coinbase_tail, &src->coinbase_tail);
+}
+
+void stratum_work_clean(struct stratum_work * const swork)
+{
+	refstr_unref(swork->job_id);
+	bytes_free(&swork->coinbase);
+	bytes_free(&swork->merkle_bin);
+	bytes_free(&swork->merkle_words);
+	bytes_free(&swork->coinbase_tail);
+}
+
+/* Caches everything in the job that does not depend on nonce2, so generating
+ * each work only needs to hash the coinbase tail and the merkle branch */
+void stratum_work_precompute(struct stratum_work * const swork)
+{
+	const uint32_t * const merkle_bin = (const uint32_t *)bytes_buf(&swork->merkle_bin);
+	const size_t coinbase_len = bytes_len(&swork->coinbase);
+	const uint64_t bitlen = (uint64_t)coinbase_len * 8;
+	size_t tail_len, padded_len;
+	uint32_t *merkle_words;
+	uint8_t *p;
+	sha256_ctx ctx;
+	int i;
+	
+	swork->coinbase_midstate_len = swork->nonce2_offset & ~(size_t)(SHA256_BLOCK_SIZE - 1);
+	sha256_init(&ctx);
+	sha256_update(&ctx, bytes_buf(&swork->coinbase), swork->coinbase_midstate_len);
+	memcpy(swork->coinbase_midstate, ctx.h, sizeof(swork->coinbase_midstate));
+	
+	tail_len = coinbase_len - swork->coinbase_midstate_len;
+	padded_len = (tail_len + 9 + SHA256_BLOCK_SIZE - 1) & ~(size_t)(SHA256_BLOCK_SIZE - 1);
+	bytes_resize(&swork->coinbase_tail, padded_len);
+	p = bytes_buf(&swork->coinbase_tail);
+	memcpy(p, &bytes_buf(&swork->coinbase)[swork->coinbase_midstate_len], tail_len);
+	p[tail_len] = 0x80;
+	memset(&p[tail_len + 1], 0, padded_len - tail_len - 1);
+	for (i = 0; i < 8; ++i)
+		p[padded_len - 1 - i] = bitlen >> (i * 8);
+	
+	bytes_resize(&swork->merkle_words, 32 * swork->merkles);
+	merkle_words = (uint32_t *)bytes_buf(&swork->merkle_words);
+	for (i = 0; i < swork->merkles * 8; ++i)
+		merkle_words[i] = be32toh(merkle_bin[i]);
+}
+
+/* Computes the merkle root as big endian words for nonce2, without touching
+ * the coinbase in swork; if nonce2 is NULL, the coinbase must already have it
+ * filled in */
+void stratum_work_merkle_root2(uint32_t * const root, const struct stratum_work * const swork, const uint8_t * const nonce2, const size_t nonce2sz)
+{
+	const uint8_t * const coinbase = bytes_buf(&swork->coinbase);
+	const size_t coinbase_len = bytes_len(&swork->coinbase);
+	const size_t midstate_len = swork->coinbase_midstate_len;
+	const uint32_t *merkle_words = (const uint32_t *)bytes_buf(&swork->merkle_words);
+	uint32_t hash1[8], hash[8], node[16];
+	sha256_ctx ctx;
+	int i;
+	
+	sha256_init_midstate(&ctx, swork->coinbase_midstate, midstate_len);
+	if (nonce2)
+	{
+		const size_t tail_pos = swork->nonce2_offset + nonce2sz;
+		sha256_update(&ctx, &coinbase[midstate_len], swork->nonce2_offset - midstate_len);
+		sha256_update(&ctx, nonce2, nonce2sz);
+		sha256_update(&ctx, &coinbase[tail_pos], coinbase_len - tail_pos);
+	}
+	else
+		sha256_update(&ctx, &coinbase[midstate_len], coinbase_len - midstate_len);
+	sha256_final(&ctx, (void *)hash1);
+	sha256((void *)hash1, 32, (void *)hash);
+	for (i = 0; i < 8; ++i)
+		node[i] = be32toh(hash[i]);
+	
+	for (i = 0; i < swork->merkles; ++i, merkle_words += 8)
+	{
+		memcpy(&node[8], merkle_words, 32);
+		sha256d_64_words(node, node);
+	}
+	memcpy(root, node, 32);
+}
+
+/* Computes the merkle root as big endian words from the coinbase, which must
+ * already have nonce2 filled in */
+void stratum_work_merkle_root(uint32_t * const root, const struct stratum_work * const swork)
+{
+	stratum_work_merkle_root2(root, swork, NULL, 0);
+}
+
+/* Second SHA-256 pass over a 32 byte digest in each lane, in place */
+static
+void _sha256_32_4way(uint32_t * const h)
+{
+	uint32_t w[16 * 4];
+	int j;
+	
+	memcpy(w, h, 8 * 4 * sizeof(*w));
+	for (j = 8 * 4; j < 16 * 4; ++j)
+		w[j] = 0;
+	for (j = 0; j < 4; ++j)
+	{
+		w[(8 * 4) + j] = 0x80000000;
+		w[(15 * 4) + j] = 256;
+	}
+	for (j = 0; j < 8 * 4; ++j)
+		h[j] = sha256_h0[j / 4];
+	sha256_transf_4way(h, w);
+}
+
+/* Same as stratum_work_merkle_root, but for several nonce2 values at once,
+ * hashing 4 lanes at a time; does not touch the coinbase in swork */
+void stratum_work_merkle_roots(uint32_t (* const roots)[8], const struct stratum_work * const swork, const uint8_t * const * const nonce2s, const size_t nonce2sz, const int count)
 {
-	*dst = *src;
-	dst->job_id = strdup(src->job_id);
-	bytes_cpy(&dst->coinbase, &src->coinbase);
-	bytes_cpy(&dst->merkle_bin, &src->merkle_bin);
+	const uint8_t * const tail = bytes_buf(&swork->coinbase_tail);
+	const int blocks = bytes_len(&swork->coinbase_tail) / SHA256_BLOCK_SIZE;
+	const size_t nonce2_pos = swork->nonce2_offset - swork->coinbase_midstate_len;
+	const uint8_t *nonce2;
+	const uint32_t *merkle_words;
+	uint32_t block[16], h[8 * 4], w[16 * 4];
+	size_t block_pos, lo, hi;
+	int i, j, lane, b;
+	
+	for (i = 0; i < count; i += 4)
+	{
+		for (lane = 0; lane < 4; ++lane)
+			for (j = 0; j < 8; ++j)
+				h[(j * 4) + lane] = swork->coinbase_midstate[j];
+		for (b = 0; b < blocks; ++b)
+		{
+			block_pos = b * SHA256_BLOCK_SIZE;
+			lo = (nonce2_pos > block_pos) ? nonce2_pos : block_pos;
+			hi = nonce2_pos + nonce2sz;
+			if (hi > block_pos + SHA256_BLOCK_SIZE)
+				hi = block_pos + SHA256_BLOCK_SIZE;
+			for (lane = 0; lane < 4; ++lane)
+			{
+				// Lanes past the end just repeat the last nonce2
+				nonce2 = nonce2s[(i + lane < count) ? (i + lane) : (count - 1)];
+				memcpy(block, &tail[block_pos], SHA256_BLOCK_SIZE);
+				if (lo < hi)
+					memcpy(&((uint8_t *)block)[lo - block_pos], &nonce2[lo - nonce2_pos], hi - lo);
+				for (j = 0; j < 16; ++j)
+					w[(j * 4) + lane] = be32toh(block[j]);
+			}
+			sha256_transf_4way(h, w);
+		}
+		_sha256_32_4way(h);
+		
+		merkle_words = (const uint32_t *)bytes_buf(&swork->merkle_words);
+		for (b = 0; b < swork->merkles; ++b, merkle_words += 8)
+		{
+			memcpy(w, h, 8 * 4 * sizeof(*w));
+			for (j = 0; j < 8; ++j)
+				for (lane = 0; lane < 4; ++lane)
+					w[((8 + j) * 4) + lane] = merkle_words[j];
+			for (j = 0; j < 8 * 4; ++j)
+				h[j] = sha256_h0[j / 4];
+			sha256_transf_4way(h, w);
+			
+			for (j = 0; j < 16 * 4; ++j)
+				w[j] = 0;
+			for (lane = 0; lane < 4; ++lane)
+			{
+				w[lane] = 0x80000000;
+				w[(15 * 4) + lane] = 512;
+			}
+			sha256_transf_4way(h, w);
+			_sha256_32_4way(h);
+		}
+		
+		for (lane = 0; lane < 4 && i + lane < count; ++lane)
+			for (j = 0; j < 8; ++j)
+				roots[i + lane][j] = h[(j * 4) + lane];
+	}
 }
 
-void stratum_work_clean(struct stratum_work * const swork)
+#define MAX_STRATUM_WORK_BATCH 32
+
+static
+void _test_stratum_merkle_root(const size_t nonce2_offset, const int merkles)
 {
-	free(swork->job_id);
-	bytes_free(&swork->coinbase);
-	bytes_free(&swork->merkle_bin);
+	struct stratum_work swork = {
+		.nonce2_offset = nonce2_offset,
+		.merkles = merkles,
+	};
+	unsigned char naive[32], merkle_sha[64];
+	uint8_t nonce2s[5][8], *p;
+	const uint8_t *nonce2p[5];
+	uint32_t root[8], roots[5][8];
+	int i, j;
+	
+	bytes_resize(&swork.coinbase, nonce2_offset + 8 + 0x47);
+	p = bytes_buf(&swork.coinbase);
+	for (i = 0; i < bytes_len(&swork.coinbase); ++i)
+		p[i] = i * 7;
+	bytes_resize(&swork.merkle_bin, 32 * merkles);
+	p = bytes_buf(&swork.merkle_bin);
+	for (i = 0; i < 32 * merkles; ++i)
+		p[i] = i * 13;
+	stratum_work_precompute(&swork);
+	
+	for (j = 0; j < 5; ++j)
+	{
+		memset(nonce2s[j], j, 8);
+		nonce2p[j] = nonce2s[j];
+	}
+	stratum_work_merkle_roots(roots, &swork, nonce2p, 8, 5);
+	
+	for (j = 0; j < 5; ++j)
+	{
+		memset(&bytes_buf(&swork.coinbase)[nonce2_offset], j, 8);
+		stratum_work_merkle_root(root, &swork);
+		if (memcmp(root, roots[j], 32))
+			applog(LOG_ERR, "Stratum batch merkle root test failed: nonce2_offset %d, %d merkles, nonce2 %02x",
+			       (int)nonce2_offset, merkles, j);
+		memset(&bytes_buf(&swork.coinbase)[nonce2_offset], 0xff, 8);
+		stratum_work_merkle_root2(roots[j], &swork, nonce2s[j], 8);
+		memset(&bytes_buf(&swork.coinbase)[nonce2_offset], j, 8);
+		if (memcmp(root, roots[j], 32))
+			applog(LOG_ERR, "Stratum separate nonce2 merkle root test failed: nonce2_offset %d, %d merkles, nonce2 %02x",
+			       (int)nonce2_offset, merkles, j);
+		
+		gen_hash(bytes_buf(&swork.coinbase), naive, bytes_len(&swork.coinbase));
+		for (i = 0; i < merkles; ++i)
+		{
+			memcpy(merkle_sha, naive, 32);
+			memcpy(&merkle_sha[32], &bytes_buf(&swork.merkle_bin)[i * 32], 32);
+			gen_hash(merkle_sha, naive, 64);
+		}
+		for (i = 0; i < 8; ++i)
+			root[i] = htobe32(root[i]);
+		if (memcmp(root, naive, 32))
+			applog(LOG_ERR, "Stratum merkle root test failed: nonce2_offset %d, %d merkles, nonce2 %02x",
+			       (int)nonce2_offset, merkles, j);
+	}
+	
+	stratum_work_clean(&swork);
 }
 
-/* Generates stratum based work based on the most recent notify information
- * from the pool. This will keep generating work while a pool is down so we use
- * other means to detect when the pool has died in stratum_thread */
-static void gen_stratum_work(struct pool *pool, struct work *work)
+static
+void test_stratum_merkle_root()
 {
-	clean_work(work);
+	static const int bench_works = 0x1000;
+	struct stratum_work swork = {
+		.nonce2_offset = 0x60,
+		.merkles = 12,
+	};
+	struct timeval tv_start;
+	uint32_t root[8], batch_roots[MAX_STRATUM_WORK_BATCH][8], batch_nonce2s[MAX_STRATUM_WORK_BATCH];
+	const uint8_t *batch_nonce2p[MAX_STRATUM_WORK_BATCH];
+	long us;
+	int i;
 	
-	cg_wlock(&pool->data_lock);
-	pool->swork.data_lock_p = &pool->data_lock;
+	_test_stratum_merkle_root(0, 0);
+	_test_stratum_merkle_root(0x2a, 0);
+	// nonce2 straddling a block boundary
+	_test_stratum_merkle_root(0x3c, 3);
+	_test_stratum_merkle_root(0x40, 1);
+	_test_stratum_merkle_root(0x60, 2);
+	_test_stratum_merkle_root(0x81, 12);
+	_test_stratum_merkle_root(0x13f, 5);
+	
+	// Rough generation throughput for a typical job: coinbase of ~200 bytes, 4096 transactions
+	bytes_resize(&swork.coinbase, 0xc8);
+	memset(bytes_buf(&swork.coinbase), '\x55', bytes_len(&swork.coinbase));
+	bytes_resize(&swork.merkle_bin, 32 * swork.merkles);
+	memset(bytes_buf(&swork.merkle_bin), '\xaa', bytes_len(&swork.merkle_bin));
+	stratum_work_precompute(&swork);
+	cgtime(&tv_start);
+	for (i = 0; i < bench_works; ++i)
+	{
+		*((uint32_t*)&bytes_buf(&swork.coinbase)[swork.nonce2_offset]) = i;
+		stratum_work_merkle_root(root, &swork);
+	}
+	us = timer_elapsed_us(&tv_start, NULL);
+	applog(LOG_DEBUG, "Stratum work generation: %d merkle roots in %ldus (%.0f works/s per job)",
+	       bench_works, us, us ? (bench_works * 1e6 / us) : 0.);
 	
+	for (i = 0; i < MAX_STRATUM_WORK_BATCH; ++i)
+	{
+		batch_nonce2s[i] = i;
+		batch_nonce2p[i] = (const uint8_t *)&batch_nonce2s[i];
+	}
+	cgtime(&tv_start);
+	for (i = 0; i < bench_works; i += MAX_STRATUM_WORK_BATCH)
+		stratum_work_merkle_roots(batch_roots, &swork, batch_nonce2p, sizeof(*batch_nonce2s), MAX_STRATUM_WORK_BATCH);
+	us = timer_elapsed_us(&tv_start, NULL);
+	applog(LOG_DEBUG, "Stratum work generation: %d merkle roots in batches of %d in %ldus (%.0f works/s per job)",
+	       bench_works, MAX_STRATUM_WORK_BATCH, us, us ? (bench_works * 1e6 / us) : 0.);
+	stratum_work_clean(&swork);
+}
+
+/* Sets work's nonce2 from a value of the pool's nonce2 counter, and its pool;
+ * needs the pool's data_lock held */
+void stratum_work_set_nonce2(struct work * const work, struct pool * const pool, const uint64_t nonce2)
+{
 	bytes_resize(&work->nonce2, pool->n2size);
 	if (pool->nonce2sz < pool->n2size)
 		memset(&bytes_buf(&work->nonce2)[pool->nonce2sz], 0, pool->n2size - pool->nonce2sz);
 	memcpy(bytes_buf(&work->nonce2),
 #ifdef WORDS_BIGENDIAN
 	// NOTE: On big endian, the most significant bits are stored at the end, so skip the LSBs
-	       &((char*)&pool->nonce2)[pool->nonce2off],
+	       &((const char*)&nonce2)[pool->nonce2off],
 #else
-	       &pool->nonce2,
+	       &nonce2,
 #endif
 	       pool->nonce2sz);
-	pool->nonce2++;
 	
 	work->pool = pool;
 	work->work_restart_id = work->pool->work_restart_id;
-	gen_stratum_work2(work, &pool->swork, pool->nonce1);
-	
-	cgtime(&work->tv_staged);
 }
 
-void gen_stratum_work2(struct work *work, struct stratum_work *swork, const char *nonce1)
+static
+void _gen_stratum_work_nonce2(struct pool * const pool, struct work * const work)
 {
-	unsigned char *coinbase, merkle_root[32], merkle_sha[64];
-	uint8_t *merkle_bin;
-	uint32_t *data32, *swap32;
-	int i;
-
-	/* Generate coinbase */
-	coinbase = bytes_buf(&swork->coinbase);
-	memcpy(&coinbase[swork->nonce2_offset], bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
-
-	/* Downgrade to a read lock to read off the variables */
-	if (swork->data_lock_p)
-		cg_dwlock(swork->data_lock_p);
+	stratum_work_set_nonce2(work, pool, pool->nonce2++);
+}
 
-	/* Generate merkle root */
-	gen_hash(coinbase, merkle_root, bytes_len(&swork->coinbase));
-	memcpy(merkle_sha, merkle_root, 32);
-	merkle_bin = bytes_buf(&swork->merkle_bin);
-	for (i = 0; i < swork->merkles; ++i, merkle_bin += 32) {
-		memcpy(merkle_sha + 32, merkle_bin, 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
-	data32 = (uint32_t *)merkle_sha;
-	swap32 = (uint32_t *)merkle_root;
-	flip32(swap32, data32);
+/* Fills in the header and submission parameters; needs swork read locked */
+static
+void _gen_stratum_work_data(struct work * const work, const struct stratum_work * const swork, const char * const nonce1, const uint32_t * const merkle_root)
+{
+	uint32_t *data32;
+	int i;
 	
 	memcpy(&work->data[0], swork->header1, 36);
-	memcpy(&work->data[36], merkle_root, 32);
+	data32 = (uint32_t *)&work->data[36];
+	for (i = 0; i < 8; ++i)
+		data32[i] = htole32(merkle_root[i]);
 	*((uint32_t*)&work->data[68]) = htobe32(swork->ntime + timer_elapsed(&swork->tv_received, NULL));
 	memcpy(&work->data[72], swork->diffbits, 4);
 	memset(&work->data[76], 0, 4);  // nonce
@@ -8971,11 +10599,13 @@ void gen_stratum_work2(struct work *work, struct stratum_work *swork, const char
 
 	/* Copy parameters required for share submission */
 	memcpy(work->target, swork->target, sizeof(work->target));
-	work->job_id = strdup(swork->job_id);
-	work->nonce1 = strdup(nonce1);
-	if (swork->data_lock_p)
-		cg_runlock(swork->data_lock_p);
+	work->job_id = refstr_ref(swork->job_id);
+	work->nonce1 = refstr_ref(nonce1);
+}
 
+static
+void _gen_stratum_work_finish(struct work * const work)
+{
 	if (opt_debug)
 	{
 		char header[161];
@@ -8986,12 +10616,13 @@ void gen_stratum_work2(struct work *work, struct stratum_work *swork, const char
 		applog(LOG_DEBUG, "Work job_id %s nonce2 %s", work->job_id, nonce2hex);
 	}
 
-	calc_midstate(work);
-
+	// Proxy clients generate works from their own threads too
+	cg_wlock(&control_lock);
 	local_work++;
+	work->id = total_work++;
+	cg_wunlock(&control_lock);
 	work->stratum = true;
 	work->blk.nonce = 0;
-	work->id = total_work++;
 	work->longpoll = false;
 	work->getwork_mode = GETWORK_MODE_STRATUM;
 	/* Nominally allow a driver to ntime roll 60 seconds */
@@ -8999,6 +10630,87 @@ void gen_stratum_work2(struct work *work, struct stratum_work *swork, const char
 	calc_diff(work, 0);
 }
 
+/* Generates stratum based work based on the most recent notify information
+ * from the pool. This will keep generating work while a pool is down so we use
+ * other means to detect when the pool has died in stratum_thread */
+static void gen_stratum_work(struct pool *pool, struct work *work)
+{
+	_clean_work_for_reuse(work);
+	
+	cg_wlock(&pool->data_lock);
+	pool->swork.data_lock_p = &pool->data_lock;
+	
+	_gen_stratum_work_nonce2(pool, work);
+	gen_stratum_work2(work, &pool->swork, pool->nonce1);
+	
+	cgtime(&work->tv_staged);
+}
+
+/* Most stratum works are wanted all at once (startup, work restarts), so this
+ * generates a batch of them with one lock acquisition, hashing their merkle
+ * roots and midstates in parallel */
+static void gen_stratum_work_batch(struct pool * const pool, struct work ** const works, const int count)
+{
+	const uint8_t *nonce2s[count];
+	uint32_t merkle_roots[count][8];
+	int i;
+	
+	for (i = 0; i < count; ++i)
+		_clean_work_for_reuse(works[i]);
+	
+	cg_wlock(&pool->data_lock);
+	pool->swork.data_lock_p = &pool->data_lock;
+	for (i = 0; i < count; ++i)
+	{
+		_gen_stratum_work_nonce2(pool, works[i]);
+		nonce2s[i] = bytes_buf(&works[i]->nonce2);
+	}
+	
+	cg_dwlock(&pool->data_lock);
+	stratum_work_merkle_roots(merkle_roots, &pool->swork, nonce2s, pool->n2size, count);
+	for (i = 0; i < count; ++i)
+		_gen_stratum_work_data(works[i], &pool->swork, pool->nonce1, merkle_roots[i]);
+	cg_runlock(&pool->data_lock);
+	
+	calc_midstates(works, count);
+	for (i = 0; i < count; ++i)
+	{
+		_gen_stratum_work_finish(works[i]);
+		cgtime(&works[i]->tv_staged);
+	}
+}
+
+void gen_stratum_work2(struct work *work, struct stratum_work *swork, const char *nonce1)
+{
+	uint32_t merkle_root[8];
+
+	/* Generate coinbase */
+	memcpy(&bytes_buf(&swork->coinbase)[swork->nonce2_offset], bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
+
+	/* Downgrade to a read lock to read off the variables */
+	if (swork->data_lock_p)
+		cg_dwlock(swork->data_lock_p);
+
+	/* Generate merkle root */
+	stratum_work_merkle_root(merkle_root, swork);
+	_gen_stratum_work_data(work, swork, nonce1, merkle_root);
+	
+	if (swork->data_lock_p)
+		cg_runlock(swork->data_lock_p);
+
+	calc_midstate(work);
+	_gen_stratum_work_finish(work);
+}
+
+/* Same as gen_stratum_work2, but with the merkle root already computed (such
+ * as by stratum_work_merkle_root2); swork is only read, and must not change */
+void gen_stratum_work3(struct work * const work, const struct stratum_work * const swork, const char * const nonce1, const uint32_t * const merkle_root)
+{
+	_gen_stratum_work_data(work, swork, nonce1, merkle_root);
+	calc_midstate(work);
+	_gen_stratum_work_finish(work);
+}
+
 void request_work(struct thr_info *thr)
 {
 	struct cgpu_info *cgpu = thr->cgpu;
@@ -9016,22 +10728,32 @@ void request_work(struct thr_info *thr)
 		thread_reportout(proc->thr[0]);
 	}
 
+	// Keep the original start time while try_get_work is being retried
+	if (thr->_get_pending)
+		return;
+	thr->_get_pending = true;
 	cgtime(&dev_stats->_get_start);
 }
 
-// FIXME: Make this non-blocking (and remove HACK above)
-struct work *get_work(struct thr_info *thr)
+static struct work *_get_work(struct thr_info * const thr, const bool blocking)
 {
 	const int thr_id = thr->id;
 	struct cgpu_info *cgpu = thr->cgpu;
 	struct cgminer_stats *dev_stats = &(cgpu->cgminer_stats);
 	struct cgminer_stats *pool_stats;
-	struct timeval tv_get;
+	struct timeval tv_now, tv_get;
 	struct work *work = NULL;
 
 	applog(LOG_DEBUG, "%"PRIpreprv": Popping work from get queue to get work", cgpu->proc_repr);
 	while (!work) {
-		work = hash_pop();
+		if ((work = work_magazine_take(cgpu)))
+			++dev_stats->getwork_cached;
+		else
+		if (!total_staged() && (work = work_magazine_steal(cgpu)))
+			++dev_stats->getwork_stolen;
+		else
+		if (!(work = hash_pop(thr, blocking)))
+			return NULL;
 		if (stale_work(work, false)) {
 			staged_full = false;  // It wasn't really full, since it was stale :(
 			discard_work(work);
@@ -9039,6 +10761,14 @@ struct work *get_work(struct thr_info *thr)
 			wake_gws();
 		}
 	}
+	thr->_get_pending = false;
+	// Only this thread ever sets getwork_waiting, so if it looks clear, it is
+	if (unlikely(thr->getwork_waiting))
+	{
+		mutex_lock(stgd_lock);
+		_getwork_waiting_clear(thr);
+		mutex_unlock(stgd_lock);
+	}
 	last_getwork = time(NULL);
 	applog(LOG_DEBUG, "%"PRIpreprv": Got work %d from get queue to get work for thread %d",
 	       cgpu->proc_repr, work->id, thr_id);
@@ -9057,8 +10787,8 @@ struct work *get_work(struct thr_info *thr)
 	work->mined = true;
 	work->blk.nonce = 0;
 
-	cgtime(&tv_get);
-	timersub(&tv_get, &dev_stats->_get_start, &tv_get);
+	cgtime(&tv_now);
+	timersub(&tv_now, &dev_stats->_get_start, &tv_get);
 
 	timeradd(&tv_get, &dev_stats->getwork_wait, &dev_stats->getwork_wait);
 	if (timercmp(&tv_get, &dev_stats->getwork_wait_max, >))
@@ -9075,6 +10805,12 @@ struct work *get_work(struct thr_info *thr)
 		pool_stats->getwork_wait_min = tv_get;
 	++pool_stats->getwork_calls;
 	
+	mutex_lock(&stats_lock);
+	latency_hist_add(&cgpu->lat_getwork_wait, &dev_stats->_get_start, &tv_now);
+	latency_hist_add(&cgpu->lat_staged, &work->tv_staged, &tv_now);
+	latency_hist_add(&work->pool->lat_staged, &work->tv_staged, &tv_now);
+	mutex_unlock(&stats_lock);
+	
 	if (work->work_difficulty < 1)
 	{
 		if (unlikely(work->work_difficulty < cgpu->min_nonce_diff))
@@ -9092,6 +10828,18 @@ struct work *get_work(struct thr_info *thr)
 	return work;
 }
 
+struct work *get_work(struct thr_info *thr)
+{
+	return _get_work(thr, true);
+}
+
+/* Returns NULL if no work is staged yet; the thread's notifier is woken as soon
+ * as there is some, so callers should retry from their notifier loop */
+struct work *try_get_work(struct thr_info *thr)
+{
+	return _get_work(thr, false);
+}
+
 static
 void _submit_work_async(struct work *work)
 {
@@ -9151,12 +10899,11 @@ void inc_hw_errors3(struct thr_info *thr, const struct work *work, const uint32_
 		thr->cgpu->drv->hw_error(thr);
 }
 
-enum test_nonce2_result hashtest2(struct work *work, bool checktarget)
+/* Checks work->hash, which must already be hashed from work->data */
+static enum test_nonce2_result _hashtest2_check(struct work *work, bool checktarget)
 {
 	uint32_t *hash2_32 = (uint32_t *)&work->hash[0];
 
-	hash_data(work->hash, work->data);
-
 	if (hash2_32[7] != 0)
 		return TNR_BAD;
 
@@ -9185,6 +10932,12 @@ enum test_nonce2_result hashtest2(struct work *work, bool checktarget)
 	return TNR_GOOD;
 }
 
+enum test_nonce2_result hashtest2(struct work *work, bool checktarget)
+{
+	hash_data(work->hash, work->data);
+	return _hashtest2_check(work, checktarget);
+}
+
 enum test_nonce2_result _test_nonce2(struct work *work, uint32_t nonce, bool checktarget)
 {
 	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
@@ -9205,6 +10958,158 @@ bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 	return submit_noffset_nonce(thr, work, nonce, 0);
 }
 
+static bool _submit_noffset_nonce(struct thr_info *, struct work *, uint32_t nonce, int noffset, const void *hash);
+
+/* Midstate of the first block of work's header, for _hash_data_4way */
+static
+void _hash_data_midstate(uint32_t * const midstate, const struct work * const work)
+{
+	union {
+		unsigned char c[64];
+		uint32_t i[16];
+	} data;
+	sha256_ctx ctx;
+	
+	swap32yes(&data.i[0], work->data, 16);
+	sha256_init(&ctx);
+	sha256_update(&ctx, data.c, 64);
+	memcpy(midstate, ctx.h, sizeof(ctx.h));
+}
+
+/* Same as hash_data for work->data with each of up to 4 nonces, but finishing
+ * from the midstate and doing the rest of the double SHA256 4 nonces at a time */
+static
+void _hash_data_4way(uint32_t hash32[][8], const uint32_t * const midstate, const struct work * const work, const uint32_t * const nonces, const int n)
+{
+	const uint32_t * const data32 = (const uint32_t *)work->data;
+	uint32_t h[8 * 4], w[16 * 4];
+	int j, lane;
+	
+	// Second block of the header: tail of the data, nonce, and padding
+	for (lane = 0; lane < 4; ++lane)
+	{
+		for (j = 0; j < 8; ++j)
+			h[(j * 4) + lane] = midstate[j];
+		for (j = 0; j < 3; ++j)
+			w[(j * 4) + lane] = le32toh(data32[16 + j]);
+		// Lanes past the end just repeat the last nonce
+		w[(3 * 4) + lane] = nonces[(lane < n) ? lane : (n - 1)];
+		w[(4 * 4) + lane] = 0x80000000;
+		for (j = 5; j < 15; ++j)
+			w[(j * 4) + lane] = 0;
+		w[(15 * 4) + lane] = 80 * 8;
+	}
+	sha256_transf_4way(h, w);
+	
+	// Second SHA256 of the resulting 32 bytes
+	for (lane = 0; lane < 4; ++lane)
+	{
+		for (j = 0; j < 8; ++j)
+		{
+			w[(j * 4) + lane] = h[(j * 4) + lane];
+			h[(j * 4) + lane] = sha256_h0[j];
+		}
+		w[(8 * 4) + lane] = 0x80000000;
+		for (j = 9; j < 15; ++j)
+			w[(j * 4) + lane] = 0;
+		w[(15 * 4) + lane] = 32 * 8;
+	}
+	sha256_transf_4way(h, w);
+	
+	for (lane = 0; lane < n; ++lane)
+		for (j = 0; j < 8; ++j)
+			hash32[lane][j] = htobe32(h[(j * 4) + lane]);
+}
+
+/* Same as calling submit_nonce for each nonce, but the first block's midstate
+ * is only computed once, and the rest of the double SHA256 is done for 4 nonces
+ * at a time. Returns the number of nonces that were valid shares. */
+int submit_nonces_batch(struct thr_info * const thr, struct work * const work, const uint32_t * const nonces, const int count)
+{
+	uint32_t midstate[8], hash32[4][8];
+	int i, lane, n, valid = 0;
+	
+#ifdef USE_SCRYPT
+	if (opt_scrypt)
+	{
+		for (i = 0; i < count; ++i)
+			valid += submit_nonce(thr, work, nonces[i]);
+		return valid;
+	}
+#endif
+	
+	_hash_data_midstate(midstate, work);
+	
+	for (i = 0; i < count; i += 4)
+	{
+		n = (count - i < 4) ? (count - i) : 4;
+		_hash_data_4way(hash32, midstate, work, &nonces[i], n);
+		for (lane = 0; lane < n; ++lane)
+			valid += _submit_noffset_nonce(thr, work, nonces[i + lane], 0, hash32[lane]);
+	}
+	
+	return valid;
+}
+
+static
+void test_submit_nonces_batch()
+{
+	// Block 125552, whose nonce is 0x42a14695
+	static const char * const header =
+		"01000000"
+		"81cd02ab7e569e8bcd9317e2fe99f2de44d49ab2b8851ba4a308000000000000"
+		"e320b6c2fffc8d750423db8b1eb942ae710e951ed797f7affc8892b0f1fc122b"
+		"c7f5d74d"
+		"f2b9441a"
+		"00000000";
+	// Valid, duplicated, and hardware error nonces, with a partial last group
+	static const uint32_t nonces[] = {
+		0x42a14695, 0x00000000, 0x42a14695, 0xffffffff,
+		0x42a14694, 0x42a14695, 0x12345678,
+	};
+	static const int count = sizeof(nonces) / sizeof(*nonces);
+	static struct pool pool;
+	struct work * const work = make_work();
+	uint32_t midstate[8], hash32[4][8];
+	unsigned char hdr[80];
+	enum test_nonce2_result res, expect;
+	int i, lane, n, good = 0;
+	
+	hex2bin(hdr, header, 80);
+	swap32yes(work->data, hdr, 80 / 4);
+	set_target_to_pdiff(work->target, 1);
+	work->pool = &pool;
+	
+	_hash_data_midstate(midstate, work);
+	for (i = 0; i < count; i += 4)
+	{
+		n = (count - i < 4) ? (count - i) : 4;
+		_hash_data_4way(hash32, midstate, work, &nonces[i], n);
+		for (lane = 0; lane < n; ++lane)
+		{
+			// What submit_nonce would have found, hashing this nonce alone
+			expect = _test_nonce2(work, nonces[i + lane], true);
+			if (memcmp(hash32[lane], work->hash, sizeof(hash32[lane])))
+				applog(LOG_ERR, "%s test failed: nonce %08lx hash mismatch",
+				       "submit_nonces_batch", (unsigned long)nonces[i + lane]);
+			memcpy(work->hash, hash32[lane], sizeof(work->hash));
+			res = _hashtest2_check(work, true);
+			if (res != expect)
+				applog(LOG_ERR, "%s test failed: nonce %08lx result %d (expected %d)",
+				       "submit_nonces_batch", (unsigned long)nonces[i + lane], (int)res, (int)expect);
+			if (res == TNR_GOOD)
+				++good;
+		}
+	}
+	
+	// Only the real nonce, each of the 3 times it appears, is a share
+	if (good != 3)
+		applog(LOG_ERR, "%s test failed: %d good nonces (expected %d)",
+		       "submit_nonces_batch", good, 3);
+	
+	free_work(work);
+}
+
 /* Allows drivers to submit work items where the driver has changed the ntime
  * value by noffset. Must be only used with a work protocol that does not ntime
  * roll itself intrinsically to generate work (eg stratum). We do not touch
@@ -9212,14 +11117,30 @@ bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t nonce,
 			  int noffset)
 {
-	struct work *work = make_work();
-	_copy_work(work, work_in, noffset);
-	
+	return _submit_noffset_nonce(thr, work_in, nonce, noffset, NULL);
+}
+
+/* If hash is not NULL, it is used as the already computed hash of the header
+ * instead of hashing it again */
+static bool _submit_noffset_nonce(struct thr_info * const thr, struct work * const work_in, const uint32_t nonce,
+                                  const int noffset, const void * const hash)
+{
+	/* Most nonces never reach the pool, so they are checked against a shallow
+	 * copy on the stack first. It shares work_in's allocations, so it must
+	 * never be cleaned; a real copy is only made for shares to submit. */
+	struct work _work, *work = &_work;
 	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
 	struct timeval tv_work_found;
 	enum test_nonce2_result res;
 	bool ret = true;
 
+	memcpy(work, work_in, sizeof(*work));
+	if (noffset)
+	{
+		uint32_t *work_ntime = (uint32_t *)(work->data + 68);
+		*work_ntime = htobe32(be32toh(*work_ntime) + noffset);
+	}
+
 	thread_reportout(thr);
 
 	cgtime(&tv_work_found);
@@ -9227,12 +11148,21 @@ bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t n
 	work->thr_id = thr->id;
 
 	/* Do one last check before attempting to submit the work */
-	/* Side effect: sets work->data for us */
-	res = test_nonce2(work, nonce);
+	if (hash)
+	{
+		memcpy(work->hash, hash, sizeof(work->hash));
+		res = _hashtest2_check(work, true);
+	}
+	else
+		/* Side effect: sets work->data for us */
+		res = test_nonce2(work, nonce);
 	
 	if (unlikely(res == TNR_BAD))
 		{
 			inc_hw_errors(thr, work, nonce);
+			mutex_lock(&stats_lock);
+			++total_submit_copies_avoided;
+			mutex_unlock(&stats_lock);
 			ret = false;
 			goto out;
 		}
@@ -9242,6 +11172,8 @@ bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t n
 	thr ->cgpu->diff1 += work->nonce_diff;
 	work->pool->diff1 += work->nonce_diff;
 	thr->cgpu->last_device_valid_work = time(NULL);
+	if (res == TNR_HIGH)
+		++total_submit_copies_avoided;
 	mutex_unlock(&stats_lock);
 	
 	if (noncelog_file)
@@ -9256,11 +11188,14 @@ bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t n
 			goto out;
 	}
 	
+	work = make_work();
+	_copy_work(work, work_in, noffset);
+	memcpy(work->data, _work.data, sizeof(work->data));
+	memcpy(work->hash, _work.hash, sizeof(work->hash));
+	work->thr_id = _work.thr_id;
+	
 	submit_work_async2(work, &tv_work_found);
-	work = NULL;  // Taken by submit_work_async2
 out:
-	if (work)
-		free_work(work);
 	thread_reportin(thr);
 
 	return ret;
@@ -9296,7 +11231,8 @@ void mt_disable_start(struct thr_info *mythr)
 		drv->thread_disable(mythr);
 	
 	hashmeter2(mythr);
-	__thr_being_msg(LOG_WARNING, mythr, "being disabled");
+	// Running out of work is routine with try_get_work; don't cry wolf over it
+	__thr_being_msg(mythr->_getwork_retry ? LOG_DEBUG : LOG_WARNING, mythr, "being disabled");
 	mythr->rolling = mythr->cgpu->rolling = 0;
 	thread_reportout(mythr);
 	mythr->_mt_disable_called = true;
@@ -9541,7 +11477,7 @@ void mt_disable_finish(struct thr_info *mythr)
 	struct device_drv *drv = mythr->cgpu->drv;
 	
 	thread_reportin(mythr);
-	__thr_being_msg(LOG_WARNING, mythr, "being re-enabled");
+	__thr_being_msg(mythr->_getwork_retry ? LOG_DEBUG : LOG_WARNING, mythr, "being re-enabled");
 	if (drv->thread_enable)
 		drv->thread_enable(mythr);
 	mythr->_mt_disable_called = false;
@@ -10412,6 +12348,11 @@ void _bfg_clean_up(bool restarting)
 			print_summary();
 	}
 
+	logbufs_flush();
+#ifdef HAVE_SHM_OPEN
+	shmstats_cleanup();
+#endif
+
 	if (opt_n_threads > 0)
 		free(cpus);
 
@@ -11537,6 +13478,7 @@ static void raise_fd_limits(void)
 
 extern void bfg_init_threadlocal();
 extern void stratumsrv_start();
+extern void test_stratumsrv_vardiff();
 
 int main(int argc, char *argv[])
 {
@@ -11583,7 +13525,6 @@ int main(int argc, char *argv[])
 	mutex_init(&console_lock);
 	cglock_init(&control_lock);
 	mutex_init(&stats_lock);
-	mutex_init(&sharelog_lock);
 	cglock_init(&ch_lock);
 	mutex_init(&sshare_lock);
 	rwlock_init(&blk_lock);
@@ -11594,6 +13535,9 @@ int main(int argc, char *argv[])
 	mutex_init(&lp_lock);
 	if (unlikely(pthread_cond_init(&lp_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init lp_cond");
+#ifdef HAVE_SYS_EPOLL_H
+	mutex_init(&stratum_evloop_lock);
+#endif
 
 	if (unlikely(pthread_cond_init(&gws_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init gws_cond");
@@ -11783,6 +13727,31 @@ int main(int argc, char *argv[])
 		test_decimal_width();
 		test_domain_funcs();
 		test_target();
+		test_sha256();
+		test_submit_nonces_batch();
+#ifdef WANT_CPUMINE
+		test_cpu_algos();
+#endif
+#ifdef USE_SCRYPT
+		test_scrypt_nway();
+#endif
+		test_stratum_merkle_root();
+		test_stratum_line_reader();
+		test_stratum_fastjson();
+		test_staged_heap();
+		test_latency_hist();
+#ifndef WIN32
+		test_api_cache();
+#endif
+#ifdef USE_LIBEVENT
+		test_stratumsrv_vardiff();
+#endif
+#ifdef HAVE_SHM_OPEN
+		test_shmstats();
+#endif
+#if defined(NEED_BFG_LOWL_VCOM) && !defined(WIN32)
+		test_vcom_port();
+#endif
 		utf8_test();
 	}
 
@@ -12064,6 +14033,18 @@ begin_bench:
 	cgtime(&total_tv_start);
 	cgtime(&total_tv_end);
 
+#ifdef HAVE_SHM_OPEN
+	if (opt_shmstats)
+		shmstats_init(opt_shmstats);
+#endif
+
+	if (opt_sharelog_interval && (sharelog_file || noncelog_file))
+	{
+		pthread_t pth;
+		if (unlikely(pthread_create(&pth, NULL, logbuf_thread, NULL)))
+			quit(1, "logbuf thread create failed");
+	}
+
 	if (!opt_benchmark)
 	{
 		pthread_t submit_thread;
@@ -12146,7 +14127,7 @@ begin_bench:
 		max_staged += mining_threads;
 
 		mutex_lock(stgd_lock);
-		ts = __total_staged();
+		ts = __total_staged() + __total_magazined();
 
 		if (!pool_localgen(cp) && !ts && !opt_fail_only)
 			lagging = true;
@@ -12155,7 +14136,7 @@ begin_bench:
 		if (ts > max_staged) {
 			staged_full = true;
 			pthread_cond_wait(&gws_cond, stgd_lock);
-			ts = __total_staged();
+			ts = __total_staged() + __total_magazined();
 		}
 		mutex_unlock(stgd_lock);
 
@@ -12180,6 +14161,23 @@ retry:
 				pool = altpool;
 				goto retry;
 			}
+			
+			// Fill the whole deficit at once, rather than one work per wakeup
+			int count = max_staged - ts + 1;
+			if (count > MAX_STRATUM_WORK_BATCH)
+				count = MAX_STRATUM_WORK_BATCH;
+			if (count > 1)
+			{
+				struct work *works[count];
+				works[0] = work;
+				for (int i = 1; i < count; ++i)
+					works[i] = make_work();
+				gen_stratum_work_batch(pool, works, count);
+				applog(LOG_DEBUG, "Generated %d stratum works", count);
+				stage_work_batch(works, count);
+				continue;
+			}
+			
 			gen_stratum_work(pool, work);
 			applog(LOG_DEBUG, "Generated stratum work");
 			stage_work(work);
@@ -403,6 +403,8 @@ struct cgminer_stats {
 	struct timeval getwork_wait;
 	struct timeval getwork_wait_max;
 	struct timeval getwork_wait_min;
+	uint32_t getwork_cached;
+	uint32_t getwork_stolen;
 
 	struct timeval _get_start;
 };
@@ -432,6 +434,17 @@ struct cgminer_pool_stats {
 	uint64_t net_bytes_received;
 };
 
+// Log-linear histogram of latencies in microseconds: exact below 8us, then 8
+// buckets for each power of two, so any bucket is within 12.5% of its values
+#define LATENCY_HIST_BUCKETS  240
+
+struct latency_hist {
+	uint32_t count;
+	uint32_t max_us;
+	uint64_t total_us;
+	uint32_t buckets[LATENCY_HIST_BUCKETS];
+};
+
 
 #define PRIprepr "-6s"
 #define PRIpreprv "s"
@@ -441,6 +454,8 @@ struct cgminer_pool_stats {
 #define ALLOC_H2B_SPACED  8
 #define ALLOC_H2B_SHORTV  7
 
+#define WORK_MAGAZINE_SIZE  4
+
 
 struct cgpu_info {
 	int cgminer_id;
@@ -547,6 +562,12 @@ struct cgpu_info {
 	int dev_throttle_count;
 
 	struct cgminer_stats cgminer_stats;
+	
+	// Protected by stats_lock
+	struct latency_hist lat_getwork_wait;
+	struct latency_hist lat_staged;
+	struct latency_hist lat_found_submit;
+	struct latency_hist lat_submit;
 
 	pthread_rwlock_t qlock;
 	struct work *queued_work;
@@ -558,6 +579,11 @@ struct cgpu_info {
 	
 	// Lowest difficulty supported for finding nonces
 	float min_nonce_diff;
+	
+	// Staged work cached for this processor by get_work
+	pthread_mutex_t work_magazine_lock;
+	struct work *work_magazine[WORK_MAGAZINE_SIZE];
+	int work_magazine_count;
 };
 
 extern void renumber_cgpu(struct cgpu_info *);
@@ -622,6 +648,10 @@ struct thr_info {
 	uint32_t _max_nonce;
 	notifier_t mutex_request;
 
+	bool _getwork_retry;
+	bool _get_pending;
+	bool getwork_waiting;
+
 	// Used by minerloop_queue
 	struct work *work_list;
 	bool queue_full;
@@ -913,8 +943,14 @@ extern bool use_curses;
 extern bool have_libusb;
 #endif
 extern int httpsrv_port;
+extern int httpsrv_threads;
+extern bool httpsrv_metrics;
 extern int stratumsrv_port;
+extern int stratumsrv_share_rate;
+extern int stratumsrv_threads;
+extern int stratumsrv_verify_threads;
 extern char *opt_api_allow;
+extern int opt_api_cache;
 extern bool opt_api_mcast;
 extern char *opt_api_mcast_addr;
 extern char *opt_api_mcast_code;
@@ -923,6 +959,7 @@ extern int opt_api_mcast_port;
 extern char *opt_api_groups;
 extern char *opt_api_description;
 extern int opt_api_port;
+extern int opt_api_threads;
 extern bool opt_api_listen;
 extern bool opt_api_network;
 extern bool opt_delaynet;
@@ -1025,6 +1062,7 @@ extern int set_memoryclock(int gpu, int iMemoryClock);
 #endif
 
 extern void api(int thr_id);
+extern void test_api_cache();
 
 extern struct pool *current_pool(void);
 extern int enabled_pools;
@@ -1132,15 +1170,33 @@ enum pool_protocol {
 	PLP_GETBLOCKTEMPLATE,
 };
 
+// Where a stratum pool is, when --stratum-event-loop is handling it
+enum stratum_evloop_state {
+	SELS_NONE,
+	SELS_NEW,
+	SELS_CONNECTED,
+	SELS_SUSPENDED,
+	SELS_RESTARTING,
+	SELS_RESTARTED,
+	SELS_RETRY,
+};
+
 struct stratum_work {
 	char *job_id;
 	bool clean;
 	
 	bytes_t coinbase;
 	size_t nonce2_offset;
+	// SHA-256 state after the coinbase blocks preceding nonce2
+	uint32_t coinbase_midstate[8];
+	size_t coinbase_midstate_len;
+	// The rest of the coinbase with SHA-256 padding, for hashing several nonce2s at once
+	bytes_t coinbase_tail;
 	
 	int merkles;
 	bytes_t merkle_bin;
+	// merkle_bin as big endian words, ready to feed into SHA-256
+	bytes_t merkle_words;
 	
 	uint8_t header1[36];
 	uint8_t diffbits[4];
@@ -1237,14 +1293,25 @@ struct pool {
 
 	struct cgminer_stats cgminer_stats;
 	struct cgminer_pool_stats cgminer_pool_stats;
+	
+	// Protected by stats_lock
+	struct latency_hist lat_getwork;
+	struct latency_hist lat_staged;
+	struct latency_hist lat_found_submit;
+	struct latency_hist lat_submit;
 
 	/* Stratum variables */
 	char *stratum_url;
 	char *stratum_port;
 	CURL *stratum_curl;
 	SOCKETTYPE sock;
+	/* Unparsed data is sockbuf[sockbuf_pos..sockbuf_len), followed by a
+	 * NUL; there is no newline before sockbuf_scan */
 	char *sockbuf;
 	size_t sockbuf_size;
+	size_t sockbuf_len;
+	size_t sockbuf_pos;
+	size_t sockbuf_scan;
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	char *nonce1;
 	size_t n1_len;
@@ -1260,7 +1327,20 @@ struct pool {
 	bool stratum_init;
 	bool stratum_notify;
 	struct stratum_work swork;
+	// Start of a mining.submit for submit_tmpl_job, only used by the submit thread
+	bytes_t submit_tmpl;
+	char *submit_tmpl_job;
+	char *submit_tmpl_user;
 	pthread_t stratum_thread;
+	enum stratum_evloop_state evloop_state;
+	bool evloop_restart_ok;
+	// Whether the connection was lost, rather than suspended, before restarting
+	bool evloop_lost;
+	// Set by client.reconnect for the event loop to restart the connection
+	bool evloop_reconnect;
+	int evloop_restarts;
+	// Receive timeout when connected, otherwise when to retry connecting
+	struct timeval tv_evloop;
 	pthread_mutex_t stratum_lock;
 	char *admin_msg;
 
@@ -1347,12 +1427,45 @@ struct work {
 	struct work *next;
 };
 
+/* Per-thread cache of free works, refilled from and spilled to a shared list
+ * in bulk; see make_work */
+struct work_cache {
+	struct work *works;
+	int count;
+	
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t refills;
+	
+	struct work_cache *prev;
+	struct work_cache *next;
+};
+
+struct work_alloc_stats {
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t refills;
+	uint64_t slabs;
+	uint64_t copies_avoided;
+};
+
+extern struct work_cache *_bfg_work_cache(void);
+extern void work_cache_register(struct work_cache *);
+extern void work_cache_release(struct work_cache *);
+extern void get_work_alloc_stats(struct work_alloc_stats *);
+
 extern void get_datestamp(char *, size_t, time_t);
 #define get_now_datestamp(buf, bufsz)  get_datestamp(buf, bufsz, INVALID_TIMESTAMP)
 extern void get_benchmark_work(struct work *);
 extern void stratum_work_cpy(struct stratum_work *dst, const struct stratum_work *src);
 extern void stratum_work_clean(struct stratum_work *);
+extern void stratum_work_precompute(struct stratum_work *);
+extern void stratum_work_merkle_root(uint32_t *root, const struct stratum_work *);
+extern void stratum_work_merkle_root2(uint32_t *root, const struct stratum_work *, const uint8_t *nonce2, size_t nonce2sz);
+extern void stratum_work_merkle_roots(uint32_t (*roots)[8], const struct stratum_work *, const uint8_t * const *nonce2s, size_t nonce2sz, int count);
 extern void gen_stratum_work2(struct work *, struct stratum_work *, const char *nonce1);
+extern void stratum_work_set_nonce2(struct work *, struct pool *, uint64_t nonce2);
+extern void gen_stratum_work3(struct work *, const struct stratum_work *, const char *nonce1, const uint32_t *merkle_root);
 extern void inc_hw_errors3(struct thr_info *thr, const struct work *work, const uint32_t *bad_nonce_p, float nonce_diff);
 static inline
 void inc_hw_errors2(struct thr_info * const thr, const struct work * const work, const uint32_t *bad_nonce_p)
@@ -1375,6 +1488,7 @@ extern enum test_nonce2_result _test_nonce2(struct work *, uint32_t nonce, bool
 #define test_nonce(work, nonce, checktarget)  (_test_nonce2(work, nonce, checktarget) == TNR_GOOD)
 #define test_nonce2(work, nonce)  (_test_nonce2(work, nonce, true))
 extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
+extern int submit_nonces_batch(struct thr_info *, struct work *, const uint32_t *nonces, int count);
 extern bool submit_noffset_nonce(struct thr_info *thr, struct work *work, uint32_t nonce,
 			  int noffset);
 extern void __add_queued(struct cgpu_info *cgpu, struct work *work);
@@ -1398,6 +1512,9 @@ extern char *curses_input(const char *query);
 extern bool drv_ready(struct cgpu_info *);
 extern double stats_elapsed(struct cgminer_stats *);
 #define cgpu_runtime(cgpu)  stats_elapsed(&((cgpu)->cgminer_stats))
+extern void latency_hist_add_us(struct latency_hist *, int64_t us);
+extern void latency_hist_add(struct latency_hist *, const struct timeval *tv_start, const struct timeval *tv_end);
+extern uint32_t latency_hist_percentile(const struct latency_hist *, double percentile);
 extern double cgpu_utility(struct cgpu_info *);
 extern void kill_work(void);
 extern int prioritize_pools(char *param, int *pid);
@@ -1421,6 +1538,7 @@ extern void tq_freeze(struct thread_q *tq);
 extern void tq_thaw(struct thread_q *tq);
 extern bool successful_connect;
 extern void adl(void);
+extern struct work *make_work(void);
 extern void clean_work(struct work *work);
 extern void free_work(struct work *work);
 extern void __copy_work(struct work *work, const struct work *base_work);
@@ -28,7 +28,9 @@
  */
 
 #include "config.h"
+#include "driver-cpu.h"
 #include "miner.h"
+#include "scrypt.h"
 
 #include <stdlib.h>
 #include <stdbool.h>
@@ -446,13 +448,19 @@ int scrypt_test(unsigned char *pdata, const unsigned char *ptarget, uint32_t non
 	return 1;
 }
 
+/* Scratchpad for one CPU thread hashing lanes nonces at a time */
+void *scrypt_scratchbuf_alloc(const int lanes)
+{
+	return malloc(SCRATCHBUF_SIZE + (lanes - 1) * 128 * 1024);
+}
+
 bool scanhash_scrypt(struct thr_info *thr, const unsigned char __maybe_unused *pmidstate,
 		     unsigned char *pdata, unsigned char __maybe_unused *phash1,
 		     unsigned char __maybe_unused *phash, const unsigned char *ptarget,
 		     uint32_t max_nonce, uint32_t *last_nonce, uint32_t n)
 {
 	uint32_t *nonce = (uint32_t *)(pdata + 76);
-	char *scratchbuf;
+	char *scratchbuf = thr->cgpu_data;
 	uint32_t data[20];
 	uint32_t tmp_hash7;
 	uint32_t Htarg = le32toh(((const uint32_t *)ptarget)[7]);
@@ -460,7 +468,9 @@ bool scanhash_scrypt(struct thr_info *thr, const unsigned char __maybe_unused *p
 
 	be32enc_vect(data, (const uint32_t *)pdata, 19);
 
-	scratchbuf = malloc(SCRATCHBUF_SIZE);
+	// Benchmarking doesn't go through cpu_thread_init
+	if (!scratchbuf)
+		scratchbuf = malloc(SCRATCHBUF_SIZE);
 	if (unlikely(!scratchbuf)) {
 		applog(LOG_ERR, "Failed to malloc scratchbuf in scanhash_scrypt");
 		return ret;
@@ -489,6 +499,155 @@ bool scanhash_scrypt(struct thr_info *thr, const unsigned char __maybe_unused *p
 
 	*last_nonce = n;
 	
-	free(scratchbuf);
+	if (scratchbuf != thr->cgpu_data)
+		free(scratchbuf);
 	return ret;
 }
+
+#define SCRYPT_MAX_WAYS  8
+
+/* Same as scrypt_1024_1_1_256_sp for each of lanes inputs, but with the
+ * scratchpad phase done for all of them at once by core */
+static
+void scrypt_1024_1_1_256_nway(uint32_t data[][20], uint32_t ostate[][8], char * const scratchbuf,
+                              const int lanes, void (* const core)(uint32_t *, void *))
+{
+	uint32_t X[SCRYPT_MAX_WAYS * 32];
+	int l;
+
+	for (l = 0; l < lanes; ++l)
+		PBKDF2_SHA256_80_128(data[l], &X[l * 32]);
+	core(X, (void *)(((uintptr_t)(scratchbuf) + 63) & ~ (uintptr_t)(63)));
+	for (l = 0; l < lanes; ++l)
+		PBKDF2_SHA256_80_128_32(data[l], &X[l * 32], ostate[l]);
+}
+
+static
+bool scanhash_scrypt_nway(struct thr_info * const thr, unsigned char * const pdata,
+                          const unsigned char * const ptarget,
+                          const uint32_t max_nonce, uint32_t * const last_nonce, uint32_t n,
+                          const int lanes, void (* const core)(uint32_t *, void *))
+{
+	uint32_t *nonce = (uint32_t *)(pdata + 76);
+	char *scratchbuf = thr->cgpu_data;
+	uint32_t data[SCRYPT_MAX_WAYS][20];
+	uint32_t ostate[SCRYPT_MAX_WAYS][8];
+	uint32_t tmp_hash7;
+	uint32_t Htarg = le32toh(((const uint32_t *)ptarget)[7]);
+	bool ret = false;
+	int l;
+
+	for (l = 0; l < lanes; ++l)
+		be32enc_vect(data[l], (const uint32_t *)pdata, 19);
+
+	if (!scratchbuf)
+		scratchbuf = scrypt_scratchbuf_alloc(lanes);
+	if (unlikely(!scratchbuf)) {
+		applog(LOG_ERR, "Failed to malloc scratchbuf in scanhash_scrypt_%dway", lanes);
+		return ret;
+	}
+	
+	while(1) {
+		for (l = 0; l < lanes; ++l)
+			data[l][19] = n + l;
+		scrypt_1024_1_1_256_nway(data, ostate, scratchbuf, lanes, core);
+		for (l = 0; l < lanes; ++l) {
+			tmp_hash7 = be32toh(ostate[l][7]);
+
+			if (unlikely(tmp_hash7 <= Htarg)) {
+				n += l;
+				*nonce = swab32(n);
+				ret = true;
+				goto out;
+			}
+		}
+
+		if (unlikely(((uint64_t)n + lanes - 1 >= max_nonce) || thr->work_restart)) {
+			n += lanes - 1;
+			break;
+		}
+		
+		n += lanes;
+	}
+
+out:
+	*last_nonce = n;
+	
+	if (scratchbuf != thr->cgpu_data)
+		free(scratchbuf);
+	return ret;
+}
+
+#ifdef WANT_SCRYPT_4WAY
+bool scanhash_scrypt_4way(struct thr_info *thr, const unsigned char __maybe_unused *pmidstate,
+		     unsigned char *pdata, unsigned char __maybe_unused *phash1,
+		     unsigned char __maybe_unused *phash, const unsigned char *ptarget,
+		     uint32_t max_nonce, uint32_t *last_nonce, uint32_t n)
+{
+	return scanhash_scrypt_nway(thr, pdata, ptarget, max_nonce, last_nonce, n, 4, scrypt_core_4way);
+}
+#endif
+
+#ifdef WANT_SCRYPT_AVX2_8WAY
+bool scanhash_scrypt_avx2_8way(struct thr_info *thr, const unsigned char __maybe_unused *pmidstate,
+		     unsigned char *pdata, unsigned char __maybe_unused *phash1,
+		     unsigned char __maybe_unused *phash, const unsigned char *ptarget,
+		     uint32_t max_nonce, uint32_t *last_nonce, uint32_t n)
+{
+	return scanhash_scrypt_nway(thr, pdata, ptarget, max_nonce, last_nonce, n, 8, scrypt_core_8way);
+}
+#endif
+
+/* Every lane of the N-way cores must hash exactly like the scalar code */
+void test_scrypt_nway()
+{
+	static const struct {
+		const char *name;
+		int lanes;
+		void (*core)(uint32_t *, void *);
+	} algos[] = {
+#ifdef WANT_SCRYPT_4WAY
+		{"scrypt_4way", 4, scrypt_core_4way},
+#endif
+#ifdef WANT_SCRYPT_AVX2_8WAY
+		{"scrypt_avx2_8way", 8, scrypt_core_8way},
+#endif
+	};
+	uint32_t data[SCRYPT_MAX_WAYS][20], ostate[SCRYPT_MAX_WAYS][8], expect[8];
+	char *scratchbuf;
+	int i, j, l;
+
+	scratchbuf = scrypt_scratchbuf_alloc(SCRYPT_MAX_WAYS);
+	if (unlikely(!scratchbuf))
+		quithere(1, "Failed to malloc scratchbuf");
+
+	for (i = 0; i < sizeof(algos) / sizeof(*algos); ++i)
+	{
+#ifdef WANT_SCRYPT_AVX2_8WAY
+		if (algos[i].core == scrypt_core_8way)
+		{
+			__builtin_cpu_init();
+			if (!__builtin_cpu_supports("avx2"))
+			{
+				applog(LOG_DEBUG, "scrypt test skipped: %s not supported by this CPU", algos[i].name);
+				continue;
+			}
+		}
+#endif
+		for (l = 0; l < algos[i].lanes; ++l)
+		{
+			for (j = 0; j < 19; ++j)
+				data[l][j] = 0x9e3779b9 * (i * 19 + j + 1);
+			data[l][19] = 0xfffffffe + l;
+		}
+		scrypt_1024_1_1_256_nway(data, ostate, scratchbuf, algos[i].lanes, algos[i].core);
+		for (l = 0; l < algos[i].lanes; ++l)
+		{
+			scrypt_1024_1_1_256_sp(data[l], scratchbuf, expect);
+			if (memcmp(ostate[l], expect, sizeof(expect)))
+				applog(LOG_ERR, "scrypt test failed: %s lane %d differs from scrypt", algos[i].name, l);
+		}
+	}
+
+	free(scratchbuf);
+}
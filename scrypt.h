@@ -10,6 +10,11 @@ extern int scrypt_test(unsigned char *pdata, const unsigned char *ptarget,
 			uint32_t nonce);
 extern void scrypt_regenhash(struct work *work);
 
+extern void *scrypt_scratchbuf_alloc(int lanes);
+extern void scrypt_core_4way(uint32_t *X, void *scratchpad);
+extern void scrypt_core_8way(uint32_t *X, void *scratchpad);
+extern void test_scrypt_nway();
+
 #else /* USE_SCRYPT */
 static inline int scrypt_test(__maybe_unused unsigned char *pdata,
 			       __maybe_unused const unsigned char *ptarget,
@@ -0,0 +1,117 @@
+/*-
+ * Copyright 2009 Colin Percival, 2011 ArtForz
+ * Copyright 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * The salsa20/8 core here is salsa20_8 from scrypt.c, which was originally
+ * written by Colin Percival as part of the Tarsnap online backup system.
+ */
+
+/* The salsa20/8 half of scrypt(1024,1,1) for several nonces at once, one per
+ * vector lane.  This is built once per lane count: 4-way with the default
+ * flags (SSE2 on x86_64) and 8-way with the AVX2 flags. */
+
+#include "config.h"
+
+#ifdef USE_SCRYPT
+
+#include <stdint.h>
+
+#include "scrypt.h"
+
+#ifndef SCRYPT_NWAY
+#define SCRYPT_NWAY 4
+#endif
+
+#define _SCRYPT_CORE_FUNC(n)  scrypt_core_ ## n ## way
+#define SCRYPT_CORE_FUNC(n)  _SCRYPT_CORE_FUNC(n)
+
+typedef uint32_t scrypt_vec __attribute__((vector_size(4 * SCRYPT_NWAY)));
+
+static inline
+void salsa20_8_nway(scrypt_vec B[16], const scrypt_vec Bx[16])
+{
+	scrypt_vec x[16];
+	int i;
+
+	for (i = 0; i < 16; ++i)
+		x[i] = (B[i] ^= Bx[i]);
+	for (i = 0; i < 8; i += 2) {
+#define R(a,b) (((a) << (b)) | ((a) >> (32 - (b))))
+		/* Operate on columns. */
+		x[ 4] ^= R(x[ 0]+x[12], 7);	x[ 9] ^= R(x[ 5]+x[ 1], 7);	x[14] ^= R(x[10]+x[ 6], 7);	x[ 3] ^= R(x[15]+x[11], 7);
+		x[ 8] ^= R(x[ 4]+x[ 0], 9);	x[13] ^= R(x[ 9]+x[ 5], 9);	x[ 2] ^= R(x[14]+x[10], 9);	x[ 7] ^= R(x[ 3]+x[15], 9);
+		x[12] ^= R(x[ 8]+x[ 4],13);	x[ 1] ^= R(x[13]+x[ 9],13);	x[ 6] ^= R(x[ 2]+x[14],13);	x[11] ^= R(x[ 7]+x[ 3],13);
+		x[ 0] ^= R(x[12]+x[ 8],18);	x[ 5] ^= R(x[ 1]+x[13],18);	x[10] ^= R(x[ 6]+x[ 2],18);	x[15] ^= R(x[11]+x[ 7],18);
+
+		/* Operate on rows. */
+		x[ 1] ^= R(x[ 0]+x[ 3], 7);	x[ 6] ^= R(x[ 5]+x[ 4], 7);	x[11] ^= R(x[10]+x[ 9], 7);	x[12] ^= R(x[15]+x[14], 7);
+		x[ 2] ^= R(x[ 1]+x[ 0], 9);	x[ 7] ^= R(x[ 6]+x[ 5], 9);	x[ 8] ^= R(x[11]+x[10], 9);	x[13] ^= R(x[12]+x[15], 9);
+		x[ 3] ^= R(x[ 2]+x[ 1],13);	x[ 4] ^= R(x[ 7]+x[ 6],13);	x[ 9] ^= R(x[ 8]+x[11],13);	x[14] ^= R(x[13]+x[12],13);
+		x[ 0] ^= R(x[ 3]+x[ 2],18);	x[ 5] ^= R(x[ 4]+x[ 7],18);	x[10] ^= R(x[ 9]+x[ 8],18);	x[15] ^= R(x[14]+x[13],18);
+#undef R
+	}
+	for (i = 0; i < 16; ++i)
+		B[i] += x[i];
+}
+
+/* X holds SCRYPT_NWAY consecutive 32-word blocks, one per nonce, and is
+ * replaced by the mixed blocks.  V must be 64-byte aligned and
+ * SCRYPT_NWAY * 128 KiB; its layout is interleaved like the lanes. */
+void SCRYPT_CORE_FUNC(SCRYPT_NWAY)(uint32_t * const Xio, void * const scratchpad)
+{
+	scrypt_vec * const V = scratchpad;
+	scrypt_vec X[32];
+	uint32_t j;
+	int i, k, l;
+
+	for (k = 0; k < 32; ++k)
+		for (l = 0; l < SCRYPT_NWAY; ++l)
+			X[k][l] = Xio[l * 32 + k];
+
+	for (i = 0; i < 1024; ++i) {
+		for (k = 0; k < 32; ++k)
+			V[i * 32 + k] = X[k];
+
+		salsa20_8_nway(&X[0], &X[16]);
+		salsa20_8_nway(&X[16], &X[0]);
+	}
+	for (i = 0; i < 1024; ++i) {
+		// Every lane reads its own, random, entry of V
+		for (l = 0; l < SCRYPT_NWAY; ++l) {
+			j = X[16][l] & 1023;
+			for (k = 0; k < 32; ++k)
+				X[k][l] ^= V[j * 32 + k][l];
+		}
+
+		salsa20_8_nway(&X[0], &X[16]);
+		salsa20_8_nway(&X[16], &X[0]);
+	}
+
+	for (k = 0; k < 32; ++k)
+		for (l = 0; l < SCRYPT_NWAY; ++l)
+			Xio[l * 32 + k] = X[k][l];
+}
+
+#endif /* USE_SCRYPT */
@@ -37,6 +37,10 @@
 #include <stdint.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "sha2.h"
 
 #define UNPACK32(x, str)                      \
@@ -85,12 +89,61 @@ uint32_t sha256_k[64] =
 
 /* SHA-256 functions */
 
+/* Compresses one block whose first 16 schedule words are already in w[] */
+void sha256_transf_c(uint32_t *h, uint32_t *w)
+{
+    uint32_t wv[8];
+    uint32_t t1, t2;
+    int j;
+
+    for (j = 16; j < 64; j++) {
+        SHA256_SCR(j);
+    }
+
+    for (j = 0; j < 8; j++) {
+        wv[j] = h[j];
+    }
+
+    for (j = 0; j < 64; j++) {
+        t1 = wv[7] + SHA256_F2(wv[4]) + CH(wv[4], wv[5], wv[6])
+            + sha256_k[j] + w[j];
+        t2 = SHA256_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);
+        wv[7] = wv[6];
+        wv[6] = wv[5];
+        wv[5] = wv[4];
+        wv[4] = wv[3] + t1;
+        wv[3] = wv[2];
+        wv[2] = wv[1];
+        wv[1] = wv[0];
+        wv[0] = t1 + t2;
+    }
+
+    for (j = 0; j < 8; j++) {
+        h[j] += wv[j];
+    }
+}
+
+#ifdef HAVE_SHANI
+/* -1 until the CPU has been checked; racing threads just check it twice */
+static int sha256_use_shani = -1;
+
+static inline void sha256_transf_w(uint32_t *h, uint32_t *w)
+{
+    if (unlikely(sha256_use_shani < 0))
+        sha256_use_shani = sha256_shani_supported();
+    if (sha256_use_shani)
+        sha256_transf_shani(h, w);
+    else
+        sha256_transf_c(h, w);
+}
+#else
+#define sha256_transf_w  sha256_transf_c
+#endif
+
 void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
                    unsigned int block_nb)
 {
     uint32_t w[64];
-    uint32_t wv[8];
-    uint32_t t1, t2;
     const unsigned char *sub_block;
     int i;
 
@@ -103,31 +156,7 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
             PACK32(&sub_block[j << 2], &w[j]);
         }
 
-        for (j = 16; j < 64; j++) {
-            SHA256_SCR(j);
-        }
-
-        for (j = 0; j < 8; j++) {
-            wv[j] = ctx->h[j];
-        }
-
-        for (j = 0; j < 64; j++) {
-            t1 = wv[7] + SHA256_F2(wv[4]) + CH(wv[4], wv[5], wv[6])
-                + sha256_k[j] + w[j];
-            t2 = SHA256_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);
-            wv[7] = wv[6];
-            wv[6] = wv[5];
-            wv[5] = wv[4];
-            wv[4] = wv[3] + t1;
-            wv[3] = wv[2];
-            wv[2] = wv[1];
-            wv[1] = wv[0];
-            wv[0] = t1 + t2;
-        }
-
-        for (j = 0; j < 8; j++) {
-            ctx->h[j] += wv[j];
-        }
+        sha256_transf_w(ctx->h, w);
     }
 }
 
@@ -151,6 +180,15 @@ void sha256_init(sha256_ctx *ctx)
     ctx->tot_len = 0;
 }
 
+/* Resumes hashing from a state saved after an exact number of blocks */
+void sha256_init_midstate(sha256_ctx *ctx, const uint32_t *h,
+                          unsigned int len)
+{
+    memcpy(ctx->h, h, sizeof(ctx->h));
+    ctx->len = 0;
+    ctx->tot_len = len;
+}
+
 void sha256_update(sha256_ctx *ctx, const unsigned char *message,
                    unsigned int len)
 {
@@ -209,3 +247,106 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest)
         UNPACK32(ctx->h[i], &digest[i << 2]);
     }
 }
+
+/* Double SHA-256 of a single 64-byte message, such as a merkle tree node.
+ * Input and output are big endian words; out may alias in */
+void sha256d_64_words(uint32_t *out, const uint32_t *in)
+{
+    uint32_t w[64];
+    uint32_t h[8];
+
+    memcpy(h, sha256_h0, sizeof(h));
+    memcpy(w, in, 16 * sizeof(*w));
+    sha256_transf_w(h, w);
+
+    w[0] = 0x80000000;
+    memset(&w[1], 0, 14 * sizeof(*w));
+    w[15] = 512;
+    sha256_transf_w(h, w);
+
+    memcpy(w, h, sizeof(h));
+    w[8] = 0x80000000;
+    memset(&w[9], 0, 6 * sizeof(*w));
+    w[15] = 256;
+    memcpy(out, sha256_h0, 8 * sizeof(*out));
+    sha256_transf_w(out, w);
+}
+
+/* Compresses one block in each of 4 independent lanes. Both the state and the
+ * 16 message words are interleaved by lane: h[i * 4 + lane], w[j * 4 + lane] */
+#ifdef __SSE2__
+
+#define ROTR4(x, n)  _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - (n)))
+#define CH4(x, y, z)  _mm_xor_si128(_mm_and_si128(x, y), _mm_andnot_si128(x, z))
+#define MAJ4(x, y, z)  _mm_xor_si128(_mm_xor_si128(_mm_and_si128(x, y), _mm_and_si128(x, z)), _mm_and_si128(y, z))
+#define SHA256_F1_4(x)  _mm_xor_si128(_mm_xor_si128(ROTR4(x,  2), ROTR4(x, 13)), ROTR4(x, 22))
+#define SHA256_F2_4(x)  _mm_xor_si128(_mm_xor_si128(ROTR4(x,  6), ROTR4(x, 11)), ROTR4(x, 25))
+#define SHA256_F3_4(x)  _mm_xor_si128(_mm_xor_si128(ROTR4(x,  7), ROTR4(x, 18)), _mm_srli_epi32(x,  3))
+#define SHA256_F4_4(x)  _mm_xor_si128(_mm_xor_si128(ROTR4(x, 17), ROTR4(x, 19)), _mm_srli_epi32(x, 10))
+
+void sha256_transf_4way(uint32_t *h, const uint32_t *w)
+{
+    __m128i w4[64];
+    __m128i wv[8];
+    __m128i t1, t2;
+    int j;
+
+    for (j = 0; j < 16; j++) {
+        w4[j] = _mm_loadu_si128((const __m128i *)&w[j << 2]);
+    }
+
+    for (j = 16; j < 64; j++) {
+        w4[j] = _mm_add_epi32(_mm_add_epi32(SHA256_F4_4(w4[j - 2]), w4[j - 7]),
+                              _mm_add_epi32(SHA256_F3_4(w4[j - 15]), w4[j - 16]));
+    }
+
+    for (j = 0; j < 8; j++) {
+        wv[j] = _mm_loadu_si128((const __m128i *)&h[j << 2]);
+    }
+
+    for (j = 0; j < 64; j++) {
+        t1 = _mm_add_epi32(_mm_add_epi32(wv[7], SHA256_F2_4(wv[4])),
+                           _mm_add_epi32(CH4(wv[4], wv[5], wv[6]),
+                                         _mm_add_epi32(_mm_set1_epi32(sha256_k[j]), w4[j])));
+        t2 = _mm_add_epi32(SHA256_F1_4(wv[0]), MAJ4(wv[0], wv[1], wv[2]));
+        wv[7] = wv[6];
+        wv[6] = wv[5];
+        wv[5] = wv[4];
+        wv[4] = _mm_add_epi32(wv[3], t1);
+        wv[3] = wv[2];
+        wv[2] = wv[1];
+        wv[1] = wv[0];
+        wv[0] = _mm_add_epi32(t1, t2);
+    }
+
+    for (j = 0; j < 8; j++) {
+        _mm_storeu_si128((__m128i *)&h[j << 2],
+                         _mm_add_epi32(_mm_loadu_si128((const __m128i *)&h[j << 2]), wv[j]));
+    }
+}
+
+#else
+
+void sha256_transf_4way(uint32_t *h, const uint32_t *w)
+{
+    uint32_t lw[64];
+    uint32_t lh[8];
+    int lane, j;
+
+    for (lane = 0; lane < 4; lane++) {
+        for (j = 0; j < 16; j++) {
+            lw[j] = w[(j << 2) + lane];
+        }
+        for (j = 0; j < 8; j++) {
+            lh[j] = h[(j << 2) + lane];
+        }
+
+        sha256_transf_w(lh, lw);
+
+        for (j = 0; j < 8; j++) {
+            h[(j << 2) + lane] = lh[j];
+        }
+    }
+}
+
+#endif
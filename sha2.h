@@ -61,13 +61,23 @@ typedef struct {
     uint32_t h[8];
 } sha256_ctx;
 
+extern uint32_t sha256_h0[8];
 extern uint32_t sha256_k[64];
 
 void sha256_init(sha256_ctx * ctx);
+void sha256_init_midstate(sha256_ctx *ctx, const uint32_t *h,
+                          unsigned int len);
 void sha256_update(sha256_ctx *ctx, const unsigned char *message,
                    unsigned int len);
 void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
+void sha256d_64_words(uint32_t *out, const uint32_t *in);
+void sha256_transf_c(uint32_t *h, uint32_t *w);
+#ifdef HAVE_SHANI
+extern bool sha256_shani_supported(void);
+extern void sha256_transf_shani(uint32_t *h, const uint32_t *w);
+#endif
+void sha256_transf_4way(uint32_t *h, const uint32_t *w);
 
 #endif /* !SHA2_H */
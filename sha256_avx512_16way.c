@@ -0,0 +1,195 @@
+// Copyright 2010 Satoshi Nakamoto
+// Copyright 2012-2013 Luke Dashjr
+// Copyright 2026 agent <agent@local>
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+// 16-way 512-bit AVX-512F SHA-256, laid out like tcatm's 4-way SSE2 one
+
+#include "config.h"
+
+#include "driver-cpu.h"
+
+#ifdef WANT_AVX512_16WAY
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <immintrin.h>
+
+#define NPAR 16
+
+static const uint32_t sha256_consts[] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, /*  0 */
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, /*  8 */
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, /* 16 */
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, /* 24 */
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, /* 32 */
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, /* 40 */
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, /* 48 */
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, /* 56 */
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t pSHA256InitState[8] =
+{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+// vpternlogd truth tables: 0xca is (b ? c : d), 0xe8 is majority, 0x96 is 3-way xor
+#define Ch(b, c, d)  _mm512_ternarylogic_epi32(b, c, d, 0xca)
+#define Maj(b, c, d)  _mm512_ternarylogic_epi32(b, c, d, 0xe8)
+#define XOR3(x, y, z)  _mm512_ternarylogic_epi32(x, y, z, 0x96)
+#define ROTR(x, n)  _mm512_ror_epi32(x, n)
+#define SHR(x, n)  _mm512_srli_epi32(x, n)
+
+#define BIGSIGMA0_256(x)  XOR3(ROTR(x,  2), ROTR(x, 13), ROTR(x, 22))
+#define BIGSIGMA1_256(x)  XOR3(ROTR(x,  6), ROTR(x, 11), ROTR(x, 25))
+#define SIGMA0_256(x)     XOR3(ROTR(x,  7), ROTR(x, 18), SHR(x,  3))
+#define SIGMA1_256(x)     XOR3(ROTR(x, 17), ROTR(x, 19), SHR(x, 10))
+
+#define add4(x0, x1, x2, x3)  _mm512_add_epi32(_mm512_add_epi32(x0, x1), _mm512_add_epi32(x2, x3))
+#define add5(x0, x1, x2, x3, x4)  _mm512_add_epi32(add4(x0, x1, x2, x3), x4)
+
+#define SHA256ROUND(a, b, c, d, e, f, g, h, i)  do {  \
+	T1 = add5(h, BIGSIGMA1_256(e), Ch(e, f, g), _mm512_set1_epi32(sha256_consts[i]), w[i]);  \
+	d = _mm512_add_epi32(d, T1);  \
+	h = _mm512_add_epi32(T1, _mm512_add_epi32(BIGSIGMA0_256(a), Maj(a, b, c)));  \
+} while (0)
+
+#define SHA256ROUNDS8(i)  do {  \
+	SHA256ROUND(a, b, c, d, e, f, g, h, (i) + 0);  \
+	SHA256ROUND(h, a, b, c, d, e, f, g, (i) + 1);  \
+	SHA256ROUND(g, h, a, b, c, d, e, f, (i) + 2);  \
+	SHA256ROUND(f, g, h, a, b, c, d, e, (i) + 3);  \
+	SHA256ROUND(e, f, g, h, a, b, c, d, (i) + 4);  \
+	SHA256ROUND(d, e, f, g, h, a, b, c, (i) + 5);  \
+	SHA256ROUND(c, d, e, f, g, h, a, b, (i) + 6);  \
+	SHA256ROUND(b, c, d, e, f, g, h, a, (i) + 7);  \
+} while (0)
+
+static inline
+void sha256_expand(__m512i w[64])
+{
+	int i;
+
+	for (i = 16; i < 64; ++i)
+		w[i] = add4(SIGMA1_256(w[i - 2]), w[i - 7], SIGMA0_256(w[i - 15]), w[i - 16]);
+}
+
+bool ScanHash_16WayAVX512(struct thr_info * const thr, const unsigned char * const pmidstate,
+	unsigned char *pdata,
+	unsigned char * const phash1, unsigned char * const phash,
+	const unsigned char * const ptarget,
+	const uint32_t max_nonce, uint32_t * const last_nonce,
+	uint32_t nonce)
+{
+	const uint32_t * const hPre = (const uint32_t *)pmidstate;
+	const uint32_t * const Pad = (const uint32_t *)phash1;
+	uint32_t * const hash32 = (uint32_t *)phash;
+	uint32_t * const nNonce_p = (uint32_t *)(pdata + 76);
+	const uint32_t * const In = (const uint32_t *)(pdata + 64);
+	const __m512i offset = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	uint32_t thash[8][NPAR] __attribute__((aligned(64)));
+	__m512i w[64], T1, a, b, c, d, e, f, g, h, H7;
+	int i, j, mask;
+
+	for (;;)
+	{
+		// First hash: second block of the header, from the midstate
+		for (i = 0; i < 16; ++i)
+			w[i] = _mm512_set1_epi32(In[i]);
+		w[3] = _mm512_add_epi32(_mm512_set1_epi32(nonce), offset);
+		sha256_expand(w);
+
+		a = _mm512_set1_epi32(hPre[0]);
+		b = _mm512_set1_epi32(hPre[1]);
+		c = _mm512_set1_epi32(hPre[2]);
+		d = _mm512_set1_epi32(hPre[3]);
+		e = _mm512_set1_epi32(hPre[4]);
+		f = _mm512_set1_epi32(hPre[5]);
+		g = _mm512_set1_epi32(hPre[6]);
+		h = _mm512_set1_epi32(hPre[7]);
+		for (i = 0; i < 64; i += 8)
+			SHA256ROUNDS8(i);
+
+		// Second hash, of the first one
+		w[0] = _mm512_add_epi32(a, _mm512_set1_epi32(hPre[0]));
+		w[1] = _mm512_add_epi32(b, _mm512_set1_epi32(hPre[1]));
+		w[2] = _mm512_add_epi32(c, _mm512_set1_epi32(hPre[2]));
+		w[3] = _mm512_add_epi32(d, _mm512_set1_epi32(hPre[3]));
+		w[4] = _mm512_add_epi32(e, _mm512_set1_epi32(hPre[4]));
+		w[5] = _mm512_add_epi32(f, _mm512_set1_epi32(hPre[5]));
+		w[6] = _mm512_add_epi32(g, _mm512_set1_epi32(hPre[6]));
+		w[7] = _mm512_add_epi32(h, _mm512_set1_epi32(hPre[7]));
+		for (i = 8; i < 16; ++i)
+			w[i] = _mm512_set1_epi32(Pad[i]);
+		sha256_expand(w);
+
+		a = _mm512_set1_epi32(pSHA256InitState[0]);
+		b = _mm512_set1_epi32(pSHA256InitState[1]);
+		c = _mm512_set1_epi32(pSHA256InitState[2]);
+		d = _mm512_set1_epi32(pSHA256InitState[3]);
+		e = _mm512_set1_epi32(pSHA256InitState[4]);
+		f = _mm512_set1_epi32(pSHA256InitState[5]);
+		g = _mm512_set1_epi32(pSHA256InitState[6]);
+		h = _mm512_set1_epi32(pSHA256InitState[7]);
+		for (i = 0; i < 56; i += 8)
+			SHA256ROUNDS8(i);
+		SHA256ROUND(a, b, c, d, e, f, g, h, 56);
+		SHA256ROUND(h, a, b, c, d, e, f, g, 57);
+		SHA256ROUND(g, h, a, b, c, d, e, f, 58);
+		SHA256ROUND(f, g, h, a, b, c, d, e, 59);
+		SHA256ROUND(e, f, g, h, a, b, c, d, 60);
+
+		/* H7 is already final after round 60; only finish the
+		 * last 3 rounds if some lane has H==0 */
+		H7 = _mm512_add_epi32(h, _mm512_set1_epi32(pSHA256InitState[7]));
+		mask = _mm512_cmpeq_epi32_mask(H7, _mm512_setzero_si512());
+		if (unlikely(mask))
+		{
+			SHA256ROUND(d, e, f, g, h, a, b, c, 61);
+			SHA256ROUND(c, d, e, f, g, h, a, b, 62);
+			SHA256ROUND(b, c, d, e, f, g, h, a, 63);
+
+			_mm512_store_si512((__m512i *)thash[0], _mm512_add_epi32(a, _mm512_set1_epi32(pSHA256InitState[0])));
+			_mm512_store_si512((__m512i *)thash[1], _mm512_add_epi32(b, _mm512_set1_epi32(pSHA256InitState[1])));
+			_mm512_store_si512((__m512i *)thash[2], _mm512_add_epi32(c, _mm512_set1_epi32(pSHA256InitState[2])));
+			_mm512_store_si512((__m512i *)thash[3], _mm512_add_epi32(d, _mm512_set1_epi32(pSHA256InitState[3])));
+			_mm512_store_si512((__m512i *)thash[4], _mm512_add_epi32(e, _mm512_set1_epi32(pSHA256InitState[4])));
+			_mm512_store_si512((__m512i *)thash[5], _mm512_add_epi32(f, _mm512_set1_epi32(pSHA256InitState[5])));
+			_mm512_store_si512((__m512i *)thash[6], _mm512_add_epi32(g, _mm512_set1_epi32(pSHA256InitState[6])));
+			_mm512_store_si512((__m512i *)thash[7], H7);
+
+			for (j = 0; j < NPAR; ++j)
+			{
+				if (!(mask & (1 << j)))
+					continue;
+				for (i = 0; i < 8; ++i)
+					hash32[i] = thash[i][j];
+				if (fulltest(phash, ptarget))
+				{
+					nonce += j;
+					*last_nonce = nonce;
+					*nNonce_p = nonce;
+					return true;
+				}
+			}
+		}
+
+		if ((nonce >= max_nonce) || thr->work_restart)
+		{
+			*last_nonce = nonce;
+			return false;
+		}
+
+		nonce += NPAR;
+	}
+}
+
+#endif /* WANT_AVX512_16WAY */
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+// SHA-256 using the x86 SHA extensions (SHA-NI)
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "driver-cpu.h"
+#include "sha2.h"
+
+bool sha256_shani_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	// SSE4.1 for the blends and SSSE3 for palignr
+	if (!((ecx & bit_SSE4_1) && (ecx & bit_SSSE3)))
+		return false;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return ebx & (1 << 29);
+}
+
+#define SHANI_RNDS4(state0, state1, msg, i)  do {  \
+	__m128i _m = _mm_add_epi32(msg, _mm_loadu_si128((const __m128i *)&sha256_k[(i) * 4]));  \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, _m);  \
+	_m = _mm_shuffle_epi32(_m, 0x0e);  \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, _m);  \
+} while (0)
+
+/* Compresses one block into h (a..h, native words); w holds the 16 message
+ * words, also native, so nothing needs byte swapping here */
+void sha256_transf_shani(uint32_t * const h, const uint32_t * const w)
+{
+	__m128i state0, state1, save0, save1, tmp;
+	__m128i msg[16];
+	int i;
+
+	// SHA256RNDS2 wants the state as ABEF and CDGH
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+	save0 = state0;
+	save1 = state1;
+
+	for (i = 0; i < 4; ++i)
+	{
+		msg[i] = _mm_loadu_si128((const __m128i *)&w[i * 4]);
+		SHANI_RNDS4(state0, state1, msg[i], i);
+	}
+	for ( ; i < 16; ++i)
+	{
+		tmp = _mm_add_epi32(_mm_sha256msg1_epu32(msg[i - 4], msg[i - 3]),
+		                    _mm_alignr_epi8(msg[i - 1], msg[i - 2], 4));
+		msg[i] = _mm_sha256msg2_epu32(tmp, msg[i - 1]);
+		SHANI_RNDS4(state0, state1, msg[i], i);
+	}
+
+	state0 = _mm_add_epi32(state0, save0);
+	state1 = _mm_add_epi32(state1, save1);
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	_mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, state1, 0xf0));
+	_mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+#ifdef WANT_SHANI
+
+bool scanhash_shani(struct thr_info * const thr, const unsigned char * const pmidstate,
+	unsigned char *pdata,
+	unsigned char * const phash1, unsigned char * const phash,
+	const unsigned char * const ptarget,
+	const uint32_t max_nonce, uint32_t * const last_nonce,
+	uint32_t n)
+{
+	uint32_t * const hash32 = (uint32_t *)phash;
+	uint32_t * const nNonce_p = (uint32_t *)(pdata + 76);
+	uint32_t * const hash1 = (uint32_t *)phash1;
+	uint32_t data[16];
+
+	// data and hash1 (which already holds its padding) are native endian words
+	memcpy(data, pdata + 64, sizeof(data));
+
+	while (true)
+	{
+		data[3] = n;
+		memcpy(hash1, pmidstate, 32);
+		sha256_transf_shani(hash1, data);
+		memcpy(hash32, sha256_h0, 32);
+		sha256_transf_shani(hash32, hash1);
+
+		if (unlikely(hash32[7] == 0 && fulltest(phash, ptarget)))
+		{
+			*nNonce_p = n;
+			*last_nonce = n;
+			return true;
+		}
+
+		if ((n >= max_nonce) || thr->work_restart)
+		{
+			*nNonce_p = n;
+			*last_nonce = n;
+			return false;
+		}
+
+		++n;
+	}
+}
+
+#endif /* WANT_SHANI */
@@ -0,0 +1,307 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+// Publishes the summary, pool and processor counters in shared memory
+
+#include "config.h"
+
+#ifdef HAVE_SHM_OPEN
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "miner.h"
+#include "shmstats.h"
+#include "util.h"
+
+static char *shmstats_name;
+static struct bfg_shmstats *shmstats;
+static struct timeval tv_shmstats_updated;
+static pthread_mutex_t shmstats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static
+struct bfg_shmstats *shmstats_create(const char * const name, const uint32_t pools_max, const uint32_t procs_max)
+{
+	const size_t sz = bfg_shmstats_size(pools_max, procs_max);
+	struct bfg_shmstats *s;
+	int fd;
+	
+	fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		applog(LOG_ERR, "%s: shm_open(%s) failed: %s", __func__, name, bfg_strerror(errno, BST_ERRNO));
+		return NULL;
+	}
+	if (ftruncate(fd, sz))
+	{
+		applog(LOG_ERR, "%s: ftruncate(%s) failed: %s", __func__, name, bfg_strerror(errno, BST_ERRNO));
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	s = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED)
+	{
+		applog(LOG_ERR, "%s: mmap(%s) failed: %s", __func__, name, bfg_strerror(errno, BST_ERRNO));
+		shm_unlink(name);
+		return NULL;
+	}
+	
+	memset(s, 0, sz);
+	s->version = BFG_SHMSTATS_VERSION;
+	s->pools_max = pools_max;
+	s->procs_max = procs_max;
+	// Readers check the magic last, so it must not be visible before the rest
+	__sync_synchronize();
+	s->magic = BFG_SHMSTATS_MAGIC;
+	
+	return s;
+}
+
+bool shmstats_init(const char * const name)
+{
+	// Leave room for pools and processors added later
+	shmstats = shmstats_create(name, total_pools + 0x10, total_devices + 0x40);
+	if (!shmstats)
+		return false;
+	shmstats_name = strdup(name);
+	applog(LOG_NOTICE, "Publishing stats in shared memory %s", name);
+	return true;
+}
+
+void shmstats_write_begin(struct bfg_shmstats * const s)
+{
+	++s->seq;
+	__sync_synchronize();
+}
+
+void shmstats_write_end(struct bfg_shmstats * const s)
+{
+	__sync_synchronize();
+	++s->seq;
+}
+
+// Called from hashmeter after it releases hash_lock
+void shmstats_update(void)
+{
+	struct bfg_shmstats * const s = shmstats;
+	struct bfg_shmstats_summary sum;
+	struct bfg_shmstats_proc *procs;
+	struct bfg_shmstats_pool *sp;
+	struct bfg_shmstats_proc *sproc;
+	struct cgpu_info *proc;
+	struct pool *pool;
+	struct timeval tv_now;
+	uint32_t n;
+	int i;
+	
+	if (!s)
+		return;
+	// Only one thread writes at a time, and the rest do not wait for it
+	if (mutex_trylock(&shmstats_lock))
+		return;
+	cgtime(&tv_now);
+	if (timer_elapsed_us(&tv_shmstats_updated, &tv_now) < 1000000)
+		goto out;
+	tv_shmstats_updated = tv_now;
+	procs = bfg_shmstats_procs(s);
+	
+	// Only the totals need hash_lock; URLs and names are copied without it
+	mutex_lock(&hash_lock);
+	sum = (struct bfg_shmstats_summary){
+		.elapsed = total_secs,
+		.total_mhashes = total_mhashes_done,
+		.rolling_mhs = total_rolling,
+		.diff1 = total_diff1,
+		.diff_accepted = total_diff_accepted,
+		.diff_rejected = total_diff_rejected,
+		.diff_stale = total_diff_stale,
+		.accepted = total_accepted,
+		.rejected = total_rejected,
+		.stale = total_stale,
+		.hw_errors = hw_errors,
+		.getworks = total_getworks,
+		.found_blocks = found_blocks,
+	};
+	mutex_unlock(&hash_lock);
+	
+	shmstats_write_begin(s);
+	
+	s->updated = time(NULL);
+	s->summary = sum;
+	
+	for (i = n = 0; i < total_pools && n < s->pools_max; ++i)
+	{
+		pool = pools[i];
+		if (pool->removed)
+			continue;
+		sp = &s->pool[n++];
+		sp->pool_no = pool->pool_no;
+		sp->accepted = pool->accepted;
+		sp->rejected = pool->rejected;
+		sp->stale = pool->stale_shares;
+		sp->diff_accepted = pool->diff_accepted;
+		sp->diff_rejected = pool->diff_rejected;
+		sp->diff_stale = pool->diff_stale;
+		sp->getwork_latency = pool->cgminer_pool_stats.getwork_wait_rolling;
+		snprintf(sp->url, sizeof(sp->url), "%s", pool->rpc_url);
+	}
+	s->pools = n;
+	
+	for (i = n = 0; i < total_devices && n < s->procs_max; ++i)
+	{
+		proc = get_devices(i);
+		sproc = &procs[n++];
+		snprintf(sproc->name, sizeof(sproc->name), "%s", proc->proc_repr_ns);
+		sproc->total_mhashes = proc->total_mhashes;
+		sproc->rolling_mhs = proc->rolling;
+		sproc->diff_accepted = proc->diff_accepted;
+		sproc->diff_rejected = proc->diff_rejected;
+		sproc->diff_stale = proc->diff_stale;
+		sproc->accepted = proc->accepted;
+		sproc->rejected = proc->rejected;
+		sproc->stale = proc->stale;
+		sproc->hw_errors = proc->hw_errors;
+		sproc->temp = proc->temp;
+	}
+	s->procs = n;
+	
+	shmstats_write_end(s);
+	
+out:
+	mutex_unlock(&shmstats_lock);
+}
+
+void shmstats_cleanup(void)
+{
+	if (!shmstats_name)
+		return;
+	shm_unlink(shmstats_name);
+	free(shmstats_name);
+	shmstats_name = NULL;
+}
+
+static const int test_shmstats_iterations = 0x10000;
+
+// Every published counter is set to the same value, so a torn read shows up
+static
+void *_test_shmstats_writer(void *userdata)
+{
+	struct bfg_shmstats * const s = userdata;
+	struct bfg_shmstats_proc * const procs = bfg_shmstats_procs(s);
+	uint32_t j;
+	int i;
+	
+	for (i = 1; i <= test_shmstats_iterations; ++i)
+	{
+		shmstats_write_begin(s);
+		s->summary.total_mhashes = s->summary.diff_accepted = i;
+		s->summary.accepted = i;
+		for (j = 0; j < s->pools_max; ++j)
+			s->pool[j].diff_accepted = s->pool[j].accepted = i;
+		for (j = 0; j < s->procs_max; ++j)
+			procs[j].total_mhashes = procs[j].accepted = i;
+		shmstats_write_end(s);
+	}
+	return NULL;
+}
+
+void test_shmstats()
+{
+	const uint32_t pools_max = 4, procs_max = 0x100;
+	const size_t sz = bfg_shmstats_size(pools_max, procs_max);
+	struct bfg_shmstats *s, *r, *copy;
+	struct bfg_shmstats_proc *procs;
+	char name[0x20];
+	pthread_t pth;
+	uint32_t seq;
+	double v = 0;
+	uint32_t j;
+	int fd, reads = 0, retries = 0;
+	bool bad;
+	
+	snprintf(name, sizeof(name), "/bfgminer-test-%ld", (long)getpid());
+	s = shmstats_create(name, pools_max, procs_max);
+	if (!s)
+	{
+		applog(LOG_ERR, "%s: Failed to create shared memory", __func__);
+		return;
+	}
+	
+	// Read through a separate mapping, as another process would
+	fd = shm_open(name, O_RDONLY, 0);
+	r = (fd < 0) ? MAP_FAILED : mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
+	if (fd >= 0)
+		close(fd);
+	shm_unlink(name);
+	if (r == MAP_FAILED)
+	{
+		applog(LOG_ERR, "%s: Failed to map shared memory for reading", __func__);
+		munmap(s, sz);
+		return;
+	}
+	if (r->magic != BFG_SHMSTATS_MAGIC || r->version != BFG_SHMSTATS_VERSION || r->procs_max != procs_max)
+		applog(LOG_ERR, "%s: Bad header (magic %08lx, version %lu)",
+		       __func__, (unsigned long)r->magic, (unsigned long)r->version);
+	
+	copy = malloc(sz);
+	pthread_create(&pth, NULL, _test_shmstats_writer, s);
+	do {
+		if (!bfg_shmstats_read_begin(r, &seq))
+		{
+			applog(LOG_ERR, "%s: Timed out waiting for an update to finish", __func__);
+			break;
+		}
+		memcpy(copy, r, sz);
+		if (bfg_shmstats_read_retry(r, seq))
+		{
+			++retries;
+			continue;
+		}
+		++reads;
+	
+		procs = bfg_shmstats_procs(copy);
+		v = copy->summary.total_mhashes;
+		bad = (copy->summary.diff_accepted != v || copy->summary.accepted != v);
+		for (j = 0; j < pools_max; ++j)
+			if (copy->pool[j].diff_accepted != v || copy->pool[j].accepted != v)
+				bad = true;
+		for (j = 0; j < procs_max; ++j)
+			if (procs[j].total_mhashes != v || procs[j].accepted != v)
+				bad = true;
+		if (bad)
+		{
+			applog(LOG_ERR, "%s: Torn read of update %g", __func__, v);
+			break;
+		}
+	} while (v < test_shmstats_iterations);
+	pthread_join(pth, NULL);
+	
+	applog(LOG_DEBUG, "%s: %d consistent reads, %d retries", __func__, reads, retries);
+	
+	// A writer that never finishes its update leaves the stats stale
+	shmstats_write_begin(s);
+	if (bfg_shmstats_read_begin(r, &seq))
+		applog(LOG_ERR, "%s: Read began in the middle of an update", __func__);
+	free(copy);
+	munmap(r, sz);
+	munmap(s, sz);
+}
+
+#endif
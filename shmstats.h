@@ -0,0 +1,134 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef BFG_SHMSTATS_H
+#define BFG_SHMSTATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/* Layout of the shared memory object published with --shm-stats.  It is a
+ * struct bfg_shmstats, followed by pools_max pools and then procs_max
+ * processors, all in the miner's native byte order.
+ *
+ * seq is odd while the miner is updating the stats.  Readers copy out what
+ * they need between bfg_shmstats_read_begin and bfg_shmstats_read_retry, and
+ * start over if the latter returns true.  If bfg_shmstats_read_begin fails,
+ * the stats are stale. */
+
+#define BFG_SHMSTATS_MAGIC    0x53474642  // "BFGS" on little endian
+#define BFG_SHMSTATS_VERSION  1
+
+struct bfg_shmstats_summary {
+	double elapsed;
+	double total_mhashes;
+	double rolling_mhs;
+	double diff1;
+	double diff_accepted;
+	double diff_rejected;
+	double diff_stale;
+	uint32_t accepted;
+	uint32_t rejected;
+	uint32_t stale;
+	uint32_t hw_errors;
+	uint32_t getworks;
+	uint32_t found_blocks;
+};
+
+struct bfg_shmstats_pool {
+	int32_t pool_no;
+	uint32_t accepted;
+	uint32_t rejected;
+	uint32_t stale;
+	double diff_accepted;
+	double diff_rejected;
+	double diff_stale;
+	double getwork_latency;
+	char url[0x100];
+};
+
+struct bfg_shmstats_proc {
+	char name[16];
+	double total_mhashes;
+	double rolling_mhs;
+	double diff_accepted;
+	double diff_rejected;
+	double diff_stale;
+	uint32_t accepted;
+	uint32_t rejected;
+	uint32_t stale;
+	uint32_t hw_errors;
+	float temp;
+	uint32_t _reserved;
+};
+
+struct bfg_shmstats {
+	uint32_t magic;
+	uint32_t version;
+	volatile uint32_t seq;
+	uint32_t pools_max;
+	uint32_t procs_max;
+	uint32_t pools;
+	uint32_t procs;
+	uint32_t updated;
+	struct bfg_shmstats_summary summary;
+	struct bfg_shmstats_pool pool[];
+};
+
+static inline
+size_t bfg_shmstats_size(const uint32_t pools_max, const uint32_t procs_max)
+{
+	return sizeof(struct bfg_shmstats)
+	     + (pools_max * sizeof(struct bfg_shmstats_pool))
+	     + (procs_max * sizeof(struct bfg_shmstats_proc));
+}
+
+static inline
+struct bfg_shmstats_proc *bfg_shmstats_procs(const struct bfg_shmstats * const s)
+{
+	return (struct bfg_shmstats_proc *)&s->pool[s->pools_max];
+}
+
+// How long, in milliseconds, a reader waits for an update to finish
+#define BFG_SHMSTATS_READ_TIMEOUT  1000
+
+// Returns false if an update has not finished in time, ie the miner died in it
+static inline
+bool bfg_shmstats_read_begin(const struct bfg_shmstats * const s, uint32_t * const out_seq)
+{
+	uint32_t seq;
+	int waited = 0;
+	
+	while ((seq = s->seq) & 1)
+	{
+		if (waited++ >= BFG_SHMSTATS_READ_TIMEOUT)
+			return false;
+		usleep(1000);
+	}
+	__sync_synchronize();
+	*out_seq = seq;
+	return true;
+}
+
+static inline
+bool bfg_shmstats_read_retry(const struct bfg_shmstats * const s, const uint32_t seq)
+{
+	__sync_synchronize();
+	return s->seq != seq;
+}
+
+extern bool shmstats_init(const char *name);
+extern void shmstats_update(void);
+extern void shmstats_write_begin(struct bfg_shmstats *);
+extern void shmstats_write_end(struct bfg_shmstats *);
+extern void shmstats_cleanup(void);
+extern void test_shmstats();
+
+#endif
@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+# Copyright 2026 agent <agent@local>
+#
+# This program is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation; either version 3 of the License, or (at your option) any later
+# version.  See COPYING for more details.
+
+# Simulates many stratum miners connecting to the stratum proxy (--stratum-port)
+# Shares are random, so nearly all are rejected, but each one still goes
+# through the same work generation and checking as a real share.
+
+import argparse
+import json
+import random
+import selectors
+import socket
+import time
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--hostname", default="localhost")
+parser.add_argument("--port", type=int, default=3334)
+parser.add_argument("--clients", type=int, default=100)
+parser.add_argument("--users", type=int, default=1, help="number of distinct usernames")
+parser.add_argument("--rate", type=float, default=1000., help="total shares per second")
+parser.add_argument("--shares-per-nonce2", type=int, default=1, help="shares submitted with each extranonce2, like miners rolling ntime")
+parser.add_argument("--duration", type=float, default=0, help="seconds to run (0 means forever)")
+args = parser.parse_args()
+
+sel = selectors.DefaultSelector()
+
+class Client:
+	def __init__(self, n):
+		self.user = "loadgen%d" % (n % args.users,)
+		self.sock = socket.create_connection((args.hostname, args.port))
+		self.sock.setblocking(False)
+		self.inbuf = b''
+		self.outbuf = b''
+		self.xnonce2sz = None
+		self.job = None
+		self.xnonce2 = None
+		self.xnonce2uses = 0
+		self.nextid = 3
+		self.sent = {}
+		sel.register(self.sock, selectors.EVENT_READ, self)
+		self.send({"id": 1, "method": "mining.subscribe", "params": []})
+		self.send({"id": 2, "method": "mining.authorize", "params": [self.user, "x"]})
+
+	def send(self, msg):
+		self.outbuf += json.dumps(msg).encode() + b'\n'
+		self.flush()
+
+	def flush(self):
+		try:
+			n = self.sock.send(self.outbuf)
+		except BlockingIOError:
+			n = 0
+		self.outbuf = self.outbuf[n:]
+		sel.modify(self.sock, selectors.EVENT_READ | (selectors.EVENT_WRITE if self.outbuf else 0), self)
+
+	def submit(self):
+		if self.job is None or self.xnonce2sz is None:
+			return False
+		(job_id, ntime) = self.job
+		msgid = self.nextid
+		self.nextid += 1
+		if not self.xnonce2uses:
+			self.xnonce2 = '%0*x' % (self.xnonce2sz * 2, random.getrandbits(self.xnonce2sz * 8))
+			self.xnonce2uses = args.shares_per_nonce2
+		self.xnonce2uses -= 1
+		nonce = '%08x' % (random.getrandbits(32),)
+		self.sent[msgid] = time.time()
+		self.send({"id": msgid, "method": "mining.submit", "params": [self.user, job_id, self.xnonce2, ntime, nonce]})
+		stats['sent'] += 1
+		return True
+
+	def read(self):
+		try:
+			data = self.sock.recv(0x10000)
+		except BlockingIOError:
+			return
+		if not data:
+			raise EOFError
+		lines = (self.inbuf + data).split(b'\n')
+		self.inbuf = lines.pop()
+		for line in lines:
+			if line.strip():
+				self.handle(json.loads(line.decode()))
+
+	def handle(self, msg):
+		method = msg.get('method')
+		if method == 'mining.notify':
+			params = msg['params']
+			self.job = (params[0], params[7])
+		elif method == 'client.show_message':
+			print('Server message: %s' % (msg['params'][0],))
+		elif method is None:
+			msgid = msg.get('id')
+			if msgid == 1:
+				if msg.get('result'):
+					self.xnonce2sz = msg['result'][2]
+				else:
+					print('Subscribe failed: %s' % (msg.get('error'),))
+			elif msgid in self.sent:
+				latency = time.time() - self.sent.pop(msgid)
+				stats['replies'] += 1
+				stats['latency'] += latency
+				stats['maxlatency'] = max(stats['maxlatency'], latency)
+				if msg.get('error'):
+					err = msg['error'][1]
+					stats['errors'][err] = stats['errors'].get(err, 0) + 1
+
+def reset_stats():
+	return {'sent': 0, 'replies': 0, 'latency': 0., 'maxlatency': 0., 'errors': {}}
+
+def drop(client):
+	print('Client %s disconnected' % (client.user,))
+	sel.unregister(client.sock)
+	client.sock.close()
+	clients.remove(client)
+
+stats = reset_stats()
+clients = []
+for i in range(args.clients):
+	clients.append(Client(i))
+
+start = last_report = last_tick = time.time()
+owed = 0.
+while True:
+	now = time.time()
+	if args.duration and now - start >= args.duration:
+		break
+
+	# Shares not sent for clients without a job yet are simply dropped, and
+	# so is any backlog beyond a tenth of a second when the server is slow
+	owed = min(owed + args.rate * (now - last_tick), max(args.rate / 10, 1))
+	last_tick = now
+	while owed >= 1 and clients:
+		client = random.choice(clients)
+		try:
+			client.submit()
+		except ConnectionError:
+			drop(client)
+		owed -= 1
+
+	for (key, events) in sel.select(timeout=0.01):
+		client = key.data
+		try:
+			if events & selectors.EVENT_READ:
+				client.read()
+			if events & selectors.EVENT_WRITE:
+				client.flush()
+		except (EOFError, ConnectionError):
+			drop(client)
+
+	if now - last_report >= 1:
+		elapsed = now - last_report
+		avglatency = stats['latency'] / stats['replies'] if stats['replies'] else 0
+		print('%d clients: %.0f submits/s, %.0f replies/s, latency avg %.1fms max %.1fms, errors %s' % (
+			len(clients), stats['sent'] / elapsed, stats['replies'] / elapsed,
+			avglatency * 1e3, stats['maxlatency'] * 1e3, stats['errors']))
+		stats = reset_stats()
+		last_report = now
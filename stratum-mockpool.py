@@ -0,0 +1,245 @@
+#!/usr/bin/env python3
+# Copyright 2026 agent <agent@local>
+#
+# This program is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation; either version 3 of the License, or (at your option) any later
+# version.  See COPYING for more details.
+
+# Mock stratum pools for testing --stratum-event-loop against, eg:
+#   bfgminer --stratum-event-loop --balance \
+#     -o stratum+tcp://127.0.0.1:3340 -u x -p x \
+#     -o stratum+tcp://127.0.0.1:3341 -u x -p x
+# Once the miner has been connected for a while, the first pool sends it
+# client.reconnect, and then stalls the new connection's subscribe. The other
+# pools keep asking the miner for its version with client.get_version, and if
+# their replies are held up while the first pool reconnects, the test fails.
+
+import argparse
+import heapq
+import json
+import selectors
+import socket
+import sys
+import time
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--hostname", default="127.0.0.1")
+parser.add_argument("--port", type=int, default=3340, help="port of the first pool; the rest follow it")
+parser.add_argument("--pools", type=int, default=2)
+parser.add_argument("--reconnect-after", type=float, default=10., help="seconds after the first pool is authorized to send client.reconnect")
+parser.add_argument("--stall", type=float, default=5., help="seconds to delay the reconnected subscribe")
+parser.add_argument("--probe-interval", type=float, default=.25, help="seconds between client.get_version requests")
+parser.add_argument("--timeout", type=float, default=120., help="seconds to wait for the miner")
+args = parser.parse_args()
+
+sel = selectors.DefaultSelector()
+timers = []
+timer_seq = 0
+
+def schedule(when, func):
+	global timer_seq
+	timer_seq += 1
+	heapq.heappush(timers, (when, timer_seq, func))
+
+notify_params = [
+	"1",
+	"4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000",
+	"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008",
+	"072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000",
+	[],
+	"00000002",
+	"1c2ac4af",
+	"504e86b9",
+	True,
+]
+
+class Pool:
+	def __init__(self, n):
+		self.n = n
+		self.port = args.port + n
+		self.conns = []
+		self.authorized = 0
+		self.stall_next = False
+		self.lsock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		self.lsock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+		self.lsock.bind((args.hostname, self.port))
+		self.lsock.listen(8)
+		self.lsock.setblocking(False)
+		sel.register(self.lsock, selectors.EVENT_READ, self)
+
+	def accept(self):
+		(sock, addr) = self.lsock.accept()
+		self.conns.append(Conn(self, sock))
+
+class Conn:
+	def __init__(self, pool, sock):
+		self.pool = pool
+		self.sock = sock
+		self.sock.setblocking(False)
+		self.inbuf = b''
+		self.outbuf = b''
+		self.authorized = False
+		# Messages received while the subscribe is stalled, handled after it
+		self.stalled = None
+		self.nextid = 1
+		self.probes = {}
+		sel.register(self.sock, selectors.EVENT_READ, self)
+
+	def send(self, msg):
+		if self.sock is None:
+			return
+		self.outbuf += json.dumps(msg).encode() + b'\n'
+		self.flush()
+
+	def flush(self):
+		try:
+			n = self.sock.send(self.outbuf)
+		except BlockingIOError:
+			n = 0
+		self.outbuf = self.outbuf[n:]
+		sel.modify(self.sock, selectors.EVENT_READ | (selectors.EVENT_WRITE if self.outbuf else 0), self)
+
+	def read(self):
+		try:
+			data = self.sock.recv(0x10000)
+		except BlockingIOError:
+			return
+		if not data:
+			raise EOFError
+		lines = (self.inbuf + data).split(b'\n')
+		self.inbuf = lines.pop()
+		for line in lines:
+			if line.strip():
+				self.handle(json.loads(line.decode()))
+
+	def subscribed(self, msgid):
+		self.send({"id": msgid, "result": [[["mining.notify", "%08x" % (id(self) & 0xffffffff,)]], "%08x" % (self.pool.n,), 4], "error": None})
+
+	def unstall(self, msgid):
+		pending = self.stalled
+		self.stalled = None
+		self.subscribed(msgid)
+		for msg in pending:
+			self.handle(msg)
+
+	def handle(self, msg):
+		if self.stalled is not None:
+			self.stalled.append(msg)
+			return
+		method = msg.get('method')
+		msgid = msg.get('id')
+		now = time.time()
+		if method == 'mining.subscribe':
+			if self.pool.stall_next:
+				self.pool.stall_next = False
+				print('Pool %d: Stalling subscribe for %g seconds' % (self.pool.n, args.stall))
+				self.stalled = []
+				schedule(now + args.stall, lambda: self.unstall(msgid))
+			else:
+				self.subscribed(msgid)
+		elif method == 'mining.authorize':
+			self.send({"id": msgid, "result": True, "error": None})
+			self.send({"id": None, "method": "mining.set_difficulty", "params": [1]})
+			self.send({"id": None, "method": "mining.notify", "params": notify_params})
+			self.authorized = True
+			self.pool.authorized += 1
+			print('Pool %d: Miner authorized (%d times)' % (self.pool.n, self.pool.authorized))
+			authorized(self)
+		elif method == 'mining.submit':
+			self.send({"id": msgid, "result": True, "error": None})
+		elif method is not None:
+			if msgid is not None:
+				self.send({"id": msgid, "result": None, "error": [20, "Not supported", None]})
+		elif msgid in self.probes:
+			sent = self.probes.pop(msgid)
+			latency = now - sent
+			stats['replies'] += 1
+			if stall_start is not None and sent < stall_start + args.stall and now > stall_start:
+				stats['stall_replies'] += 1
+				stats['stall_maxlatency'] = max(stats['stall_maxlatency'], latency)
+			stats['maxlatency'] = max(stats['maxlatency'], latency)
+
+	def probe(self):
+		msgid = self.nextid
+		self.nextid += 1
+		self.probes[msgid] = time.time()
+		self.send({"id": msgid, "method": "client.get_version", "params": []})
+
+	def close(self):
+		sel.unregister(self.sock)
+		self.sock.close()
+		self.sock = None
+		self.pool.conns.remove(self)
+
+stall_start = None
+stats = {'replies': 0, 'maxlatency': 0., 'stall_replies': 0, 'stall_maxlatency': 0.}
+
+def authorized(conn):
+	if conn.pool is pools[0] and conn.pool.authorized == 1:
+		schedule(time.time() + args.reconnect_after, reconnect)
+
+def reconnect():
+	global stall_start
+	conns = [conn for conn in pools[0].conns if conn.authorized]
+	if not conns:
+		return
+	print('Pool 0: Sending client.reconnect')
+	pools[0].stall_next = True
+	stall_start = time.time()
+	for conn in conns:
+		conn.send({"id": None, "method": "client.reconnect", "params": []})
+
+def probe():
+	for pool in pools[1:]:
+		for conn in pool.conns:
+			if conn.authorized:
+				conn.probe()
+	schedule(time.time() + args.probe_interval, probe)
+
+pools = [Pool(i) for i in range(args.pools)]
+start = time.time()
+schedule(start, probe)
+
+while True:
+	now = time.time()
+	if stall_start is not None and now > stall_start + args.stall + 2:
+		break
+	if now - start > args.timeout:
+		print('Timed out waiting for the miner')
+		sys.exit(1)
+
+	while timers and timers[0][0] <= now:
+		heapq.heappop(timers)[2]()
+
+	timeout = (timers[0][0] - now) if timers else None
+	for (key, events) in sel.select(timeout=timeout):
+		obj = key.data
+		if isinstance(obj, Pool):
+			obj.accept()
+			continue
+		if obj.sock is None:
+			continue
+		try:
+			if events & selectors.EVENT_READ:
+				obj.read()
+			if obj.sock is not None and events & selectors.EVENT_WRITE:
+				obj.flush()
+		except (EOFError, ConnectionError):
+			print('Pool %d: Miner disconnected' % (obj.pool.n,))
+			obj.close()
+
+print('%d version replies, %.3fs max latency; %d while reconnecting, %.3fs max latency' % (
+	stats['replies'], stats['maxlatency'], stats['stall_replies'], stats['stall_maxlatency']))
+
+failed = False
+if pools[0].authorized < 2:
+	print('FAIL: Miner did not reconnect to pool 0')
+	failed = True
+if args.pools > 1 and not stats['stall_replies']:
+	print('FAIL: No version replies from other pools while pool 0 was reconnecting')
+	failed = True
+if stats['stall_maxlatency'] > args.stall / 2:
+	print('FAIL: Other pools were held up while pool 0 was reconnecting')
+	failed = True
+sys.exit(1 if failed else 0)
@@ -25,6 +25,7 @@
 #include <curl/curl.h>
 #include <time.h>
 #include <errno.h>
+#include <math.h>
 #include <unistd.h>
 #include <sys/types.h>
 #ifdef HAVE_SYS_PRCTL_H
@@ -675,16 +676,23 @@ char *absolute_uri(char *uri, const char *ref)
 	return abs;
 }
 
-static const char _hexchars[0x10] = "0123456789abcdef";
+// Both hex digits of every byte value, so bin2hex needs one lookup per byte
+#define _HEXDIGIT(n)  ((n) < 10 ? '0' + (n) : 'a' - 10 + (n))
+#define _HEXPAIR(n)  { _HEXDIGIT((n) >> 4), _HEXDIGIT((n) & 0xf) }
+#define _HEXPAIRS4(n)  _HEXPAIR(n), _HEXPAIR((n) + 1), _HEXPAIR((n) + 2), _HEXPAIR((n) + 3)
+#define _HEXPAIRS16(n)  _HEXPAIRS4(n), _HEXPAIRS4((n) + 4), _HEXPAIRS4((n) + 8), _HEXPAIRS4((n) + 12)
+#define _HEXPAIRS64(n)  _HEXPAIRS16(n), _HEXPAIRS16((n) + 0x10), _HEXPAIRS16((n) + 0x20), _HEXPAIRS16((n) + 0x30)
+static const char _hexpairs[0x100][2] = {
+	_HEXPAIRS64(0), _HEXPAIRS64(0x40), _HEXPAIRS64(0x80), _HEXPAIRS64(0xc0),
+};
 
 void bin2hex(char *out, const void *in, size_t len)
 {
 	const unsigned char *p = in;
 	while (len--)
 	{
-		(out++)[0] = _hexchars[p[0] >> 4];
-		(out++)[0] = _hexchars[p[0] & 0xf];
-		++p;
+		memcpy(out, _hexpairs[(p++)[0]], 2);
+		out += 2;
 	}
 	out[0] = '\0';
 }
@@ -1680,7 +1688,7 @@ static bool socket_full(struct pool *pool, int wait)
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-	if (strlen(pool->sockbuf))
+	if (pool->sockbuf_len > pool->sockbuf_pos)
 		return true;
 
 	return (socket_full(pool, 0));
@@ -1688,7 +1696,8 @@ bool sock_full(struct pool *pool)
 
 static void clear_sockbuf(struct pool *pool)
 {
-	strcpy(pool->sockbuf, "");
+	pool->sockbuf_pos = pool->sockbuf_len = pool->sockbuf_scan = 0;
+	pool->sockbuf[0] = '\0';
 }
 
 static void clear_sock(struct pool *pool)
@@ -1706,36 +1715,86 @@ static void clear_sock(struct pool *pool)
 	clear_sockbuf(pool);
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
-static void recalloc_sock(struct pool *pool, size_t len)
+/* Make room for len more bytes after the unparsed data, by first dropping
+ * what has already been parsed and then doubling the buffer as needed so any
+ * coinbase size fits. Returns where to put them. */
+static char *sockbuf_reserve(struct pool *pool, size_t len)
 {
-	size_t old, new;
+	size_t new;
 
-	old = strlen(pool->sockbuf);
-	new = old + len + 1;
-	if (new < pool->sockbuf_size)
-		return;
-	new = new + (RBUFSIZE - (new % RBUFSIZE));
-	// Avoid potentially recursive locking
-	// applog(LOG_DEBUG, "Recallocing pool sockbuf to %lu", (unsigned long)new);
-	pool->sockbuf = realloc(pool->sockbuf, new);
-	if (!pool->sockbuf)
-		quithere(1, "Failed to realloc pool sockbuf");
-	memset(pool->sockbuf + old, 0, new - old);
-	pool->sockbuf_size = new;
-}
-
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
-char *recv_line(struct pool *pool)
+	if (pool->sockbuf_pos)
+	{
+		pool->sockbuf_len -= pool->sockbuf_pos;
+		pool->sockbuf_scan -= pool->sockbuf_pos;
+		memmove(pool->sockbuf, &pool->sockbuf[pool->sockbuf_pos], pool->sockbuf_len);
+		pool->sockbuf_pos = 0;
+	}
+	new = pool->sockbuf_size;
+	while (new < pool->sockbuf_len + len + 1)
+		new *= 2;
+	if (new != pool->sockbuf_size)
+	{
+		// Avoid potentially recursive locking
+		// applog(LOG_DEBUG, "Reallocing pool sockbuf to %lu", (unsigned long)new);
+		pool->sockbuf = realloc(pool->sockbuf, new);
+		if (!pool->sockbuf)
+			quithere(1, "Failed to realloc pool sockbuf");
+		pool->sockbuf_size = new;
+	}
+	return &pool->sockbuf[pool->sockbuf_len];
+}
+
+static void sockbuf_commit(struct pool *pool, size_t len)
+{
+	pool->sockbuf_len += len;
+	pool->sockbuf[pool->sockbuf_len] = '\0';
+}
+
+/* Terminates the next complete line in place and returns it, or NULL if there
+ * isn't one yet. Only bytes not scanned by a previous call are searched, and
+ * empty lines are skipped. */
+static char *sockbuf_getline(struct pool *pool, size_t *lenp)
+{
+	char *line, *nl;
+
+	do {
+		nl = memchr(&pool->sockbuf[pool->sockbuf_scan], '\n', pool->sockbuf_len - pool->sockbuf_scan);
+		if (!nl)
+		{
+			pool->sockbuf_scan = pool->sockbuf_len;
+			return NULL;
+		}
+		line = &pool->sockbuf[pool->sockbuf_pos];
+		*nl = '\0';
+		pool->sockbuf_pos = pool->sockbuf_scan = nl + 1 - pool->sockbuf;
+	} while (nl == line);
+
+	*lenp = nl - line;
+	return line;
+}
+
+static void recv_line_received(struct pool * const pool, const char * const s, const size_t len)
 {
-	char *tok, *sret = NULL;
-	ssize_t len, buflen;
+	pool->cgminer_pool_stats.times_received++;
+	pool->cgminer_pool_stats.bytes_received += len;
+	total_bytes_rcvd += len;
+	pool->cgminer_pool_stats.net_bytes_received += len;
+
+	if (opt_protocol)
+		applog(LOG_DEBUG, "Pool %u: RECV: %s", pool->pool_no, s);
+}
+
+/* Waits for the first end of line on a socket and returns that line, still
+ * in the pool's socket buffer. It is only valid until the next call for the
+ * same pool. */
+char *_recv_line(struct pool *pool, size_t *lenp)
+{
+	char *sret = NULL;
+	size_t len;
 	int waited = 0;
 
-	if (!strstr(pool->sockbuf, "\n")) {
+	sret = sockbuf_getline(pool, &len);
+	if (!sret) {
 		struct timeval rstart, now;
 
 		cgtime(&rstart);
@@ -1745,12 +1804,11 @@ char *recv_line(struct pool *pool)
 		}
 
 		do {
-			char s[RBUFSIZE];
-			size_t slen;
+			char *s;
 			size_t n = 0;
 			CURLcode rc;
 
-			memset(s, 0, RBUFSIZE);
+			s = sockbuf_reserve(pool, RECVSIZE);
 			rc = curl_easy_recv(pool->stratum_curl, s, RECVSIZE, &n);
 			if (rc == CURLE_OK && !n)
 			{
@@ -1771,42 +1829,176 @@ char *recv_line(struct pool *pool)
 					break;
 				}
 			} else {
-				slen = strlen(s);
-				recalloc_sock(pool, slen);
-				strcat(pool->sockbuf, s);
+				sockbuf_commit(pool, n);
+				sret = sockbuf_getline(pool, &len);
 			}
-		} while (waited < DEFAULT_SOCKWAIT && !strstr(pool->sockbuf, "\n"));
+		} while (waited < DEFAULT_SOCKWAIT && !sret);
 	}
 
-	buflen = strlen(pool->sockbuf);
-	tok = strtok(pool->sockbuf, "\n");
-	if (!tok) {
+	if (!sret) {
 		applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
 		goto out;
 	}
-	sret = strdup(tok);
-	len = strlen(sret);
 
-	/* Copy what's left in the buffer after the \n, including the
-	 * terminating \0 */
-	if (buflen > len + 1)
-		memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-	else
-		strcpy(pool->sockbuf, "");
-
-	pool->cgminer_pool_stats.times_received++;
-	pool->cgminer_pool_stats.bytes_received += len;
-	total_bytes_rcvd += len;
-	pool->cgminer_pool_stats.net_bytes_received += len;
+	recv_line_received(pool, sret, len);
 
 out:
 	if (!sret)
 		clear_sock(pool);
-	else if (opt_protocol)
-		applog(LOG_DEBUG, "Pool %u: RECV: %s", pool->pool_no, sret);
+	else
+	if (lenp)
+		*lenp = len;
 	return sret;
 }
 
+/* Like _recv_line, but for sockets being polled by the caller: reads at most
+ * once, never waits, and returns NULL when no complete line is available yet.
+ * *closedp is set if the connection was lost instead. */
+char *recv_line_nowait(struct pool *pool, size_t *lenp, bool *closedp)
+{
+	char *sret, *s;
+	size_t len, n = 0;
+	CURLcode rc;
+
+	*closedp = false;
+	sret = sockbuf_getline(pool, &len);
+	if (!sret)
+	{
+		if (pool->sock == INVSOCK)
+		{
+			*closedp = true;
+			return NULL;
+		}
+		s = sockbuf_reserve(pool, RECVSIZE);
+		rc = curl_easy_recv(pool->stratum_curl, s, RECVSIZE, &n);
+		if (rc == CURLE_AGAIN)
+			return NULL;
+		if (rc != CURLE_OK || !n)
+		{
+			if (rc == CURLE_OK)
+				applog(LOG_DEBUG, "Socket closed in recv_line_nowait");
+			else
+				applog(LOG_DEBUG, "Failed to recv sock in recv_line_nowait: %s", curl_easy_strerror(rc));
+			suspend_stratum(pool);
+			*closedp = true;
+			return NULL;
+		}
+		sockbuf_commit(pool, n);
+		sret = sockbuf_getline(pool, &len);
+		if (!sret)
+			return NULL;
+	}
+
+	recv_line_received(pool, sret, len);
+	if (lenp)
+		*lenp = len;
+	return sret;
+}
+
+/* Like _recv_line, but returns a malloced copy of the line */
+char *recv_line(struct pool *pool)
+{
+	size_t len;
+	char * const s = _recv_line(pool, &len);
+	char *sret;
+
+	if (!s)
+		return NULL;
+	sret = malloc(len + 1);
+	if (!sret)
+		quithere(1, "Failed to malloc line");
+	memcpy(sret, s, len + 1);
+	return sret;
+}
+
+// Feeds data through the socket buffer in chunks, as recv would, and counts the lines
+static
+unsigned long _test_sockbuf_feed(struct pool * const pool, const char * const data, const size_t datalen, const size_t chunk, const char * const * const expect, const int expects)
+{
+	unsigned long lines = 0;
+	size_t off, n, len;
+	char *line;
+
+	for (off = 0; off < datalen; off += n)
+	{
+		n = datalen - off;
+		if (n > chunk)
+			n = chunk;
+		memcpy(sockbuf_reserve(pool, n), &data[off], n);
+		sockbuf_commit(pool, n);
+		while ((line = sockbuf_getline(pool, &len)))
+		{
+			if (expect && (len != strlen(expect[lines % expects]) || memcmp(line, expect[lines % expects], len)))
+				applog(LOG_ERR, "Stratum line reader test failed: chunk %d, line %lu", (int)chunk, lines);
+			++lines;
+		}
+	}
+	return lines;
+}
+
+void test_stratum_line_reader()
+{
+	static const int bench_rounds = 0x4000;
+	static const size_t chunks[] = {1, 7, 0x40, 0x3ff, RECVSIZE};
+	static const char * const merkle = "\"2a1f0b3c8d9e4f5061728394a5b6c7d8e9f00112233445566778899aabbccdd\"";
+	// A recorded session, with the notify's merkle branch filled in below
+	const char *session[] = {
+		"{\"id\": 1, \"result\": [[\"mining.notify\", \"ae6812eb4cd7735a302a8a9dd95cf71f\"], \"f8002c90\", 4], \"error\": null}",
+		"{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [32]}",
+		NULL,
+		"{\"id\": 4, \"result\": true, \"error\": null}",
+	};
+	const int session_lines = sizeof(session) / sizeof(*session);
+	struct pool pool = {
+		.sockbuf_size = 0x10,
+	};
+	struct timeval tv_start;
+	char *notify, *traffic, *p;
+	size_t trafficlen;
+	unsigned long lines;
+	long us;
+	int i;
+
+	notify = malloc(0x1000);
+	p = notify + sprintf(notify, "{\"params\": [\"bf\", \"4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000\", "
+	    "\"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008\", "
+	    "\"072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000\", [");
+	for (i = 0; i < 12; ++i)
+		p += sprintf(p, "%s%s", i ? ", " : "", merkle);
+	strcpy(p, "], \"00000002\", \"1c2ac4af\", \"504e86b9\", false], \"id\": null, \"method\": \"mining.notify\"}");
+	session[2] = notify;
+
+	trafficlen = 0;
+	for (i = 0; i < session_lines; ++i)
+		trafficlen += strlen(session[i]) + 1;
+	traffic = malloc(trafficlen + 1);
+	p = traffic;
+	for (i = 0; i < session_lines; ++i)
+		p += sprintf(p, "%s\n", session[i]);
+
+	pool.sockbuf = calloc(pool.sockbuf_size, 1);
+	for (i = 0; i < sizeof(chunks) / sizeof(*chunks); ++i)
+	{
+		lines = _test_sockbuf_feed(&pool, traffic, trafficlen, chunks[i], session, session_lines);
+		if (lines != session_lines || sock_full(&pool))
+			applog(LOG_ERR, "Stratum line reader test failed: chunk %d, got %lu lines", (int)chunks[i], lines);
+	}
+
+	// Throughput, fed the way recv_line reads the socket
+	lines = 0;
+	cgtime(&tv_start);
+	for (i = 0; i < bench_rounds; ++i)
+		lines += _test_sockbuf_feed(&pool, traffic, trafficlen, RECVSIZE, NULL, 0);
+	us = timer_elapsed_us(&tv_start, NULL);
+	applog(LOG_DEBUG, "Stratum line reader: %lu lines, %lu bytes in %ldus (%.0f lines/s, %.1f MB/s)",
+	       lines, (unsigned long)(trafficlen * bench_rounds), us,
+	       us ? (lines * 1e6 / us) : 0., us ? (trafficlen * bench_rounds / (double)us) : 0.);
+
+	free(pool.sockbuf);
+	free(traffic);
+	free(notify);
+}
+
 /* Dumps any JSON value as a string. Just like jansson 2.1's JSON_ENCODE_ANY
  * flag, but this is compatible with 2.0. */
 char *json_dumps_ANY(json_t *json, size_t flags)
@@ -2072,67 +2264,280 @@ void stratum_probe_transparency(struct pool *pool)
 	pool->swork.transparency_probed = true;
 }
 
-static bool parse_notify(struct pool *pool, json_t *val)
+/* A minimal JSON scanner for the stratum messages received most often, so they
+ * can be handled straight out of the socket buffer without building a jansson
+ * tree. Anything it is not sure about (including any string with escapes, or
+ * anything but ASCII, which jansson would validate as UTF-8) is rejected, so
+ * the caller can fall back to jansson. */
+
+const char *fastjson_ws(const char *p)
 {
-	const char *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit, *ntime;
-	char *job_id;
-	bool clean, ret = false;
-	int merkles, i;
-	size_t cb1_len, cb2_len;
-	json_t *arr;
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		++p;
+	return p;
+}
 
-	arr = json_array_get(val, 4);
-	if (!arr || !json_is_array(arr))
-		goto out;
+// Returns the contents of the string at p, and sets *endp past its end
+const char *fastjson_string(const char *p, size_t * const lenp, const char ** const endp)
+{
+	const char *e;
 
-	merkles = json_array_size(arr);
-	for (i = 0; i < merkles; i++)
-		if (!json_is_string(json_array_get(arr, i)))
-			goto out;
+	if (*p != '"')
+		return NULL;
+	for (e = ++p; *e != '"'; ++e)
+		if (*e == '\\' || (unsigned char)*e < 0x20 || (unsigned char)*e >= 0x80)
+			return NULL;
+	*lenp = e - p;
+	*endp = &e[1];
+	return p;
+}
 
-	prev_hash = __json_array_string(val, 1);
-	coinbase1 = __json_array_string(val, 2);
-	coinbase2 = __json_array_string(val, 3);
-	bbversion = __json_array_string(val, 5);
-	nbit = __json_array_string(val, 6);
-	ntime = __json_array_string(val, 7);
-	clean = json_is_true(json_array_get(val, 8));
+static const char *fastjson_digits(const char *p)
+{
+	if (!isdigit(*p))
+		return NULL;
+	while (isdigit(*p))
+		++p;
+	return p;
+}
 
-	if (!prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime)
-		goto out;
-	
-	job_id = json_array_string(val, 0);
+// Also rejects anything jansson would refuse for being out of range
+static const char *fastjson_number(const char * const s)
+{
+	const char *p = s;
+	bool real = false;
+
+	if (*p == '-')
+		++p;
+	if (*p == '0')
+		++p;
+	else
+	if (!(p = fastjson_digits(p)))
+		return NULL;
+	if (*p == '.')
+	{
+		if (!(p = fastjson_digits(&p[1])))
+			return NULL;
+		real = true;
+	}
+	if (*p == 'e' || *p == 'E')
+	{
+		++p;
+		if (*p == '+' || *p == '-')
+			++p;
+		if (!(p = fastjson_digits(p)))
+			return NULL;
+		real = true;
+	}
+	if (real ? isinf(strtod(s, NULL)) : (p - s > 18))
+		return NULL;
+	return p;
+}
+
+// Returns where the value at p ends
+static const char *fastjson_skip(const char *p, const int depth)
+{
+	size_t len;
+	char close;
+
+	switch (*p)
+	{
+		case '"':
+			return fastjson_string(p, &len, &p) ? p : NULL;
+		case 't':
+			return strncmp(p, "true", 4) ? NULL : &p[4];
+		case 'f':
+			return strncmp(p, "false", 5) ? NULL : &p[5];
+		case 'n':
+			return strncmp(p, "null", 4) ? NULL : &p[4];
+		case '[':
+		case '{':
+			break;
+		default:
+			return fastjson_number(p);
+	}
+
+	if (depth >= 0x10)
+		return NULL;
+	close = (*p == '[') ? ']' : '}';
+	p = fastjson_ws(&p[1]);
+	if (*p == close)
+		return &p[1];
+	while (true)
+	{
+		if (close == '}')
+		{
+			if (!fastjson_string(p, &len, &p))
+				return NULL;
+			p = fastjson_ws(p);
+			if (*p != ':')
+				return NULL;
+			p = fastjson_ws(&p[1]);
+		}
+		if (!(p = fastjson_skip(p, depth + 1)))
+			return NULL;
+		p = fastjson_ws(p);
+		if (*p == close)
+			return &p[1];
+		if (*p != ',')
+			return NULL;
+		p = fastjson_ws(&p[1]);
+	}
+}
+
+/* Finds where each element of the array at p starts, storing up to max of
+ * them. Returns how many elements there are, or -1 if p is not an array */
+static int fastjson_array(const char *p, const char ** const elems, const int max)
+{
+	int n = 0;
+
+	if (*p != '[')
+		return -1;
+	p = fastjson_ws(&p[1]);
+	if (*p == ']')
+		return 0;
+	while (true)
+	{
+		if (n < max)
+			elems[n] = p;
+		++n;
+		if (!(p = fastjson_skip(p, 1)))
+			return -1;
+		p = fastjson_ws(p);
+		if (*p == ']')
+			return n;
+		if (*p != ',')
+			return -1;
+		p = fastjson_ws(&p[1]);
+	}
+}
+
+bool fastjson_is(const char * const p, const char * const literal)
+{
+	const size_t len = strlen(literal);
+	return p && !strncmp(p, literal, len) && !isalnum(p[len]);
+}
+
+bool fastjson_int(const char * const p, long long * const out)
+{
+	const char *e = fastjson_number(p);
+	char *e2;
+
+	if (!e || memchr(p, '.', e - p) || memchr(p, 'e', e - p) || memchr(p, 'E', e - p))
+		return false;
+	*out = strtoll(p, &e2, 10);
+	return e2 == e;
+}
+
+/* Finds the members of a stratum message that matter; each is left pointing
+ * to the start of its JSON value, or NULL if absent. Returns false if the line
+ * is not a JSON object, or is anything this cannot handle */
+bool stratum_fastjson_scan(struct stratum_fastjson * const fj, const char *p)
+{
+	const char *key, *val;
+	size_t keylen;
+
+	memset(fj, 0, sizeof(*fj));
+	p = fastjson_ws(p);
+	if (*p != '{')
+		return false;
+	p = fastjson_ws(&p[1]);
+	if (*p == '}')
+		goto end;
+	while (true)
+	{
+		if (!(key = fastjson_string(p, &keylen, &p)))
+			return false;
+		p = fastjson_ws(p);
+		if (*p != ':')
+			return false;
+		val = fastjson_ws(&p[1]);
+		if (!(p = fastjson_skip(val, 1)))
+			return false;
+#define FASTJSON_KEY(k)  (keylen == sizeof(#k) - 1 && !memcmp(key, #k, keylen))
+		if (FASTJSON_KEY(method))
+		{
+			if (!(fj->method = fastjson_string(val, &fj->method_len, &key)))
+				return false;
+		}
+		else
+		if (FASTJSON_KEY(params))
+			fj->params = val;
+		else
+		if (FASTJSON_KEY(id))
+			fj->id = val;
+		else
+		if (FASTJSON_KEY(result))
+			fj->result = val;
+		else
+		if (FASTJSON_KEY(error))
+			fj->error = val;
+#undef FASTJSON_KEY
+		p = fastjson_ws(p);
+		if (*p == '}')
+			break;
+		if (*p != ',')
+			return false;
+		p = fastjson_ws(&p[1]);
+	}
+end:
+	// Like json_loads, allow nothing but whitespace after the object
+	return !*fastjson_ws(&p[1]);
+}
+
+// The fields of a mining.notify, as NUL terminated hex strings
+struct stratum_notify {
+	const char *job_id;
+	const char *prev_hash;
+	const char *coinbase1;
+	const char *coinbase2;
+	int merkles;
+	const char **merkle;
+	const char *bbversion;
+	const char *nbit;
+	const char *ntime;
+	bool clean;
+};
+
+static bool stratum_apply_notify(struct pool * const pool, const struct stratum_notify * const sn)
+{
+	char *job_id;
+	size_t cb1_len, cb2_len;
+	int i;
+
+	job_id = refstr_dup(sn->job_id);
 	if (!job_id)
-		goto out;
+		return false;
 
 	cg_wlock(&pool->data_lock);
 	cgtime(&pool->swork.tv_received);
-	free(pool->swork.job_id);
+	refstr_unref(pool->swork.job_id);
 	pool->swork.job_id = job_id;
-	pool->submit_old = !clean;
+	pool->submit_old = !sn->clean;
 	pool->swork.clean = true;
 	
-	hex2bin(&pool->swork.header1[0], bbversion,  4);
-	hex2bin(&pool->swork.header1[4], prev_hash, 32);
-	hex2bin((void*)&pool->swork.ntime, ntime, 4);
+	hex2bin(&pool->swork.header1[0], sn->bbversion,  4);
+	hex2bin(&pool->swork.header1[4], sn->prev_hash, 32);
+	hex2bin((void*)&pool->swork.ntime, sn->ntime, 4);
 	pool->swork.ntime = be32toh(pool->swork.ntime);
-	hex2bin(&pool->swork.diffbits[0], nbit, 4);
+	hex2bin(&pool->swork.diffbits[0], sn->nbit, 4);
 	
-	cb1_len = strlen(coinbase1) / 2;
+	cb1_len = strlen(sn->coinbase1) / 2;
 	pool->swork.nonce2_offset = cb1_len + pool->n1_len;
-	cb2_len = strlen(coinbase2) / 2;
+	cb2_len = strlen(sn->coinbase2) / 2;
 
 	bytes_resize(&pool->swork.coinbase, pool->swork.nonce2_offset + pool->n2size + cb2_len);
 	uint8_t *coinbase = bytes_buf(&pool->swork.coinbase);
-	hex2bin(coinbase, coinbase1, cb1_len);
+	hex2bin(coinbase, sn->coinbase1, cb1_len);
 	hex2bin(&coinbase[cb1_len], pool->nonce1, pool->n1_len);
 	// NOTE: gap for nonce2, filled at work generation time
-	hex2bin(&coinbase[pool->swork.nonce2_offset + pool->n2size], coinbase2, cb2_len);
+	hex2bin(&coinbase[pool->swork.nonce2_offset + pool->n2size], sn->coinbase2, cb2_len);
 	
-	bytes_resize(&pool->swork.merkle_bin, 32 * merkles);
-	for (i = 0; i < merkles; i++)
-		hex2bin(&bytes_buf(&pool->swork.merkle_bin)[i * 32], json_string_value(json_array_get(arr, i)), 32);
-	pool->swork.merkles = merkles;
+	bytes_resize(&pool->swork.merkle_bin, 32 * sn->merkles);
+	for (i = 0; i < sn->merkles; i++)
+		hex2bin(&bytes_buf(&pool->swork.merkle_bin)[i * 32], sn->merkle[i], 32);
+	pool->swork.merkles = sn->merkles;
+	stratum_work_precompute(&pool->swork);
 	pool->nonce2 = 0;
 	cg_wunlock(&pool->data_lock);
 
@@ -2141,35 +2546,62 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	if (opt_debug && opt_protocol)
 	{
 		applog(LOG_DEBUG, "job_id: %s", job_id);
-		applog(LOG_DEBUG, "prev_hash: %s", prev_hash);
-		applog(LOG_DEBUG, "coinbase1: %s", coinbase1);
-		applog(LOG_DEBUG, "coinbase2: %s", coinbase2);
-		for (i = 0; i < merkles; i++)
-			applog(LOG_DEBUG, "merkle%d: %s", i, json_string_value(json_array_get(arr, i)));
-		applog(LOG_DEBUG, "bbversion: %s", bbversion);
-		applog(LOG_DEBUG, "nbit: %s", nbit);
-		applog(LOG_DEBUG, "ntime: %s", ntime);
-		applog(LOG_DEBUG, "clean: %s", clean ? "yes" : "no");
+		applog(LOG_DEBUG, "prev_hash: %s", sn->prev_hash);
+		applog(LOG_DEBUG, "coinbase1: %s", sn->coinbase1);
+		applog(LOG_DEBUG, "coinbase2: %s", sn->coinbase2);
+		for (i = 0; i < sn->merkles; i++)
+			applog(LOG_DEBUG, "merkle%d: %s", i, sn->merkle[i]);
+		applog(LOG_DEBUG, "bbversion: %s", sn->bbversion);
+		applog(LOG_DEBUG, "nbit: %s", sn->nbit);
+		applog(LOG_DEBUG, "ntime: %s", sn->ntime);
+		applog(LOG_DEBUG, "clean: %s", sn->clean ? "yes" : "no");
 	}
 
 	/* A notify message is the closest stratum gets to a getwork */
 	pool->getwork_requested++;
 	total_getworks++;
 
-	if ((merkles && (!pool->swork.transparency_probed || rand() <= RAND_MAX / (opt_skip_checks + 1))) || timer_isset(&pool->swork.tv_transparency))
+	if ((sn->merkles && (!pool->swork.transparency_probed || rand() <= RAND_MAX / (opt_skip_checks + 1))) || timer_isset(&pool->swork.tv_transparency))
 		if (pool->probed)
 			stratum_probe_transparency(pool);
 
-	ret = true;
-out:
-	return ret;
+	return true;
 }
 
-static bool parse_diff(struct pool *pool, json_t *val)
+static bool parse_notify(struct pool *pool, json_t *val)
 {
-	double diff;
+	struct stratum_notify sn;
+	int i;
+	json_t *arr;
 
-	diff = json_number_value(json_array_get(val, 0));
+	arr = json_array_get(val, 4);
+	if (!arr || !json_is_array(arr))
+		return false;
+
+	sn.merkles = json_array_size(arr);
+	const char *merkle[sn.merkles];
+	for (i = 0; i < sn.merkles; i++)
+		if (!(merkle[i] = json_string_value(json_array_get(arr, i))))
+			return false;
+	sn.merkle = merkle;
+
+	sn.prev_hash = __json_array_string(val, 1);
+	sn.coinbase1 = __json_array_string(val, 2);
+	sn.coinbase2 = __json_array_string(val, 3);
+	sn.bbversion = __json_array_string(val, 5);
+	sn.nbit = __json_array_string(val, 6);
+	sn.ntime = __json_array_string(val, 7);
+	sn.clean = json_is_true(json_array_get(val, 8));
+
+	if (!sn.prev_hash || !sn.coinbase1 || !sn.coinbase2 || !sn.bbversion || !sn.nbit || !sn.ntime)
+		return false;
+	
+	sn.job_id = __json_array_string(val, 0);
+	return stratum_apply_notify(pool, &sn);
+}
+
+static bool stratum_set_diff(struct pool * const pool, double diff)
+{
 	if (diff == 0)
 		return false;
 
@@ -2200,6 +2632,11 @@ static bool parse_diff(struct pool *pool, json_t *val)
 	return true;
 }
 
+static bool parse_diff(struct pool *pool, json_t *val)
+{
+	return stratum_set_diff(pool, json_number_value(json_array_get(val, 0)));
+}
+
 static bool parse_reconnect(struct pool *pool, json_t *val)
 {
 	if (opt_disable_client_reconnect)
@@ -2240,6 +2677,15 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
 
 	applog(LOG_NOTICE, "Reconnect requested from pool %d to %s", pool->pool_no, address);
 
+	/* The stratum event loop handles every pool, so it must not block
+	 * connecting this one; it restarts the connection on a thread of its
+	 * own. Only the event loop thread touches a connected pool's state. */
+	if (pool->evloop_state == SELS_CONNECTED)
+	{
+		pool->evloop_reconnect = true;
+		return true;
+	}
+
 	if (!restart_stratum(pool))
 		return false;
 
@@ -2292,7 +2738,82 @@ static bool stratum_show_message(struct pool *pool, json_t *val, json_t *params)
 	return true;
 }
 
-bool parse_method(struct pool *pool, char *s)
+/* Handles the hot methods without jansson, decoding straight into the pool.
+ * Returns false if the line needs parse_method_json instead, and otherwise
+ * sets *retp to what that would have returned. Strings get NUL terminated in
+ * place, so s is only left as it was when falling back. */
+static bool parse_method_fast(struct pool * const pool, char * const s, bool * const retp)
+{
+	struct stratum_fastjson fj;
+	struct stratum_notify sn;
+	const char *elem[9], *str[8], *end[8];
+	size_t len;
+	int n, merkles, i;
+
+	if (!stratum_fastjson_scan(&fj, s))
+		return false;
+	if (!fj.method)
+	{
+		*retp = false;
+		return true;
+	}
+	if (fj.error && !fastjson_is(fj.error, "null"))
+		return false;
+	if (!fj.params)
+		return false;
+
+	if (fj.method_len == 13 && !strncasecmp(fj.method, "mining.notify", 13))
+	{
+		n = fastjson_array(fj.params, elem, 9);
+		if (n < 8)
+			return false;
+		for (i = 0; i < 8; ++i)
+			if (i != 4 && !(str[i] = fastjson_string(elem[i], &len, &end[i])))
+				return false;
+		merkles = fastjson_array(elem[4], NULL, 0);
+		if (merkles < 0)
+			return false;
+		const char *merkle[merkles + 1], *merkle_end[merkles + 1];
+		fastjson_array(elem[4], merkle, merkles);
+		for (i = 0; i < merkles; ++i)
+			if (!(merkle[i] = fastjson_string(merkle[i], &len, &merkle_end[i])))
+				return false;
+
+		// Nothing can fail from here on, so terminate the strings over their quotes
+		for (i = 0; i < 8; ++i)
+			if (i != 4)
+				s[end[i] - s - 1] = '\0';
+		for (i = 0; i < merkles; ++i)
+			s[merkle_end[i] - s - 1] = '\0';
+
+		sn = (struct stratum_notify){
+			.job_id = str[0],
+			.prev_hash = str[1],
+			.coinbase1 = str[2],
+			.coinbase2 = str[3],
+			.merkles = merkles,
+			.merkle = merkle,
+			.bbversion = str[5],
+			.nbit = str[6],
+			.ntime = str[7],
+			.clean = (n > 8 && fastjson_is(elem[8], "true")),
+		};
+		pool->stratum_notify = *retp = stratum_apply_notify(pool, &sn);
+		return true;
+	}
+
+	if (fj.method_len == 21 && !strncasecmp(fj.method, "mining.set_difficulty", 21))
+	{
+		if (fastjson_array(fj.params, elem, 1) < 1 || !fastjson_number(elem[0]))
+			return false;
+		*retp = stratum_set_diff(pool, strtod(elem[0], NULL));
+		return true;
+	}
+
+	return false;
+}
+
+static bool parse_method_json(struct pool *pool, char *s)
 {
 	json_t *val = NULL, *method, *err_val, *params;
 	json_error_t err;
@@ -2367,6 +2888,183 @@ out:
 	return ret;
 }
 
+bool parse_method(struct pool *pool, char *s)
+{
+	bool ret;
+
+	if (s && parse_method_fast(pool, s, &ret))
+		return ret;
+	return parse_method_json(pool, s);
+}
+
+static
+bool _test_fastjson_same(const struct pool * const a, const struct pool * const b)
+{
+	const struct stratum_work * const sa = &a->swork, * const sb = &b->swork;
+
+	if (a->stratum_notify != b->stratum_notify || a->submit_old != b->submit_old || sa->clean != sb->clean)
+		return false;
+	if ((!sa->job_id) != (!sb->job_id) || (sa->job_id && strcmp(sa->job_id, sb->job_id)))
+		return false;
+	if (memcmp(sa->header1, sb->header1, sizeof(sa->header1)) || sa->ntime != sb->ntime
+	 || memcmp(sa->diffbits, sb->diffbits, sizeof(sa->diffbits)) || memcmp(sa->target, sb->target, sizeof(sa->target)))
+		return false;
+	if (sa->nonce2_offset != sb->nonce2_offset || sa->merkles != sb->merkles)
+		return false;
+	if (bytes_len(&sa->coinbase) != bytes_len(&sb->coinbase)
+	 || (bytes_len(&sa->coinbase) && memcmp(bytes_buf(&sa->coinbase), bytes_buf(&sb->coinbase), bytes_len(&sa->coinbase))))
+		return false;
+	return !(sa->merkles && memcmp(bytes_buf(&sa->merkle_bin), bytes_buf(&sb->merkle_bin), 32 * sa->merkles));
+}
+
+/* Damages the line a little; the contents of strings are left alone, since
+ * broken hex would only exercise hex2bin (noisily) */
+static
+void _test_fastjson_mutate(char * const line, uint32_t * const rnd)
+{
+	static const char fuzzchars[] = "{}[],:\"\\ 0123456789.-+eEtrufalsn";
+	int n = 1 + (*rnd = *rnd * 1103515245 + 12345) % 3;
+	size_t len, pos, i;
+	bool instr;
+
+	while (n--)
+	{
+		len = strlen(line);
+		if (!len)
+			return;
+		pos = (*rnd = *rnd * 1103515245 + 12345) % len;
+		instr = false;
+		for (i = 0; i < pos; ++i)
+			if (line[i] == '"')
+				instr = !instr;
+		if (instr && line[pos] != '"')
+			continue;
+		switch ((*rnd = *rnd * 1103515245 + 12345) % 4)
+		{
+			case 0:
+				line[pos] = '\0';
+				break;
+			case 1:
+				memmove(&line[pos], &line[pos + 1], len - pos);
+				break;
+			case 2:
+				line[pos] = fuzzchars[(*rnd >> 8) % (sizeof(fuzzchars) - 1)];
+				break;
+			case 3:
+				memmove(&line[pos + 1], &line[pos], len - pos + 1);
+				line[pos] = fuzzchars[(*rnd >> 8) % (sizeof(fuzzchars) - 1)];
+				break;
+		}
+	}
+}
+
+void test_stratum_fastjson()
+{
+	static const char * const notify =
+	    "{\"params\": [\"bf\", \"4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000\", "
+	    "\"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008\", "
+	    "\"072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000\", "
+	    "[\"2a1f0b3c8d9e4f5061728394a5b6c7d8e9f00112233445566778899aabbccddee\", \"00112233445566778899aabbccddeeff00112233445566778899aabbccddeeff\"], "
+	    "\"00000002\", \"1c2ac4af\", \"504e86b9\", %s], \"id\": null, \"method\": \"%s\"%s}";
+	// The first of these must all be handled without jansson
+	static const int fast_samples = 9;
+	static const char * const samples[] = {
+		"{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [32]}",
+		"{\"id\":null,\"method\":\"mining.set_difficulty\",\"params\":[0.5]}",
+		"{\"params\": [1e3], \"method\": \"mining.set_difficulty\", \"error\": null}",
+		"{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [0]}",
+		"{\"id\": 4, \"result\": true, \"error\": null}",
+		"{\"id\": 5, \"result\": null, \"error\": [21, \"Job not found\", null]}",
+		NULL,  // notify, clean
+		NULL,  // notify, not clean
+		NULL,  // notify, method in another case
+		NULL,  // notify, job id with an escape
+		NULL,  // notify, with an error
+		"{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [\"32\"]}",
+		"{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [12345678901234567890]}",
+		"{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": []}",
+		"{\"id\": null, \"method\": \"mining.set_difficulty\"}",
+		"{\"id\": null, \"method\": null, \"params\": [2]}",
+		"{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"bf\", \"00\", 1]}",
+		"{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [2], \"x\": {\"y\": [true, false, {}]}}",
+		"{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [2], \"x\": \"caf\xc3\xa9\"}",
+		"{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [2], \"x\": \"caf\xc3\x28\"}",
+		"{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [2], \"x\xff\": 1}",
+		"{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [2]} x",
+		"[\"mining.set_difficulty\", 2]",
+	};
+	const int sample_count = sizeof(samples) / sizeof(*samples);
+	char *sample[sample_count];
+	struct pool * const pa = calloc(1, sizeof(*pa)), * const pb = calloc(1, sizeof(*pb));
+	struct pool *pool;
+	char line[0x800], linefast[0x800], orig[0x800];
+	uint32_t rnd = 0x5eed;
+	bool ret, reta, retb;
+	int i, j;
+
+	for (i = 0; i < sample_count; ++i)
+		sample[i] = (char *)samples[i];
+	sample[6] = malloc(0x800);
+	sprintf(sample[6], notify, "true", "mining.notify", "");
+	sample[7] = malloc(0x800);
+	sprintf(sample[7], notify, "false", "mining.notify", "");
+	sample[8] = malloc(0x800);
+	sprintf(sample[8], notify, "false", "Mining.Notify", "");
+	sample[9] = malloc(0x800);
+	sprintf(sample[9], notify, "false", "mining.notify", "");
+	memcpy(strstr(sample[9], "\"bf\""), "\"\\/\"", 4);
+	sample[10] = malloc(0x800);
+	sprintf(sample[10], notify, "true", "mining.notify", ", \"error\": [20, \"Other\", null]");
+
+	for (j = 0; j < 2; ++j)
+	{
+		pool = j ? pb : pa;
+		cglock_init(&pool->data_lock);
+		pool->swork.data_lock_p = &pool->data_lock;
+		pool->nonce1 = refstr_dup("f8002c90");
+		pool->n1_len = 4;
+		pool->n2size = 4;
+	}
+
+	for (i = 0; i < sample_count; ++i)
+		for (j = 0; j < 0x100; ++j)
+		{
+			strcpy(orig, sample[i]);
+			if (j)
+				_test_fastjson_mutate(orig, &rnd);
+			strcpy(line, orig);
+			strcpy(linefast, orig);
+			reta = parse_method_json(pa, line);
+			retb = parse_method(pb, linefast);
+			if (reta != retb || !_test_fastjson_same(pa, pb))
+			{
+				applog(LOG_ERR, "Stratum fast JSON test failed: sample %d mutation %d: %s", i, j, orig);
+				break;
+			}
+		}
+
+	for (i = 0; i < fast_samples; ++i)
+	{
+		strcpy(line, sample[i]);
+		if (!parse_method_fast(pb, line, &ret))
+			applog(LOG_ERR, "Stratum fast JSON test failed: sample %d needed jansson", i);
+	}
+
+	for (j = 0; j < 2; ++j)
+	{
+		pool = j ? pb : pa;
+		refstr_unref(pool->swork.job_id);
+		refstr_unref(pool->nonce1);
+		bytes_free(&pool->swork.coinbase);
+		bytes_free(&pool->swork.merkle_bin);
+		bytes_free(&pool->swork.merkle_words);
+		bytes_free(&pool->swork.coinbase_tail);
+		free(pool);
+	}
+	for (i = 6; i <= 10; ++i)
+		free(sample[i]);
+}
+
 extern bool parse_stratum_response(struct pool *, char *s);
 
 bool auth_stratum(struct pool *pool)
@@ -2384,17 +3082,14 @@ bool auth_stratum(struct pool *pool)
 
 	/* Parse all data in the queue and anything left should be auth */
 	while (42) {
-		sret = recv_line(pool);
+		sret = _recv_line(pool, NULL);
 		if (!sret)
 			goto out;
-		if (parse_method(pool, sret))
-			free(sret);
-		else
+		if (!parse_method(pool, sret))
 			break;
 	}
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
@@ -2452,9 +3147,6 @@ static bool setup_stratum_curl(struct pool *pool)
 	pool->stratum_curl = curl_easy_init();
 	if (unlikely(!pool->stratum_curl))
 		quithere(1, "Failed to curl_easy_init");
-	if (pool->sockbuf)
-		pool->sockbuf[0] = '\0';
-
 	curl = pool->stratum_curl;
 
 	if (!pool->sockbuf) {
@@ -2463,6 +3155,7 @@ static bool setup_stratum_curl(struct pool *pool)
 			quithere(1, "Failed to calloc pool sockbuf");
 		pool->sockbuf_size = RBUFSIZE;
 	}
+	clear_sockbuf(pool);
 
 	curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
 	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30);
@@ -2626,12 +3319,11 @@ resend:
 		goto out;
 	}
 
-	sret = recv_line(pool);
+	sret = _recv_line(pool, NULL);
 	if (!sret)
 		goto out;
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -2676,9 +3368,10 @@ resend:
 	cg_wlock(&pool->data_lock);
 	free(pool->sessionid);
 	pool->sessionid = sessionid;
-	free(pool->nonce1);
-	pool->nonce1 = nonce1;
+	refstr_unref(pool->nonce1);
+	pool->nonce1 = refstr_dup(nonce1);
 	pool->n1_len = strlen(nonce1) / 2;
+	free(nonce1);
 	pool->n2size = n2size;
 	pool->nonce2sz  = (n2size > sizeof(pool->nonce2)) ? sizeof(pool->nonce2) : n2size;
 #ifdef WORDS_BIGENDIAN
@@ -2877,6 +3570,7 @@ struct bfgtls_data {
 #ifdef NEED_BFG_LOWL_VCOM
 	struct detectone_meta_info_t __detectone_meta_info;
 #endif
+	struct work_cache __work_cache;
 };
 
 static
@@ -2900,6 +3594,7 @@ struct bfgtls_data *get_bfgtls()
 	};
 	if (pthread_setspecific(key_bfgtls, bfgtls))
 		quithere(1, "pthread_setspecific failed");
+	work_cache_register(&bfgtls->__work_cache);
 	
 	return bfgtls;
 }
@@ -2908,6 +3603,7 @@ static
 void bfgtls_free(void * const p)
 {
 	struct bfgtls_data * const bfgtls = p;
+	work_cache_release(&bfgtls->__work_cache);
 	free(bfgtls->bfg_strerror_result);
 #ifdef WIN32
 	if (bfgtls->bfg_strerror_socketresult)
@@ -2923,6 +3619,11 @@ struct detectone_meta_info_t *_detectone_meta_info()
 }
 #endif
 
+struct work_cache *_bfg_work_cache(void)
+{
+	return &get_bfgtls()->__work_cache;
+}
+
 void bfg_init_threadlocal()
 {
 	if (pthread_key_create(&key_bfgtls, bfgtls_free))
@@ -3195,6 +3896,48 @@ char *trimmed_strdup(const char *s)
 	return c;
 }
 
+/* Reference counted strings, so works can share their job_id and nonce1 with
+ * the stratum job instead of copying them; the count lives right before the
+ * characters, so they can be used as plain C strings.  Counts are updated
+ * atomically, since every work made and freed touches them */
+struct refstr {
+	unsigned int refcount;
+	char s[];
+};
+
+#define refstr_of(p)  ((struct refstr *)((p) - offsetof(struct refstr, s)))
+
+char *refstr_dup(const char * const s)
+{
+	if (!s)
+		return NULL;
+	const size_t sz = strlen(s) + 1;
+	struct refstr * const rs = malloc(sizeof(*rs) + sz);
+	if (unlikely(!rs))
+		quithere(1, "Failed to malloc refstr");
+	rs->refcount = 1;
+	memcpy(rs->s, s, sz);
+	return rs->s;
+}
+
+char *refstr_ref(const char * const s)
+{
+	if (!s)
+		return NULL;
+	struct refstr * const rs = refstr_of(s);
+	__sync_fetch_and_add(&rs->refcount, 1);
+	return rs->s;
+}
+
+void refstr_unref(char * const s)
+{
+	if (!s)
+		return;
+	struct refstr * const rs = refstr_of(s);
+	if (!__sync_sub_and_fetch(&rs->refcount, 1))
+		free(rs);
+}
+
 
 void *cmd_thread(void *cmdp)
 {
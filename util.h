@@ -118,6 +118,8 @@ extern const char *get_registered_domain(size_t *out_len, const char *, size_t l
 extern const char *extract_domain(size_t *out_len, const char *uri, size_t urilen);
 extern bool match_domains(const char *a, size_t alen, const char *b, size_t blen);
 extern void test_domain_funcs();
+extern void test_stratum_line_reader();
+extern void test_stratum_fastjson();
 
 
 enum bfg_gpio_value {
@@ -186,7 +188,22 @@ double tdiff(struct timeval *end, struct timeval *start);
 bool _stratum_send(struct pool *pool, char *s, ssize_t len, bool force);
 #define stratum_send(pool, s, len)  _stratum_send(pool, s, len, false)
 bool sock_full(struct pool *pool);
+char *_recv_line(struct pool *pool, size_t *lenp);
 char *recv_line(struct pool *pool);
+char *recv_line_nowait(struct pool *pool, size_t *lenp, bool *closedp);
+struct stratum_fastjson {
+	const char *method;
+	size_t method_len;
+	const char *params;
+	const char *id;
+	const char *result;
+	const char *error;
+};
+extern bool stratum_fastjson_scan(struct stratum_fastjson *, const char *);
+extern const char *fastjson_ws(const char *);
+extern const char *fastjson_string(const char *, size_t *lenp, const char **endp);
+extern bool fastjson_is(const char *, const char *literal);
+extern bool fastjson_int(const char *, long long *);
 bool parse_method(struct pool *pool, char *s);
 bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port);
 bool auth_stratum(struct pool *pool);
@@ -529,6 +546,10 @@ void maybe_strdup_if_null(const char **p, const char *s)
 
 extern char *trimmed_strdup(const char *);
 
+extern char *refstr_dup(const char *);
+extern char *refstr_ref(const char *);
+extern void refstr_unref(char *);
+
 
 extern void run_cmd(const char *cmd);
 